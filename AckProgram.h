@@ -0,0 +1,187 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef AckProgram_h
+#define AckProgram_h
+#include <Arduino.h>
+#include "FSH.h"
+
+/* Programs for the ack manager, which runs them on the programming track.
+ *  
+ * A program is written as a list of steps, and assembled into flash at 
+ * compile time by ACK_PROGRAM, which rejects a malformed program with a 
+ * static_assert. Steps are opcodes, or {opcode,operand} for the SETx opcodes 
+ * that take one. ITSKIP takes no operand: it is assembled with the offset 
+ * of the next SKIPTARGET, so nothing is scanned at run time.
+ *  
+ *  ACK_PROGRAM(MY_PROG,
+ *     BASELINE,
+ *     {SETCV,29}, {SETBIT,5},
+ *     V1, WACK, ITC1,
+ *     _FAIL);
+ *  
+ * A program runs with DCC::runAckProgram. The checks are:
+ *   - known opcodes, and operands where needed: CV 1-1024, bit 0-7, byte 0-255
+ *   - BASELINE first and only first
+ *   - WACK straight after each packet (W0,W1,WB,V0,V1,VB) and nowhere else
+ *   - no ack test (ITCx, NAKFAIL, MERGE, ITSKIP) before the first WACK
+ *   - a SKIPTARGET after each ITSKIP, within 255 bytes
+ *   - _FAIL last, so that a program always calls back
+ */
+
+enum ackOp : byte
+{           // Program opcodes for the ack Manager
+  BASELINE, // ensure enough resets sent before starting and obtain baseline current
+  W0,
+  W1,               // issue write bit (0..1) packet
+  WB,               // issue write byte packet
+  VB,               // Issue validate Byte packet
+  V0,               // Issue validate bit=0 packet
+  V1,               // issue validate bit=1 packlet
+  WACK,             // wait for ack (or absence of ack)
+  ITC1,             // If True Callback(1)  (if prevous WACK got an ACK)
+  ITC0,             // If True callback(0);
+  ITCB,             // If True callback(byte)
+  ITCB7,            // If True callback(byte &0x7F)
+  NAKFAIL,          // if false callback(-1)
+  _FAIL,             // callback(-1) -- RM 2021-04-22
+  STARTMERGE,       // Clear bit and byte settings ready for merge pass
+  MERGE,            // Merge previous wack response with byte value and decrement bit number (use for readimng CV bytes)
+  SETBIT,           // sets bit number to operand
+  SETCV,            // sets cv number to operand (2 bytes, low first)
+  SETBYTE,          // sets current byte to operand
+  SETBYTEH,         // sets current byte to word high byte
+  SETBYTEL,         // sets current byte to word low byte
+  STASHLOCOID,      // keeps current byte value for later
+  COMBINELOCOID,    // combines current value with stashed value and returns it
+  ITSKIP,           // skip to SKIPTARGET if ack true (operand: offset past itself)
+  SKIPTARGET = 0xFF // jump to target
+};
+
+struct AckStep {
+  ackOp op;
+  int operand;   // -1 for none
+  constexpr AckStep(ackOp op, int operand=-1) : op(op), operand(operand) {}
+};
+
+// Assembly. Recursive, as constexpr functions must be in C++11.
+
+constexpr byte ackStepSize(const AckStep & s) {
+  return s.op==SETCV ? 3 : (s.op==SETBIT || s.op==SETBYTE || s.op==ITSKIP) ? 2 : 1;
+}
+
+// Position in the code of step
+constexpr size_t ackCodePos(const AckStep * s, size_t step) {
+  return step==0 ? 0 : ackCodePos(s, step-1) + ackStepSize(s[step-1]);
+}
+
+// Step of the first SKIPTARGET from step, n if none
+constexpr size_t ackSkipTarget(const AckStep * s, size_t n, size_t step) {
+  return step>=n ? n : s[step].op==SKIPTARGET ? step : ackSkipTarget(s, n, step+1);
+}
+
+constexpr size_t ackSkipOffset(const AckStep * s, size_t n, size_t step) {
+  return ackCodePos(s, ackSkipTarget(s, n, step+1)) - ackCodePos(s, step) - 2;
+}
+
+// Byte b of the code for step
+constexpr ackOp ackStepByte(const AckStep * s, size_t n, size_t step, size_t b) {
+  return b==0 ? s[step].op
+       : s[step].op==ITSKIP ? (ackOp)ackSkipOffset(s, n, step)
+       : b==1 ? (ackOp)(s[step].operand & 0xFF)
+       : (ackOp)(s[step].operand >> 8);
+}
+
+constexpr ackOp ackCodeByte(const AckStep * s, size_t n, size_t out, size_t step=0, size_t pos=0) {
+  return out < pos + ackStepSize(s[step]) ? ackStepByte(s, n, step, out-pos)
+       : ackCodeByte(s, n, out, step+1, pos + ackStepSize(s[step]));
+}
+
+template<size_t N> struct AckCode {
+  ackOp code[N];
+};
+template<size_t... I> struct AckIndices {};
+template<size_t N, size_t... I> struct AckIndexSequence : AckIndexSequence<N-1, N-1, I...> {};
+template<size_t... I> struct AckIndexSequence<0, I...> : AckIndices<I...> {};
+
+template<size_t... I>
+constexpr AckCode<sizeof...(I)> ackAssemble(const AckStep * s, size_t n, AckIndices<I...>) {
+  return AckCode<sizeof...(I)>{{ ackCodeByte(s, n, I)... }};
+}
+
+// Checks
+
+constexpr bool ackIsPacket(ackOp op) {
+  return op==W0 || op==W1 || op==WB || op==VB || op==V0 || op==V1;
+}
+
+constexpr bool ackIsTest(ackOp op) {
+  return op==ITC1 || op==ITC0 || op==ITCB || op==ITCB7 || op==NAKFAIL || op==MERGE || op==ITSKIP;
+}
+
+constexpr bool ackStepValid(const AckStep & s) {
+  return !(s.op<=ITSKIP || s.op==SKIPTARGET) ? false
+       : s.op==SETCV ? s.operand>=1 && s.operand<=1024
+       : s.op==SETBIT ? s.operand>=0 && s.operand<=7
+       : s.op==SETBYTE ? s.operand>=0 && s.operand<=255
+       : s.operand==-1;
+}
+
+constexpr bool ackStepsValid(const AckStep * s, size_t n, size_t i=0) {
+  return i>=n || (ackStepValid(s[i]) && ackStepsValid(s, n, i+1));
+}
+
+constexpr bool ackBaselineFirst(const AckStep * s, size_t n, size_t i=0) {
+  return i>=n || ((s[i].op==BASELINE)==(i==0) && ackBaselineFirst(s, n, i+1));
+}
+
+constexpr bool ackEndsWithFail(const AckStep * s, size_t n) {
+  return n>0 && s[n-1].op==_FAIL;
+}
+
+constexpr bool ackPacketsWaited(const AckStep * s, size_t n, size_t i=0) {
+  return i>=n || ((!ackIsPacket(s[i].op) || (i+1<n && s[i+1].op==WACK))
+                  && (s[i].op!=WACK || (i>0 && ackIsPacket(s[i-1].op)))
+                  && ackPacketsWaited(s, n, i+1));
+}
+
+constexpr bool ackTestsWaited(const AckStep * s, size_t n, size_t i=0, bool waited=false) {
+  return i>=n || ((!ackIsTest(s[i].op) || waited) && ackTestsWaited(s, n, i+1, waited || s[i].op==WACK));
+}
+
+constexpr bool ackSkipsResolved(const AckStep * s, size_t n, size_t i=0) {
+  return i>=n || ((s[i].op!=ITSKIP || (ackSkipTarget(s, n, i+1)<n && ackSkipOffset(s, n, i)<=255))
+                  && ackSkipsResolved(s, n, i+1));
+}
+
+#define ACK_STEPS(name) name##_STEPS, (sizeof(name##_STEPS)/sizeof(name##_STEPS[0]))
+
+// Defines name as a pointer to the assembled program in flash
+#define ACK_PROGRAM(name, ...) \
+  constexpr AckStep name##_STEPS[] = { __VA_ARGS__ }; \
+  static_assert(ackStepsValid(ACK_STEPS(name)), #name ": unknown opcode, or missing, unexpected or out of range operand"); \
+  static_assert(ackBaselineFirst(ACK_STEPS(name)), #name ": BASELINE must be first, and only first"); \
+  static_assert(ackEndsWithFail(ACK_STEPS(name)), #name ": _FAIL must be last"); \
+  static_assert(ackPacketsWaited(ACK_STEPS(name)), #name ": WACK must follow each packet, and only a packet"); \
+  static_assert(ackTestsWaited(ACK_STEPS(name)), #name ": ack tested before any WACK"); \
+  static_assert(ackSkipsResolved(ACK_STEPS(name)), #name ": ITSKIP without a SKIPTARGET within 255 bytes after it"); \
+  constexpr AckCode<ackCodePos(ACK_STEPS(name))> FLASH name##_CODE = \
+      ackAssemble(ACK_STEPS(name), AckIndexSequence<ackCodePos(ACK_STEPS(name))>()); \
+  const ackOp * const name = name##_CODE.code
+
+#endif
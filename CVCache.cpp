@@ -0,0 +1,176 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**********************************************************************
+
+The CV cache remembers the values read from, verified on or written to
+decoders on the programming track. A CV read first verifies the cached
+value with a single verify byte packet, and only reads bit by bit if the
+decoder does not acknowledge it. A verify cannot return a wrong value, so
+a stale or mistaken guess only costs the time of that one packet.
+
+Values are keyed by the identity of the decoder: its manufacturer (CV8),
+version (CV7) and short address (CV1), which every decoder has. These are
+learned from the results of reads and writes of those CVs, as DecoderPro
+does at the start of a session, and are assumed to stay the same until a
+result shows otherwise. Until all three are known, only they are guessed.
+
+The cache follows the loco flags in EEPROM, behind its own header, and is
+stored when the programming track job queue empties with something new.
+When the cache is full the oldest entry is replaced.
+
+**********************************************************************/
+
+#include "CVCache.h"
+#include "EEStore.h"
+
+#define CVCACHE_ID "CC"
+
+struct CVCacheHeader {
+  char id[sizeof(CVCACHE_ID)];
+  int nEntries;
+};
+
+const int CVCache::identityCv[IDENTITY_CVS]={8,7,1};
+
+int CVCache::identityIndex(int cv) {
+  for (byte i=0;i<IDENTITY_CVS;i++) if (identityCv[i]==cv) return i;
+  return -1;
+}
+
+uint16_t CVCache::decoderKey() {
+  return ((uint16_t)identity[0]<<8 | identity[1]) ^ ((uint16_t)identity[2]*251);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool CVCache::get(int cv, byte & value) {
+  int id=identityIndex(cv);
+  if (id>=0) {
+    if (!bitRead(identityKnown,id)) return false;
+    value=identity[id];
+    return true;
+  }
+  if (identityKnown!=(1<<IDENTITY_CVS)-1) return false;
+  uint16_t key=decoderKey();
+  for (byte i=0;i<count;i++) {
+    if (entries[i].decoder==key && entries[i].cv==cv) {
+      value=entries[i].value;
+      return true;
+    }
+  }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void CVCache::put(int cv, byte value) {
+  int id=identityIndex(cv);
+  if (id>=0) {
+    identity[id]=value;
+    bitSet(identityKnown,id);
+    return;
+  }
+  if (identityKnown!=(1<<IDENTITY_CVS)-1) return;
+  uint16_t key=decoderKey();
+  for (byte i=0;i<count;i++) {
+    if (entries[i].decoder==key && entries[i].cv==cv) {
+      if (entries[i].value!=value) dirty=true;
+      entries[i].value=value;
+      return;
+    }
+  }
+  CVCacheEntry & entry=entries[nextSlot];
+  entry.decoder=key;
+  entry.cv=cv;
+  entry.value=value;
+  nextSlot=(nextSlot+1)%CV_CACHE_SIZE;
+  if (count<CV_CACHE_SIZE) count++;
+  dirty=true;
+}
+
+void CVCache::putBit(int cv, byte bitNum, bool on) {
+  byte value;
+  if (!get(cv,value)) return;
+  bitWrite(value,bitNum,on);
+  put(cv,value);
+}
+
+void CVCache::forgetDecoder() {
+  identityKnown=0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void CVCache::flush() {
+  if (!dirty) return;
+  EEStore::store();
+}
+
+void CVCache::load(){
+  struct CVCacheHeader header;
+  EEPROM.get(EEStore::pointer(),header);
+  if (strncmp(header.id,CVCACHE_ID,sizeof(CVCACHE_ID))!=0) return;
+  EEStore::advance(sizeof(header));
+
+  count=0;
+  for(int i=0;i<header.nEntries && i<CV_CACHE_SIZE;i++){
+    EEPROM.get(EEStore::pointer(),entries[i]);
+    EEStore::advance(sizeof(entries[i]));
+    count++;
+  }
+  nextSlot=count%CV_CACHE_SIZE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void CVCache::store(){
+  struct CVCacheHeader header;
+  strncpy(header.id,CVCACHE_ID,sizeof(CVCACHE_ID));
+  header.nEntries=count;
+  EEPROM.put(EEStore::pointer(),header);
+  EEStore::advance(sizeof(header));
+  for(byte i=0;i<count;i++){
+    EEPROM.put(EEStore::pointer(),entries[i]);
+    EEStore::advance(sizeof(entries[i]));
+  }
+  dirty=false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Forget everything, used when the whole store is cleared
+void CVCache::clear(){
+  count=0;
+  nextSlot=0;
+  identityKnown=0;
+  dirty=false;
+  struct CVCacheHeader header;
+  strncpy(header.id,CVCACHE_ID,sizeof(CVCACHE_ID));
+  header.nEntries=0;
+  EEPROM.put(EEStore::pointer(),header);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+byte CVCache::identity[IDENTITY_CVS];
+byte CVCache::identityKnown=0;
+CVCacheEntry CVCache::entries[CV_CACHE_SIZE];
+byte CVCache::count=0;
+byte CVCache::nextSlot=0;
+bool CVCache::dirty=false;
@@ -0,0 +1,60 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef CVCache_h
+#define CVCache_h
+
+#include <Arduino.h>
+
+// CV values last seen per decoder, so a read can start by verifying a guess
+#ifdef ARDUINO_AVR_UNO
+const byte CV_CACHE_SIZE=8;
+#else
+const byte CV_CACHE_SIZE=64;
+#endif
+
+struct CVCacheEntry {
+  uint16_t decoder;   // key of CV8, CV7 and CV1
+  int cv;
+  byte value;
+};
+
+class CVCache {
+  public:
+  static bool get(int cv, byte & value);   // a guess for the decoder on the prog track
+  static void put(int cv, byte value);     // a value read, verified or written
+  static void putBit(int cv, byte bitNum, bool on);
+  static void forgetDecoder();             // its address is changing
+  static void flush();                     // store to EEPROM if changed
+  static void load();
+  static void store();
+  static void clear();
+  private:
+  static const byte IDENTITY_CVS=3;
+  static const int identityCv[IDENTITY_CVS];
+  static byte identity[IDENTITY_CVS];
+  static byte identityKnown;               // bit per identityCv
+  static int identityIndex(int cv);
+  static uint16_t decoderKey();
+  static CVCacheEntry entries[CV_CACHE_SIZE];
+  static byte count;
+  static byte nextSlot;
+  static bool dirty;
+}; // CVCache
+
+#endif
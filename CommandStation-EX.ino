@@ -85,6 +85,8 @@ void setup()
   //  detailed pin mappings and may also require modified subclasses of the MotorDriver to implement specialist logic.
 
   // STANDARD_MOTOR_SHIELD, POLOLU_MOTOR_SHIELD, FIREBOX_MK1, FIREBOX_MK1S are pre defined in MotorShields.h
+  // Booster districts with their own motor driver may be added before DCC::begin, eg
+  //   DCCWaveform::addDistrict(new MotorDriver(4, 5, 6, UNUSED_PIN, A5, 41.54, 5000, UNUSED_PIN));
 
   DIAG(F("@@@ DCC begin")); 
   DCC::begin(MOTOR_SHIELD_TYPE); 
@@ -0,0 +1,165 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**********************************************************************
+
+A consist is driven through its own address, with <t> or from a WiThrottle,
+exactly as if it were a loco.
+
+  <C ID LOCO1 LOCO2 ...>        creates a consist that the command station runs by
+                                sending each speed change to every member loco.
+                                Works with any decoder. 
+  <C ID CV19 LOCO1 LOCO2 ...>   creates an advanced consist. Each member has CV19 
+                                written on the main so that it answers to the consist 
+                                address ID (1-127), and one packet moves the whole consist.
+  <C ID>                        dissolves the consist (clearing CV19 if advanced)
+  <C>                           lists consists as <C ID ADVANCED LOCO1 LOCO2 ...>
+
+A negative loco address means that loco runs reversed within the consist. 
+A loco may only be in one consist. Functions for a consist address are sent to 
+the lead (first) loco unless the consist is advanced, when they go to the consist 
+address like any other loco.
+
+Consists are not stored in EEPROM, advanced consists are remembered by the decoders.
+
+**********************************************************************/
+
+#include "Consists.h"
+#include "DCC.h"
+#include "StringFormatter.h"
+
+const int CONSIST_CV=19;
+const byte CONSIST_REVERSED=0x80;   // CV19 bit 7, direction reversed in the consist
+
+Consist *Consist::find(int id) {
+  Consist *tt;
+  for(tt=firstConsist;tt!=NULL && tt->data.id!=id;tt=tt->nextConsist);
+  return tt;
+}
+
+// Returns the consist for this address, or NULL if it is not a consist
+Consist *Consist::get(int id) {
+  Consist *tt=find(id);
+  return (tt && !tt->dissolving) ? tt : NULL;
+}
+
+Consist *Consist::findMember(int cab) {
+  for (Consist *tt=firstConsist;tt!=NULL;tt=tt->nextConsist) {
+    if (tt->dissolving) continue;
+    for (byte i=0;i<tt->data.nLocos;i++)
+      if (abs(tt->data.locos[i])==cab) return tt;
+  }
+  return NULL;
+}
+
+// True if this loco takes its speed from an advanced consist address
+bool Consist::isAdvancedMember(int cab) {
+  Consist *tt=findMember(cab);
+  return tt && tt->data.advanced;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Returns false if the consist is not valid or cannot be allocated
+bool Consist::create(int id, bool advanced, byte nLocos, const int16_t locos[]) {
+  if (id<=0 || nLocos==0 || nLocos>MAX_CONSIST_LOCOS) return false;
+  if (advanced && id>127) return false;  // CV19 holds a short address
+  if (find(id) || findMember(id)) return false;
+  for (byte i=0;i<nLocos;i++) {
+    int cab=abs(locos[i]);
+    if (cab==0 || cab==id || find(cab) || findMember(cab)) return false;
+    for (byte j=0;j<i;j++) if (abs(locos[j])==cab) return false;
+  }
+
+  Consist *tt=(Consist *)calloc(1,sizeof(Consist));
+  if (tt==NULL) return false;
+  tt->data.id=id;
+  tt->data.advanced=advanced;
+  tt->data.nLocos=nLocos;
+  for (byte i=0;i<nLocos;i++) tt->data.locos[i]=locos[i];
+  tt->nextConsist=firstConsist;
+  firstConsist=tt;
+
+  if (advanced) {
+    tt->pendingCV19=(1<<nLocos)-1;
+    for (byte i=0;i<nLocos;i++) DCC::setConsisted(abs(locos[i]),true);
+    loop();
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool Consist::remove(int id) {
+  Consist *tt=get(id);
+  if (tt==NULL) return false;
+  if (tt->data.advanced) {
+    // members go back to their own addresses once CV19 is cleared
+    tt->dissolving=true;
+    tt->pendingCV19=(1<<tt->data.nLocos)-1;
+    for (byte i=0;i<tt->data.nLocos;i++) DCC::setConsisted(abs(tt->data.locos[i]),false);
+    loop();
+    return true;
+  }
+  Consist *pp=NULL;
+  for(Consist *qq=firstConsist;qq!=tt;pp=qq,qq=qq->nextConsist);
+  if (pp==NULL) firstConsist=tt->nextConsist;
+  else pp->nextConsist=tt->nextConsist;
+  free(tt);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Send any CV19 writes that the main track queue could not take earlier
+void Consist::loop() {
+  Consist *pp=NULL;
+  Consist *tt=firstConsist;
+  while (tt!=NULL) {
+    for (byte i=0;i<tt->data.nLocos && tt->pendingCV19;i++) {
+      if (!(tt->pendingCV19 & (1<<i))) continue;
+      int cab=tt->data.locos[i];
+      byte value= tt->dissolving ? 0 : (tt->data.id | (cab<0 ? CONSIST_REVERSED : 0));
+      if (!DCC::writeCVByteMain(abs(cab),CONSIST_CV,value)) return; // queue full, try again later
+      tt->pendingCV19 &= ~(1<<i);
+    }
+    Consist *next=tt->nextConsist;
+    if (tt->dissolving && tt->pendingCV19==0) {
+      if (pp==NULL) firstConsist=next;
+      else pp->nextConsist=next;
+      free(tt);
+    }
+    else pp=tt;
+    tt=next;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void Consist::printAll(Print *stream) {
+  for (Consist *tt=firstConsist;tt!=NULL;tt=tt->nextConsist) {
+    if (tt->dissolving) continue;
+    StringFormatter::send(stream, F("<C %d %d"), tt->data.id, tt->data.advanced);
+    for (byte i=0;i<tt->data.nLocos;i++) StringFormatter::send(stream, F(" %d"), tt->data.locos[i]);
+    StringFormatter::send(stream, F(">\n"));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+Consist *Consist::firstConsist=NULL;
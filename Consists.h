@@ -0,0 +1,51 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Consists_h
+#define Consists_h
+
+#include <Arduino.h>
+
+const byte MAX_CONSIST_LOCOS=8;   // limited by the parameters of the <C> command
+
+struct ConsistData {
+  int id;                         // consist address
+  bool advanced;                  // members have CV19 set and respond to the consist address 
+  byte nLocos;
+  int locos[MAX_CONSIST_LOCOS];   // member addresses, negative if running reversed
+};
+
+class Consist {
+  public:
+  static Consist *firstConsist;
+  ConsistData data;
+  Consist *nextConsist;
+  static Consist *get(int id);
+  static bool isAdvancedMember(int cab);
+  static bool create(int id, bool advanced, byte nLocos, const int16_t locos[]);
+  static bool remove(int id);
+  static void loop();
+  static void printAll(Print *);
+  private:
+  byte pendingCV19;               // bit per member whose CV19 write is still to be sent
+  bool dissolving;                // members are having CV19 cleared, then this is freed
+  static Consist *find(int id);
+  static Consist *findMember(int cab);
+}; // Consist
+
+#endif
@@ -21,6 +21,9 @@
 #include "DCC.h"
 #include "DCCWaveform.h"
 #include "EEStore.h"
+#include "LocoFlags.h"
+#include "CVCache.h"
+#include "Consists.h"
 #include "GITHUB_SHA.h"
 #include "version.h"
 #include "FSH.h"
@@ -38,11 +41,50 @@
 //   Obtaining ACKs from the prog track using a function
 //   There are no volatiles here.
 
-const byte FN_GROUP_1=0x01;         
-const byte FN_GROUP_2=0x02;         
-const byte FN_GROUP_3=0x04;         
-const byte FN_GROUP_4=0x08;         
-const byte FN_GROUP_5=0x10;         
+const uint16_t FN_GROUP_1=0x01;         
+const uint16_t FN_GROUP_2=0x02;         
+const uint16_t FN_GROUP_3=0x04;         
+const uint16_t FN_GROUP_4=0x08;         
+const uint16_t FN_GROUP_5=0x10;         
+const uint16_t FN_GROUP_6=0x20;      // F29-F36, the next four groups of eight follow to F61-F68
+const byte     FN_EXPANSION_GROUPS=5;
+const byte     FEATURE_EXPANSION_F29=0xD8;   // 1101 1000, then 0xD9 for F37-F44 ... 0xDC for F61-F68
+
+static inline bool fnState(const byte functions[], byte functionNumber) {
+  return functions[functionNumber/8] & (1<<(functionNumber%8));
+}
+
+static inline void setFnState(byte functions[], byte functionNumber, bool on) {
+  if (on) functions[functionNumber/8] |= 1<<(functionNumber%8);
+  else    functions[functionNumber/8] &= ~(1<<(functionNumber%8));
+}
+
+// The eight function states from first upwards, first in bit 0
+static byte fnBits(const byte functions[], byte first) {
+  byte i=first/8;
+  uint16_t w=functions[i];
+  if (i+1<FN_BYTES) w |= functions[i+1]<<8;
+  return (byte)(w>>(first%8));
+}
+
+// Kinds of instruction for which only the latest waiting packet per loco matters. 
+// Function groups use their instruction byte as the kind.
+// A combined RCN-212 reminder is a speed packet, so a new speed supersedes it.
+const uint16_t SUPERSEDE_SPEED=0x0001;
+const uint16_t SUPERSEDE_BINARY_STATE=0x4000;  // | function number
+const uint16_t SUPERSEDE_POM_BYTE=0x8000;      // | cv
+
+// Reminder timing is kept in 16mS ticks so that a loco entry needs only 16 bit 
+// timestamps. Ages are clamped well short of wrap around.
+const byte     REMINDER_TICK_SHIFT=4;
+const uint16_t REMINDER_AGE_LIMIT=0x7FFF;
+const uint16_t REMINDER_RECENT_TICKS=10000>>REMINDER_TICK_SHIFT;   // 10 seconds since last change
+const unsigned int REMINDER_MAX_INTERVAL=4000;                      // mS default guaranteed refresh
+const unsigned int EVICT_AGE=300;                                   // seconds a stopped loco must be untouched before eviction
+
+static inline uint16_t reminderTicks() {
+  return (uint16_t)(millis()>>REMINDER_TICK_SHIFT);
+}
 
 FSH* DCC::shieldName=NULL;
 byte DCC::joinRelay=UNUSED_PIN;
@@ -72,18 +114,32 @@ void DCC::setJoinRelayPin(byte joinRelayPin) {
 }
 
 void DCC::setThrottle( uint16_t cab, uint8_t tSpeed, bool tDirection)  {
+  Consist * consist=Consist::get(cab);
+  if (consist && !consist->data.advanced) {
+    // the command station runs this consist, so every member gets the change
+    for (byte i=0; i<consist->data.nLocos; i++) {
+      int member=consist->data.locos[i];
+      setThrottle(abs(member), tSpeed, tDirection ^ (member<0));
+    }
+    return;
+  }
   byte speedCode = (tSpeed & 0x7F)  + tDirection * 128; 
   setThrottle2(cab, speedCode);
   // retain speed for loco reminders
   updateLocoReminder(cab, speedCode );
 }
 
-void DCC::setThrottle2( uint16_t cab, byte speedCode)  {
-
-  uint8_t b[4];
-  uint8_t nB = 0;
+void DCC::setThrottle2( uint16_t cab, byte speedCode, PACKET_PRIORITY priority)  {
   // DIAG(F("setSpeedInternal %d %x"),cab,speedCode);
-  
+  byte b[4];
+  byte nB=buildSpeedPacket(b, cab, speedCode);
+  if ((speedCode & 0x7F) == 1) priority=PACKET_PRIORITY::ESTOP;
+  DCCWaveform::mainTrack.schedulePacket(b, nB, 0, priority, supersedeKey(SUPERSEDE_SPEED, cab));
+}
+
+// Fills b with the speed packet (without checksum) and returns its length
+byte DCC::buildSpeedPacket(byte b[], uint16_t cab, byte speedCode) {
+  byte nB = 0;
   if (cab > 127)
     b[nB++] = highByte(cab) | 0xC0;    // convert train number into a two-byte address
   b[nB++] = lowByte(cab);
@@ -115,11 +171,16 @@ void DCC::setThrottle2( uint16_t cab, byte speedCode)  {
     b[nB++] = speedCode; // for encoding see setThrottle
 
   }
+  return nB;
+}
 
-  DCCWaveform::mainTrack.schedulePacket(b, nB, 0);
+void DCC::setGlobalSpeedsteps(byte s) {
+  globalSpeedsteps = s;
+  // cached speed reminders were encoded for the old speed steps
+  for (int reg=nextLoco(0); reg>=0; reg=nextLoco(reg+1)) forgetSpeedReminder(reg);
 }
 
-void DCC::setFunctionInternal(int cab, byte byte1, byte byte2) {
+void DCC::setFunctionInternal(int cab, byte byte1, byte byte2, PACKET_PRIORITY priority) {
   // DIAG(F("setFunctionInternal %d %x %x"),cab,byte1,byte2);
   byte b[4];
   byte nB = 0;
@@ -130,26 +191,46 @@ void DCC::setFunctionInternal(int cab, byte byte1, byte byte2) {
   if (byte1!=0) b[nB++] = byte1;
   b[nB++] = byte2;
 
-  DCCWaveform::mainTrack.schedulePacket(b, nB, 3);     // send packet 3 times
+  // F0-F4 is 100x xxxx, F5-F8 1011 xxxx, F9-F12 1010 xxxx, two byte groups by their first byte  
+  uint16_t kind = byte1 ? byte1 : ((byte2 & 0xE0) == 0x80 ? 0x80 : (byte2 & 0xF0));
+  DCCWaveform::mainTrack.schedulePacket(b, nB, 3, priority, supersedeKey(kind, cab));     // send packet 3 times
+}
+
+// A command station consist has no decoder of its own, so it takes its speed, 
+// direction and functions from its lead loco. Returns the address to use.
+int DCC::consistLead(int cab, bool & reversed) {
+  reversed=false;
+  Consist * consist=Consist::get(cab);
+  if (consist==NULL || consist->data.advanced) return cab;
+  int lead=consist->data.locos[0];
+  reversed= lead<0;
+  return abs(lead);
 }
 
+// An unknown loco reports what a new table entry would hold: stopped, forward.
 uint8_t DCC::getThrottleSpeed(int cab) {
-  int reg=lookupSpeedTable(cab);
-  if (reg<0) return -1;
+  bool reversed;
+  cab=consistLead(cab, reversed);
+  int reg=lookupSpeedTable(cab, false);
+  if (reg<0) return 0;
   return speedTable[reg].speedCode & 0x7F;
 }
 
 bool DCC::getThrottleDirection(int cab) {
-  int reg=lookupSpeedTable(cab);
-  if (reg<0) return false ;
-  return (speedTable[reg].speedCode & 0x80) !=0;
+  bool reversed;
+  cab=consistLead(cab, reversed);
+  int reg=lookupSpeedTable(cab, false);
+  if (reg<0) return !reversed;
+  return ((speedTable[reg].speedCode & 0x80) !=0) ^ reversed;
 }
 
 // Set function to value on or off
 void DCC::setFn( int cab, byte functionNumber, bool on) {
   if (cab<=0 ) return;
+  bool reversed;
+  cab=consistLead(cab, reversed);
   
-  if (functionNumber>28) { 
+  if (functionNumber>MAX_LOCO_FUNCTION) { 
     //non reminding advanced binary bit set 
     byte b[5];
     byte nB = 0;
@@ -165,23 +246,14 @@ void DCC::setFn( int cab, byte functionNumber, bool on) {
        b[nB++] = (functionNumber & 0x7F) | (on ? 0x80 : 0);  // low order bits and state flag
        b[nB++] = functionNumber >>8 ;  // high order bits
     }
-    DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+    DCCWaveform::mainTrack.schedulePacket(b, nB, 4, PACKET_PRIORITY::FUNCTION,
+                                          supersedeKey(SUPERSEDE_BINARY_STATE | functionNumber, cab));
     return;
   }
   
   int reg = lookupSpeedTable(cab);
   if (reg<0) return;  
-
-  // Take care of functions:
-  // Set state of function
-  unsigned long funcmask = (1UL<<functionNumber);
-  if (on) {
-      speedTable[reg].functions |= funcmask;
-  } else {
-      speedTable[reg].functions &= ~funcmask;
-  }
-  updateGroupflags(speedTable[reg].groupFlags, functionNumber);
-  return;
+  changeFunction(reg, functionNumber, on);
 }
 
 // Change function according to how button was pressed,
@@ -189,74 +261,96 @@ void DCC::setFn( int cab, byte functionNumber, bool on) {
 // Returns new state or -1 if nothing was changed.
 int DCC::changeFn( int cab, byte functionNumber, bool pressed) {
   int funcstate = -1;
-  if (cab<=0 || functionNumber>28) return funcstate;
+  if (cab<=0 || functionNumber>MAX_LOCO_FUNCTION) return funcstate;
+  bool reversed;
+  cab=consistLead(cab, reversed);
   int reg = lookupSpeedTable(cab);
   if (reg<0) return funcstate;  
 
   // Take care of functions:
   // Imitate how many command stations do it: Button press is
   // toggle but for F2 where it is momentary
-  unsigned long funcmask = (1UL<<functionNumber);
   if (functionNumber == 2) {
       // turn on F2 on press and off again at release of button
-      if (pressed) {
-	  speedTable[reg].functions |= funcmask;
-	  funcstate = 1;
-      } else {
-	  speedTable[reg].functions &= ~funcmask;
-	  funcstate = 0;
-      }
+      funcstate = pressed ? 1 : 0;
   } else {
       // toggle function on press, ignore release
-      if (pressed) {
-        speedTable[reg].functions ^= funcmask;
-      }
-      funcstate = (speedTable[reg].functions & funcmask)? 1 : 0;
+      byte buffer[FN_BYTES];
+      funcstate = fnState(locoFunctions(reg, buffer), functionNumber);
+      if (pressed) funcstate = !funcstate;
   }
-  updateGroupflags(speedTable[reg].groupFlags, functionNumber);
+  changeFunction(reg, functionNumber, funcstate);
   return funcstate;
 }
 
+// Remember a function change and send it now rather than waiting for the 
+// reminder cycle to reach this loco
+void DCC::changeFunction(int reg, byte functionNumber, bool on) {
+  LOCO & loco=speedTable[reg];
+  bool remembered=setLocoFunction(reg, functionNumber, on);
+  byte buffer[FN_BYTES];
+  const byte * functions=locoFunctions(reg, buffer);
+  uint16_t notReminded=0;
+  uint16_t groupMask=updateGroupflags(remembered ? loco.groupFlags : notReminded, functionNumber);
+  if (!remembered) {
+    // an Uno with its pool full: sent now, and as off by any reminder of its group
+    setFnState(buffer, functionNumber, on);
+    functions=buffer;
+  }
+  loco.lastChange=reminderTicks();
+  forgetSpeedReminder(reg);  // a combined reminder carries functions
+  if (loco.locoFlags & LOCO_FLAG_RCN212)  // and a waiting one has the old states
+    DCCWaveform::mainTrack.dropPackets(supersedeKey(SUPERSEDE_SPEED, loco.loco), PACKET_PRIORITY::REMINDER);
+  issueFunctionGroup(loco.loco, functions, groupMask, PACKET_PRIORITY::FUNCTION);
+}
+
 int DCC::getFn( int cab, byte functionNumber) {
-  if (cab<=0 || functionNumber>28) return -1;  // unknown
-  int reg = lookupSpeedTable(cab);
+  if (cab<=0 || functionNumber>MAX_LOCO_FUNCTION) return -1;  // unknown
+  bool reversed;
+  cab=consistLead(cab, reversed);
+  int reg = lookupSpeedTable(cab, false);
   if (reg<0) return -1;  
 
-  unsigned long funcmask = (1UL<<functionNumber);
-  return  (speedTable[reg].functions & funcmask)? 1 : 0;
+  byte buffer[FN_BYTES];
+  return  fnState(locoFunctions(reg, buffer), functionNumber) ? 1 : 0;
 }
 
 // Set the group flag to say we have touched the particular group.
 // A group will be reminded only if it has been touched.  
-void DCC::updateGroupflags(byte & flags, int functionNumber) {
-  byte groupMask;
+// Returns the flag for the group.
+uint16_t DCC::updateGroupflags(uint16_t & flags, int functionNumber) {
+  uint16_t groupMask;
   if (functionNumber<=4)       groupMask=FN_GROUP_1;
   else if (functionNumber<=8)  groupMask=FN_GROUP_2;
   else if (functionNumber<=12) groupMask=FN_GROUP_3;
   else if (functionNumber<=20) groupMask=FN_GROUP_4;
-  else                         groupMask=FN_GROUP_5;
+  else if (functionNumber<=28) groupMask=FN_GROUP_5;
+  else                         groupMask=FN_GROUP_6 << ((functionNumber-29)/8);
   flags |= groupMask; 
+  return groupMask;
 }
 
-void DCC::setAccessory(int address, byte number, bool activate) {
+// Returns false if the values are wrong or the packet could not be queued.
+bool DCC::setAccessory(int address, byte number, bool activate) {
   // use masks to detect wrong values and do nothing
   if(address != (address & 511))
-    return;
+    return false;
   if(number != (number & 3))
-    return;
+    return false;
   byte b[2];
 
   b[0] = address % 64 + 128;                                     // first byte is of the form 10AAAAAA, where AAAAAA represent 6 least signifcant bits of accessory address
   b[1] = ((((address / 64) % 8) << 4) + (number % 4 << 1) + activate % 2) ^ 0xF8; // second byte is of the form 1AAACDDD, where C should be 1, and the least significant D represent activate/deactivate
 
-  DCCWaveform::mainTrack.schedulePacket(b, 2, 4);      // Repeat the packet four times
+  return DCCWaveform::mainTrack.schedulePacket(b, 2, 4);      // Repeat the packet four times
 }
 
 //
 // writeCVByteMain: Write a byte with PoM on main. This writes
-// the 5 byte sized packet to implement this DCC function
+// the 5 byte sized packet to implement this DCC function.
+// Returns false if the packet could not be queued.
 //
-void DCC::writeCVByteMain(int cab, int cv, byte bValue)  {
+bool DCC::writeCVByteMain(int cab, int cv, byte bValue)  {
   byte b[5];
   byte nB = 0;
   if (cab > 127)
@@ -267,14 +361,16 @@ void DCC::writeCVByteMain(int cab, int cv, byte bValue)  {
   b[nB++] = cv2(cv);
   b[nB++] = bValue;
 
-  DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+  return DCCWaveform::mainTrack.schedulePacket(b, nB, 4, PACKET_PRIORITY::ACCESSORY,
+                                               supersedeKey(SUPERSEDE_POM_BYTE | (cv & 0x3FF), cab));
 }
 
 //
 // writeCVBitMain: Write a bit of a byte with PoM on main. This writes
-// the 5 byte sized packet to implement this DCC function
+// the 5 byte sized packet to implement this DCC function.
+// Returns false if the packet could not be queued.
 //
-void DCC::writeCVBitMain(int cab, int cv, byte bNum, bool bValue)  {
+bool DCC::writeCVBitMain(int cab, int cv, byte bNum, bool bValue)  {
   byte b[5];
   byte nB = 0;
   bValue = bValue % 2;
@@ -288,7 +384,7 @@ void DCC::writeCVBitMain(int cab, int cv, byte bNum, bool bValue)  {
   b[nB++] = cv2(cv);
   b[nB++] = WRITE_BIT | (bValue ? BIT_ON : BIT_OFF) | bNum;
 
-  DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+  return DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
 }
 
 void DCC::setProgTrackSyncMain(bool on) {
@@ -303,56 +399,50 @@ FSH* DCC::getMotorShieldName() {
   return shieldName;
 }
   
-const ackOp FLASH WRITE_BIT0_PROG[] = {
+ACK_PROGRAM(WRITE_BIT0_PROG,
      BASELINE,
      W0,WACK,
      V0, WACK,  // validate bit is 0 
      ITC1,      // if acked, callback(1)
-     _FAIL  // callback (-1)
-};
-const ackOp FLASH WRITE_BIT1_PROG[] = {
+     _FAIL);  // callback (-1)
+ACK_PROGRAM(WRITE_BIT1_PROG,
      BASELINE,
      W1,WACK,
      V1, WACK,  // validate bit is 1 
      ITC1,      // if acked, callback(1)
-     _FAIL  // callback (-1)
-};
+     _FAIL);  // callback (-1)
 
-const ackOp FLASH VERIFY_BIT0_PROG[] = {
+ACK_PROGRAM(VERIFY_BIT0_PROG,
      BASELINE,
      V0, WACK,  // validate bit is 0 
      ITC0,      // if acked, callback(0)
      V1, WACK,  // validate bit is 1
      ITC1,       
-     _FAIL  // callback (-1)
-};
-const ackOp FLASH VERIFY_BIT1_PROG[] = {
+     _FAIL);  // callback (-1)
+ACK_PROGRAM(VERIFY_BIT1_PROG,
      BASELINE,
      V1, WACK,  // validate bit is 1 
      ITC1,      // if acked, callback(1)
      V0, WACK, 
      ITC0,
-     _FAIL  // callback (-1)
-};
+     _FAIL);  // callback (-1)
 
-const ackOp FLASH READ_BIT_PROG[] = {
+ACK_PROGRAM(READ_BIT_PROG,
      BASELINE,
      V1, WACK,  // validate bit is 1 
      ITC1,      // if acked, callback(1)
      V0, WACK,  // validate bit is zero
      ITC0,      // if acked callback 0
-     _FAIL       // bit not readable 
-     };
+     _FAIL);       // bit not readable
      
-const ackOp FLASH WRITE_BYTE_PROG[] = {
+ACK_PROGRAM(WRITE_BYTE_PROG,
       BASELINE,
       WB,WACK,ITC1,    // Write and callback(1) if ACK 
       // handle decoders that dont ack a write 
       VB,WACK,ITC1,    // validate byte and callback(1) if correct 
-      _FAIL        // callback (-1)
-      };
+      _FAIL);        // callback (-1)
       
-const ackOp FLASH VERIFY_BYTE_PROG[] = {
+ACK_PROGRAM(VERIFY_BYTE_PROG,
       BASELINE,
       VB,WACK,     // validate byte 
       ITCB,       // if ok callback value
@@ -362,9 +452,9 @@ const ackOp FLASH VERIFY_BYTE_PROG[] = {
       // There is no need for one validation as entire byte is validated at the end
       V0, WACK, MERGE,        // read and merge first tested bit (7)
       ITSKIP,                 // do small excursion if there was no ack
-        SETBIT,(ackOp)7,
+        {SETBIT,7},
         V1, WACK, NAKFAIL,    // test if there is an ack on the inverse of this bit (7)
-        SETBIT,(ackOp)6,      // and abort whole test if not else continue with bit (6)
+        {SETBIT,6},      // and abort whole test if not else continue with bit (6)
       SKIPTARGET,
       V0, WACK, MERGE,        // read and merge second tested bit (6)
       V0, WACK, MERGE,        // read and merge third  tested bit (5) ...
@@ -374,10 +464,10 @@ const ackOp FLASH VERIFY_BYTE_PROG[] = {
       V0, WACK, MERGE,
       V0, WACK, MERGE,
       VB, WACK, ITCB,  // verify merged byte and return it if acked ok 
-      _FAIL };
+      _FAIL);
       
       
-const ackOp FLASH READ_CV_PROG[] = {
+ACK_PROGRAM(READ_CV_PROG,
       BASELINE,
       STARTMERGE,    //clear bit and byte values ready for merge pass
       // each bit is validated against 0 and the result inverted in MERGE
@@ -385,9 +475,9 @@ const ackOp FLASH READ_CV_PROG[] = {
       // There is no need for one validation as entire byte is validated at the end
       V0, WACK, MERGE,        // read and merge first tested bit (7)
       ITSKIP,                 // do small excursion if there was no ack
-        SETBIT,(ackOp)7,
+        {SETBIT,7},
         V1, WACK, NAKFAIL,    // test if there is an ack on the inverse of this bit (7)
-        SETBIT,(ackOp)6,      // and abort whole test if not else continue with bit (6)
+        {SETBIT,6},      // and abort whole test if not else continue with bit (6)
       SKIPTARGET,
       V0, WACK, MERGE,        // read and merge second tested bit (6)
       V0, WACK, MERGE,        // read and merge third  tested bit (5) ...
@@ -397,19 +487,19 @@ const ackOp FLASH READ_CV_PROG[] = {
       V0, WACK, MERGE,
       V0, WACK, MERGE,
       VB, WACK, ITCB,  // verify merged byte and return it if acked ok 
-      _FAIL };          // verification failed
+      _FAIL);          // verification failed
 
 
-const ackOp FLASH LOCO_ID_PROG[] = {
+ACK_PROGRAM(LOCO_ID_PROG,
       BASELINE,
-      SETCV, (ackOp)1,   
-      SETBIT, (ackOp)7,
+      {SETCV,1},   
+      {SETBIT,7},
       V0,WACK,NAKFAIL, // test CV 1 bit 7 is a zero... NAK means no loco found
 
-      SETCV, (ackOp)19,     // CV 19 is consist setting
-      SETBYTE, (ackOp)0,    
+      {SETCV,19},     // CV 19 is consist setting
+      {SETBYTE,0},    
       VB, WACK, ITSKIP,     // ignore consist if cv19 is zero (no consist)
-      SETBYTE, (ackOp)128,
+      {SETBYTE,128},
       VB, WACK, ITSKIP,     // ignore consist if cv19 is 128 (no consist, direction bit set)
       STARTMERGE,           // Setup to read cv 19
       V0, WACK, MERGE,  
@@ -423,12 +513,12 @@ const ackOp FLASH LOCO_ID_PROG[] = {
       VB, WACK, ITCB7,  // return 7 bits only, No_ACK means CV19 not supported so ignore it
       
       SKIPTARGET,     // continue here if CV 19 is zero or fails all validation      
-      SETCV,(ackOp)29,
-      SETBIT,(ackOp)5,
+      {SETCV,29},
+      {SETBIT,5},
       V0, WACK, ITSKIP,  // Skip to SKIPTARGET if bit 5 of CV29 is zero
       
       // Long locoid  
-      SETCV, (ackOp)17,       // CV 17 is part of locoid
+      {SETCV,17},       // CV 17 is part of locoid
       STARTMERGE,
       V0, WACK, MERGE,  // read and merge bit 1 etc
       V0, WACK, MERGE,
@@ -441,7 +531,7 @@ const ackOp FLASH LOCO_ID_PROG[] = {
       VB, WACK, NAKFAIL,  // verify merged byte and return -1 it if not acked ok
       STASHLOCOID,         // keep stashed cv 17 for later 
       // Read 2nd part from CV 18 
-      SETCV, (ackOp)18,
+      {SETCV,18},
       STARTMERGE,
       V0, WACK, MERGE,  // read and merge bit 1 etc
       V0, WACK, MERGE,
@@ -456,9 +546,9 @@ const ackOp FLASH LOCO_ID_PROG[] = {
       
       // ITSKIP Skips to here if CV 29 bit 5 was zero. so read CV 1 and return that  
       SKIPTARGET,
-      SETCV, (ackOp)1,
+      {SETCV,1},
       STARTMERGE,
-      SETBIT, (ackOp)6,  // skip over first bit as we know its a zero
+      {SETBIT,6},  // skip over first bit as we know its a zero
       V0, WACK, MERGE,
       V0, WACK, MERGE,
       V0, WACK, MERGE,
@@ -467,102 +557,163 @@ const ackOp FLASH LOCO_ID_PROG[] = {
       V0, WACK, MERGE,
       V0, WACK, MERGE,
       VB, WACK, ITCB,  // verify merged byte and callback
-      _FAIL
-      };    
+      _FAIL);    
 
-const ackOp FLASH SHORT_LOCO_ID_PROG[] = {
+ACK_PROGRAM(SHORT_LOCO_ID_PROG,
       BASELINE,
-      SETCV,(ackOp)19,
-      SETBYTE, (ackOp)0,
+      {SETCV,19},
+      {SETBYTE,0},
       WB,WACK,     // ignore dedcoder without cv19 support
       // Turn off long address flag
-      SETCV,(ackOp)29,
-      SETBIT,(ackOp)5,
+      {SETCV,29},
+      {SETBIT,5},
       W0,WACK,
       V0,WACK,NAKFAIL,
-      SETCV, (ackOp)1,   
+      {SETCV,1},   
       SETBYTEL,   // low byte of word 
       WB,WACK,    // some decoders don't ACK writes
       VB,WACK,ITCB,
-      _FAIL
-};    
+      _FAIL);    
 
-const ackOp FLASH LONG_LOCO_ID_PROG[] = {
+ACK_PROGRAM(LONG_LOCO_ID_PROG,
       BASELINE,
       // Clear consist CV 19
-      SETCV,(ackOp)19,
-      SETBYTE, (ackOp)0,
+      {SETCV,19},
+      {SETBYTE,0},
       WB,WACK,     // ignore decoder without cv19 support
       // Turn on long address flag cv29 bit 5
-      SETCV,(ackOp)29,
-      SETBIT,(ackOp)5,
+      {SETCV,29},
+      {SETBIT,5},
       W1,WACK,
       V1,WACK,NAKFAIL,
       // Store high byte of address in cv 17
-      SETCV, (ackOp)17,
+      {SETCV,17},
       SETBYTEH,   // high byte of word 
       WB,WACK,
       VB,WACK,NAKFAIL,
       // store 
-      SETCV, (ackOp)18,
+      {SETCV,18},
       SETBYTEL,   // low byte of word 
       WB,WACK,
       VB,WACK,ITC1,   // callback(1) means Ok
-      _FAIL
-};    
+      _FAIL);    
 
 void  DCC::writeCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback)  {
-  ackManagerSetup(cv, byteValue,  WRITE_BYTE_PROG, callback);
+  writeCVByte(cv, byteValue, ackReply(callback));
 }
 
 void DCC::writeCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callback)  {
-  if (bitNum >= 8) callback(-1);
-  else ackManagerSetup(cv, bitNum, bitValue?WRITE_BIT1_PROG:WRITE_BIT0_PROG, callback);
+  writeCVBit(cv, bitNum, bitValue, ackReply(callback));
 }
 
 void  DCC::verifyCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback)  {
-  ackManagerSetup(cv, byteValue,  VERIFY_BYTE_PROG, callback);
+  verifyCVByte(cv, byteValue, ackReply(callback));
 }
 
 void DCC::verifyCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callback)  {
-  if (bitNum >= 8) callback(-1);
-  else ackManagerSetup(cv, bitNum, bitValue?VERIFY_BIT1_PROG:VERIFY_BIT0_PROG, callback);
+  verifyCVBit(cv, bitNum, bitValue, ackReply(callback));
 }
 
-
 void DCC::readCVBit(int16_t cv, byte bitNum, ACK_CALLBACK callback)  {
-  if (bitNum >= 8) callback(-1);
-  else ackManagerSetup(cv, bitNum,READ_BIT_PROG, callback);
+  readCVBit(cv, bitNum, ackReply(callback));
 }
 
 void DCC::readCV(int16_t cv, ACK_CALLBACK callback)  {
-  ackManagerSetup(cv, 0,READ_CV_PROG, callback);
+  readCV(cv, ackReply(callback));
 }
 
 void DCC::getLocoId(ACK_CALLBACK callback) {
-  ackManagerSetup(0,0, LOCO_ID_PROG, callback);
+  getLocoId(ackReply(callback));
 }
 
 void DCC::setLocoId(int id,ACK_CALLBACK callback) {
+  setLocoId(id, ackReply(callback));
+}
+
+bool  DCC::writeCVByte(int16_t cv, byte byteValue, const PROG_REPLY & reply)  {
+  return queueProgJob(WRITE_BYTE_PROG, cv, byteValue, 0, reply);
+}
+
+bool DCC::writeCVBit(int16_t cv, byte bitNum, bool bitValue, const PROG_REPLY & reply)  {
+  if (bitNum >= 8) {
+    progReply(reply, -1);
+    return true;
+  }
+  return queueProgJob(bitValue?WRITE_BIT1_PROG:WRITE_BIT0_PROG, cv, bitNum, 0, reply);
+}
+
+bool  DCC::verifyCVByte(int16_t cv, byte byteValue, const PROG_REPLY & reply)  {
+  return queueProgJob(VERIFY_BYTE_PROG, cv, byteValue, 0, reply);
+}
+
+bool DCC::verifyCVBit(int16_t cv, byte bitNum, bool bitValue, const PROG_REPLY & reply)  {
+  if (bitNum >= 8) {
+    progReply(reply, -1);
+    return true;
+  }
+  return queueProgJob(bitValue?VERIFY_BIT1_PROG:VERIFY_BIT0_PROG, cv, bitNum, 0, reply);
+}
+
+bool DCC::readCVBit(int16_t cv, byte bitNum, const PROG_REPLY & reply)  {
+  if (bitNum >= 8) {
+    progReply(reply, -1);
+    return true;
+  }
+  return queueProgJob(READ_BIT_PROG, cv, bitNum, 0, reply);
+}
+
+bool DCC::readCV(int16_t cv, const PROG_REPLY & reply)  {
+  return queueProgJob(READ_CV_PROG, cv, 0, 0, reply);
+}
+
+bool DCC::readCVRange(int16_t first, int16_t last, const PROG_REPLY & reply)  {
+  if (first<1 || last<first || last>1024) return false;
+  if (!queueProgJob(READ_CV_PROG, first, 0, 0, reply)) return false;
+  progJobs[progJobCount-1].lastCv=last;
+  return true;
+}
+
+bool DCC::readCVList(const int16_t cvs[], byte count, const PROG_REPLY & reply)  {
+  if (count<1 || count>PROG_LIST_SIZE) return false;
+  if (!queueProgJob(READ_CV_PROG, cvs[0], 0, 0, reply)) return false;
+  PROG_JOB & job=progJobs[progJobCount-1];
+  memcpy(job.list, cvs, count * sizeof(cvs[0]));
+  job.listCount=count;
+  return true;
+}
+
+bool DCC::runAckProgram(const ackOp program[], const PROG_REPLY & reply, int cv, byte byteValueOrBitnum, int wordval) {
+  return queueProgJob(program, cv, byteValueOrBitnum, wordval, reply);
+}
+
+bool DCC::getLocoId(const PROG_REPLY & reply) {
+  return queueProgJob(LOCO_ID_PROG, 0, 0, 0, reply);
+}
+
+bool DCC::setLocoId(int id, const PROG_REPLY & reply) {
   if (id<1 || id>10239) { //0x27FF according to standard
-    callback(-1);
-    return;
+    progReply(reply, -1);
+    return true;
   }
   if (id<=127)
-      ackManagerSetup(id, SHORT_LOCO_ID_PROG, callback);
-  else
-      ackManagerSetup(id | 0xc000,LONG_LOCO_ID_PROG, callback);
+      return queueProgJob(SHORT_LOCO_ID_PROG, 0, 0, id, reply);
+  return queueProgJob(LONG_LOCO_ID_PROG, 0, 0, id | 0xc000, reply);
 }
 
 void DCC::forgetLoco(int cab) {  // removes any speed reminders for this loco
   setThrottle2(cab,1); // ESTOP this loco if still on track  
-  int reg=lookupSpeedTable(cab);
-  if (reg>=0) speedTable[reg].loco=0;
+  int reg=lookupSpeedTable(cab, false);
+  if (reg>=0) removeLoco(reg);
   setThrottle2(cab,1); // ESTOP if this loco still on track
 }
 void DCC::forgetAllLocos() {  // removes all speed reminders
   setThrottle2(0,1); // ESTOP all locos still on track      
-  for (int i=0;i<MAX_LOCOS;i++) speedTable[i].loco=0;
+  for (int reg=nextLoco(0); reg>=0; reg=nextLoco(reg+1)) speedTable[reg].loco=0;
+  memset(locoIndex,0,sizeof(locoIndex));
+  memset(locoOccupied,0,sizeof(locoOccupied));
+#ifdef ARDUINO_AVR_UNO
+  memset(fnPool,0,sizeof(fnPool));
+#endif
 }
 
 byte DCC::loopStatus=0;  
@@ -571,72 +722,278 @@ void DCC::loop()  {
   // DIAG(F("@@@ DCC Loop")); 
   DCCWaveform::loop(ackManagerProg!=NULL); // power overload checks
   ackManagerLoop();    // maintain prog track ack manager
+  Consist::loop();     // send outstanding consist CV19 writes
   issueReminders();
 }
 
+// Reminder scheduling.
+// Each time the main track queue is empty, one reminder packet is sent. A loco's 
+// reminder cycle is its speed followed by each function group that has been touched.
+// A decoder flagged LOCO_FLAG_RCN212 gets its speed and lower functions in one packet.
+// The next loco to remind is the one with the strongest claim: the time since its
+// speed was last sent, weighted by whether it is moving, was changed recently or is idle.
+// Idle locos wait at least half of the maximum interval, and any loco that has 
+// reached the maximum interval goes first.
+
 void DCC::issueReminders() {
   // if the main track transmitter still has a pending packet, skip this time around.
-  if ( DCCWaveform::mainTrack.packetPending) return;
-
-  // This loop searches for a loco in the speed table starting at nextLoco and cycling back around
-  for (int reg=0;reg<MAX_LOCOS;reg++) {
-       int slot=reg+nextLoco;
-       if (slot>=MAX_LOCOS) slot-=MAX_LOCOS; 
-       if (speedTable[slot].loco > 0) {
-          // have found the next loco to remind 
-          // issueReminder will return true if this loco is completed (ie speed and functions)
-          if (issueReminder(slot)) nextLoco=slot+1; 
-          return;
-        }
+  if ( DCCWaveform::mainTrack.isPacketPending()) return;
+
+  if (reminderReg<0) {
+    reminderReg=pickReminder();
+    if (reminderReg<0) return;  // nothing to remind
+    loopStatus=0;
+  }
+  // issueReminder will return true if this loco is completed (ie speed and functions)
+  if (issueReminder(reminderReg)) reminderReg=-1;
+}
+
+int DCC::pickReminder() {
+  const byte weight[REMIND_CLASSES]={4,2,1};
+  uint16_t now=reminderTicks();
+  int best=-1;
+  unsigned long bestClaim=0;
+  for (int reg=nextLoco(0); reg>=0; reg=nextLoco(reg+1)) {
+    LOCO & loco=speedTable[reg];
+    uint16_t age=now-loco.lastRefresh;
+    if (age>REMINDER_AGE_LIMIT) {
+      age=REMINDER_AGE_LIMIT;
+      loco.lastRefresh=now-age;
+    }
+    uint16_t changeAge=now-loco.lastChange;
+    if (changeAge>REMINDER_AGE_LIMIT) loco.lastChange=now-REMINDER_AGE_LIMIT;
+
+    REMINDER_CLASS rclass= ((loco.speedCode & 0x7F) > 1) ? REMIND_MOVING
+                         : (changeAge < REMINDER_RECENT_TICKS) ? REMIND_RECENT : REMIND_IDLE;
+    unsigned long claim;
+    if (age>=reminderMaxTicks) claim=0x20000UL+age;  // overdue, beats any weighted claim
+    else if (rclass==REMIND_IDLE && age<reminderMaxTicks/2) continue;
+    else claim=(unsigned long)age * weight[rclass];
+    if (best<0 || claim>bestClaim) {
+      best=reg;
+      bestClaim=claim;
+    }
   }
+  return best;
+}
+
+// Record that the speed of this loco has just been sent
+void DCC::noteRefresh(int reg) {
+  uint16_t now=reminderTicks();
+  LOCO & loco=speedTable[reg];
+  uint16_t age=now-loco.lastRefresh;
+  REMINDER_CLASS rclass= ((loco.speedCode & 0x7F) > 1) ? REMIND_MOVING
+                       : ((uint16_t)(now-loco.lastChange) < REMINDER_RECENT_TICKS) ? REMIND_RECENT : REMIND_IDLE;
+  if (age<=REMINDER_AGE_LIMIT && age>worstRefresh[rclass]) worstRefresh[rclass]=age;
+  loco.lastRefresh=now;
 }
  
 bool DCC::issueReminder(int reg) {
-  unsigned long functions=speedTable[reg].functions;
-  int loco=speedTable[reg].loco;
-  byte flags=speedTable[reg].groupFlags;
+  LOCO & loco=speedTable[reg];
+  if (loco.loco<=0) return true;  // forgotten during its cycle
   
-  switch (loopStatus) {
-        case 0:
-      //   DIAG(F("Reminder %d speed %d"),loco,speedTable[reg].speedCode);
-         setThrottle2(loco, speedTable[reg].speedCode);
-         break;
-       case 1: // remind function group 1 (F0-F4)
-          if (flags & FN_GROUP_1) 
-              setFunctionInternal(loco,0, 128 | ((functions>>1)& 0x0F) | ((functions & 0x01)<<4)); // 100D DDDD
+  bool sent=false;
+  if (loopStatus==0) {
+    //   DIAG(F("Reminder %d speed %d"),loco.loco,loco.speedCode);
+    noteRefresh(reg);
+    reminderGroups=loco.groupFlags;
+    loopStatus=1;
+    // an advanced consist member gets its speed from the consist address 
+    if (!(loco.locoFlags & LOCO_CONSISTED)) {
+      bool combined=loco.locoFlags & LOCO_FLAG_RCN212;
+#ifdef ARDUINO_AVR_UNO
+      // no room to keep the packet, so it is built for each reminder
+      byte packet[MAX_PACKET_SIZE+1];
+      byte packetLength=encodeSpeedReminder(reg, packet);
+#else
+      byte * packet=loco.speedPacket;
+      if (loco.speedPacketLength==0) loco.speedPacketLength=encodeSpeedReminder(reg, packet);
+      byte packetLength=loco.speedPacketLength;
+#endif
+      // a reminder is never ESTOP, even for a stopped loco, or it would cut short other packets
+      DCCWaveform::mainTrack.scheduleEncodedPacket(packet, packetLength, 0,
+           PACKET_PRIORITY::REMINDER, supersedeKey(SUPERSEDE_SPEED, loco.loco));
+      if (combined) {
+        // one packet carries the speed and as many function groups as fitted
+        const uint16_t covered[]={FN_GROUP_1, FN_GROUP_1|FN_GROUP_2|FN_GROUP_3, 
+                                  FN_GROUP_1|FN_GROUP_2|FN_GROUP_3|FN_GROUP_4, 
+                                  FN_GROUP_1|FN_GROUP_2|FN_GROUP_3|FN_GROUP_4|FN_GROUP_5};
+        byte fnBytes=packetLength - (loco.loco > 127 ? 5 : 4);  // less address, instruction, speed, checksum
+        reminderGroups &= ~covered[fnBytes-1];
+      }
+      sent=true;
+    }
+  }
+  if (!sent && reminderGroups!=0) {
+    // then each touched function group not already sent, lowest first
+    uint16_t groupMask=reminderGroups & -reminderGroups;
+    byte buffer[FN_BYTES];
+    issueFunctionGroup(loco.loco, locoFunctions(reg, buffer), groupMask, PACKET_PRIORITY::REMINDER);
+    reminderGroups &= ~groupMask;
+  }
+  // if there are no more groups then this loco is done so
+  // reset status to 0 for next loco and return true so caller 
+  // moves on to next loco. 
+  if (reminderGroups==0) {
+    loopStatus=0;
+    return true;
+  }
+  return false;
+}
+
+// Fills packet with the encoded speed reminder for this loco and returns its length
+byte DCC::encodeSpeedReminder(int reg, byte packet[]) {
+  LOCO & loco=speedTable[reg];
+  byte b[MAX_PACKET_SIZE];
+  byte buffer[FN_BYTES];
+  byte nB = (loco.locoFlags & LOCO_FLAG_RCN212) 
+          ? buildSpeedAndFunctions(b, loco.loco, loco.speedCode, locoFunctions(reg, buffer), loco.groupFlags)
+          : buildSpeedPacket(b, loco.loco, loco.speedCode);
+  return DCCWaveform::encodePacket(packet, b, nB);
+}
+
+// The kept speed reminder no longer matches the loco
+void DCC::forgetSpeedReminder(int reg) {
+#ifdef ARDUINO_AVR_UNO
+  (void)reg;   // none is kept
+#else
+  speedTable[reg].speedPacketLength=0;
+#endif
+}
+
+void DCC::setReminderMaxInterval(unsigned int ms) {
+  unsigned int ticks=ms>>REMINDER_TICK_SHIFT;
+  if (ticks<1) ticks=1;
+  if (ticks>REMINDER_AGE_LIMIT/2) ticks=REMINDER_AGE_LIMIT/2;
+  reminderMaxTicks=ticks;
+}
+
+void DCC::displayReminderStats(Print * stream) {
+  StringFormatter::send(stream,F("Reminder worst interval moving=%lmS recent=%lmS idle=%lmS limit=%lmS\n"),
+                        (long)worstRefresh[REMIND_MOVING]<<REMINDER_TICK_SHIFT,
+                        (long)worstRefresh[REMIND_RECENT]<<REMINDER_TICK_SHIFT,
+                        (long)worstRefresh[REMIND_IDLE]<<REMINDER_TICK_SHIFT,
+                        (long)reminderMaxTicks<<REMINDER_TICK_SHIFT);
+  for (byte c=0;c<REMIND_CLASSES;c++) worstRefresh[c]=0;
+}
+
+// RCN-212 Speed, Direction and Functions instruction:
+//   0011 1100, RSSS SSSS (128 step speed), then F7-F0, F15-F8, ... 
+// The instruction may carry up to four function bytes but packets are limited to
+// MAX_PACKET_SIZE, so a long address leaves room for F0-F7 and a short one for F0-F15.
+// Fills b with the packet (without checksum) and returns its length.
+byte DCC::buildSpeedAndFunctions(byte b[], int cab, byte speedCode, const byte functions[], uint16_t groupFlags) {
+  byte nB = 0;
+  if (cab > 127)
+    b[nB++] = highByte(cab) | 0xC0;    // convert train number into a two-byte address
+  b[nB++] = lowByte(cab);
+  b[nB++] = SET_SPEED_AND_FUNCTIONS;
+  b[nB++] = speedCode;
+  
+  // only as many function bytes as the touched groups need, at least one
+  byte fnBytes = (groupFlags & FN_GROUP_5) ? 4 : (groupFlags & FN_GROUP_4) ? 3 
+               : (groupFlags & (FN_GROUP_2|FN_GROUP_3)) ? 2 : 1;
+  if (fnBytes > MAX_PACKET_SIZE-nB) fnBytes = MAX_PACKET_SIZE-nB;
+  for (byte i=0; i<fnBytes; i++) b[nB++] = functions[i];
+  return nB;
+}
+
+// Record decoder capabilities for a cab and apply them to its reminders.
+// Returns false if the flags could not be stored.
+bool DCC::setLocoFlags(int cab, byte flags) {
+  if (cab<=0) return false;
+  if (!LocoFlags::set(cab,flags)) return false;
+  int reg=lookupSpeedTable(cab, false);
+  if (reg>=0) {
+    speedTable[reg].locoFlags=flags | (speedTable[reg].locoFlags & LOCO_CONSISTED);
+    forgetSpeedReminder(reg);
+  }
+  return true;
+}
+
+void DCC::setConsisted(int cab, bool on) {
+  int reg=lookupSpeedTable(cab, false);
+  if (reg<0) return;
+  if (on) speedTable[reg].locoFlags |= LOCO_CONSISTED;
+  else speedTable[reg].locoFlags &= ~LOCO_CONSISTED;
+}
+
+// Send the packet for one function group from the given function states
+void DCC::issueFunctionGroup(int loco, const byte functions[], uint16_t groupMask, PACKET_PRIORITY priority) {
+  switch (groupMask) {
+       case FN_GROUP_1: // F0-F4
+          setFunctionInternal(loco,0, 128 | ((functions[0]>>1)& 0x0F) | ((functions[0] & 0x01)<<4), priority); // 100D DDDD
           break;     
-       case 2: // remind function group 2 F5-F8
-          if (flags & FN_GROUP_2) 
-              setFunctionInternal(loco,0, 176 | ((functions>>5)& 0x0F));                           // 1011 DDDD
+       case FN_GROUP_2: // F5-F8
+          setFunctionInternal(loco,0, 176 | (fnBits(functions,5)& 0x0F), priority);                           // 1011 DDDD
           break;     
-       case 3: // remind function group 3 F9-F12
-          if (flags & FN_GROUP_3) 
-              setFunctionInternal(loco,0, 160 | ((functions>>9)& 0x0F));                           // 1010 DDDD
+       case FN_GROUP_3: // F9-F12
+          setFunctionInternal(loco,0, 160 | (fnBits(functions,9)& 0x0F), priority);                           // 1010 DDDD
           break;   
-       case 4: // remind function group 4 F13-F20
-          if (flags & FN_GROUP_4) 
-              setFunctionInternal(loco,222, ((functions>>13)& 0xFF)); 
-          flags&= ~FN_GROUP_4;  // dont send them again
+       case FN_GROUP_4: // F13-F20
+          setFunctionInternal(loco,222, fnBits(functions,13), priority); 
           break;  
-       case 5: // remind function group 5 F21-F28
-          if (flags & FN_GROUP_5)
-              setFunctionInternal(loco,223, ((functions>>21)& 0xFF)); 
-          flags&= ~FN_GROUP_5;  // dont send them again
+       case FN_GROUP_5: // F21-F28
+          setFunctionInternal(loco,223, fnBits(functions,21), priority); 
           break; 
-      }
-      loopStatus++;
-      // if we reach status 6 then this loco is done so
-      // reset status to 0 for next loco and return true so caller 
-      // moves on to next loco. 
-      if (loopStatus>5) loopStatus=0;
-      return loopStatus==0;
-    }
+       default: // F29-F36 ... F61-F68 feature expansion
+          for (byte g=0; g<FN_EXPANSION_GROUPS; g++) {
+            if (groupMask == (FN_GROUP_6<<g)) 
+              setFunctionInternal(loco, FEATURE_EXPANSION_F29+g, fnBits(functions,29+8*g), priority);
+          }
+          break;
+  }
+}
  
  
 
 
 ///// Private helper functions below here /////////////////////
 
+// Returns the function states of a loco, which are assembled in buffer on an Uno
+const byte * DCC::locoFunctions(int reg, byte buffer[FN_BYTES]) {
+#ifdef ARDUINO_AVR_UNO
+  memcpy(buffer, speedTable[reg].functions, FN_SLOT_BYTES);
+  int entry=fnPoolEntry(reg, false);
+  if (entry>=0) memcpy(buffer+FN_SLOT_BYTES, fnPool[entry].functions, FN_BYTES-FN_SLOT_BYTES);
+  else memset(buffer+FN_SLOT_BYTES, 0, FN_BYTES-FN_SLOT_BYTES);
+  return buffer;
+#else
+  (void)buffer;
+  return speedTable[reg].functions;
+#endif
+}
+
+// Returns false if the function could not be remembered, when an Uno's pool is full
+bool DCC::setLocoFunction(int reg, byte functionNumber, bool on) {
+#ifdef ARDUINO_AVR_UNO
+  if (functionNumber>=FN_SLOT_BYTES*8) {
+    int entry=fnPoolEntry(reg, on);
+    if (entry<0) return !on;  // off is what an unremembered function is
+    setFnState(fnPool[entry].functions, functionNumber-FN_SLOT_BYTES*8, on);
+    return true;
+  }
+#endif
+  setFnState(speedTable[reg].functions, functionNumber, on);
+  return true;
+}
+
+#ifdef ARDUINO_AVR_UNO
+// Returns the pool entry with this loco's higher functions, taking a free one 
+// if allocate is set, or -1
+int DCC::fnPoolEntry(int reg, bool allocate) {
+  int free=-1;
+  for (byte i=0; i<FN_POOL_SIZE; i++) {
+    if (fnPool[i].owner==reg+1) return i;
+    if (fnPool[i].owner==0 && free<0) free=i;
+  }
+  if (!allocate || free<0) return -1;
+  fnPool[free].owner=reg+1;
+  memset(fnPool[free].functions, 0, sizeof(fnPool[free].functions));
+  return free;
+}
+#endif
+
 byte DCC::cv1(byte opcode, int cv)  {
   cv--;
   return (highByte(cv) & (byte)0x03) | opcode;
@@ -646,45 +1003,161 @@ byte DCC::cv2(int cv)  {
   return lowByte(cv);
 }
 
-int DCC::lookupSpeedTable(int locoId) {
-  // determine speed reg for this loco
-  int firstEmpty = MAX_LOCOS;
-  int reg;
-  for (reg = 0; reg < MAX_LOCOS; reg++) {
-    if (speedTable[reg].loco == locoId) break;
-    if (speedTable[reg].loco == 0 && firstEmpty == MAX_LOCOS) firstEmpty = reg;
-  }
-  if (reg == MAX_LOCOS) reg = firstEmpty;
-  if (reg >= MAX_LOCOS) {
-    DIAG(F("Too many locos"));
-    return -1;
-  }
-  if (reg==firstEmpty){
-        speedTable[reg].loco = locoId;
-        speedTable[reg].speedCode=128;  // default direction forward
-        speedTable[reg].groupFlags=0;
-        speedTable[reg].functions=0;
+// Returns the index entry holding this loco, or the empty entry where it would go.
+// Linear probing always finds one as the index is never more than two thirds full.
+int DCC::findLocoIndex(int locoId) {
+  int i=(locoId ^ (locoId>>7)) & (LOCO_INDEX_SIZE-1);
+  while (locoIndex[i]!=0 && speedTable[locoIndex[i]-1].loco!=locoId) 
+    i=(i+1) & (LOCO_INDEX_SIZE-1);
+  return i;
+}
+
+// Returns the speed table slot for this loco, or -1 if it has none.
+// A slot is only allocated when autoCreate is set, so queries never use up the table.
+int DCC::lookupSpeedTable(int locoId, bool autoCreate) {
+  if (locoId<=0) return -1;
+  int i=findLocoIndex(locoId);
+  if (locoIndex[i]!=0) return locoIndex[i]-1;
+  if (!autoCreate) return -1;
+
+  // find first free slot from the occupancy bitmap
+  int reg=-1;
+  for (unsigned int b=0; b<sizeof(locoOccupied); b++) {
+    if (locoOccupied[b]==0xFF) continue;
+    reg=b*8;
+    for (byte bits=locoOccupied[b]; bits & 1; bits>>=1) reg++;
+    break;
+  }
+  if (reg<0 || reg>=MAX_LOCOS) {
+    reg=evictLoco();
+    if (reg<0) {
+      DIAG(F("Too many locos"));
+      return -1;
+    }
+    i=findLocoIndex(locoId);  // eviction may have moved index entries
   }
+  locoOccupied[reg/8] |= 1<<(reg%8);
+  locoIndex[i]=reg+1;
+  speedTable[reg].loco = locoId;
+  speedTable[reg].speedCode=128;  // default direction forward
+  speedTable[reg].groupFlags=0;
+  speedTable[reg].locoFlags=LocoFlags::get(locoId) | (Consist::isAdvancedMember(locoId) ? LOCO_CONSISTED : 0);
+  forgetSpeedReminder(reg);
+  memset(speedTable[reg].functions,0,FN_SLOT_BYTES);
+  speedTable[reg].lastRefresh=reminderTicks();
+  speedTable[reg].lastChange=speedTable[reg].lastRefresh;
   return reg;
 }
+
+// Free a speed table slot, closing up the probe sequence behind its index entry
+void DCC::removeLoco(int reg) {
+  int i=findLocoIndex(speedTable[reg].loco);
+  speedTable[reg].loco=0;
+  locoOccupied[reg/8] &= ~(1<<(reg%8));
+#ifdef ARDUINO_AVR_UNO
+  int entry=fnPoolEntry(reg, false);
+  if (entry>=0) fnPool[entry].owner=0;
+#endif
+  int j=i;
+  for (;;) {
+    locoIndex[i]=0;
+    // move back any later entry whose home position is not between the hole and itself
+    for (;;) {
+      j=(j+1) & (LOCO_INDEX_SIZE-1);
+      if (locoIndex[j]==0) return;
+      int id=speedTable[locoIndex[j]-1].loco;
+      int home=(id ^ (id>>7)) & (LOCO_INDEX_SIZE-1);
+      if (((j-home) & (LOCO_INDEX_SIZE-1)) >= ((j-i) & (LOCO_INDEX_SIZE-1))) break;
+    }
+    locoIndex[i]=locoIndex[j];
+    i=j;
+  }
+}
+
+// When the table is full, forget the stopped loco that has gone longest without
+// a change, provided that is at least the eviction age. Returns the freed slot or -1.
+int DCC::evictLoco() {
+  if (evictTicks==0) return -1;
+  uint16_t now=reminderTicks();
+  int oldest=-1;
+  uint16_t oldestAge=0;
+  for (int reg=nextLoco(0); reg>=0; reg=nextLoco(reg+1)) {
+    if ((speedTable[reg].speedCode & 0x7F) > 1) continue;  // moving
+    uint16_t age=now-speedTable[reg].lastChange;
+    if (age>REMINDER_AGE_LIMIT) age=REMINDER_AGE_LIMIT;
+    if (age>=evictTicks && age>=oldestAge) {
+      oldest=reg;
+      oldestAge=age;
+    }
+  }
+  if (oldest<0) return -1;
+  DIAG(F("Loco %d forgotten after %dS unused"), speedTable[oldest].loco, (int)(((unsigned long)oldestAge<<REMINDER_TICK_SHIFT)/1000));
+  if (reminderReg==oldest) reminderReg=-1;
+  removeLoco(oldest);
+  return oldest;
+}
+
+void DCC::setEvictAge(unsigned int seconds) {
+  unsigned long ticks=((unsigned long)seconds*1000)>>REMINDER_TICK_SHIFT;
+  if (seconds>0 && ticks<1) ticks=1;
+  if (ticks>REMINDER_AGE_LIMIT) ticks=REMINDER_AGE_LIMIT;
+  evictTicks=ticks;
+}
+
+unsigned int DCC::getEvictAge() {
+  return ((unsigned long)evictTicks<<REMINDER_TICK_SHIFT)/1000;
+}
+
+// Returns the first slot in use at or after reg, or -1 if there are no more.
+int DCC::nextLoco(int reg) {
+  while (reg<MAX_LOCOS) {
+    byte bits=locoOccupied[reg/8] >> (reg%8);
+    if (bits==0) {
+      reg=(reg|7)+1;  // skip rest of this empty byte
+      continue;
+    }
+    while (!(bits & 1)) {
+      bits>>=1;
+      reg++;
+    }
+    return reg<MAX_LOCOS ? reg : -1;
+  }
+  return -1;
+}
   
 void  DCC::updateLocoReminder(int loco, byte speedCode) {
  
   if (loco==0) {
      // broadcast stop/estop but dont change direction
-     for (int reg = 0; reg < MAX_LOCOS; reg++) {
+     for (int reg=nextLoco(0); reg>=0; reg=nextLoco(reg+1)) {
        speedTable[reg].speedCode = (speedTable[reg].speedCode & 0x80) |  (speedCode & 0x7f);
+       speedTable[reg].lastChange = reminderTicks();
+       forgetSpeedReminder(reg);
      }
      return; 
   }
   
   // determine speed reg for this loco
   int reg=lookupSpeedTable(loco);       
-  if (reg>=0) speedTable[reg].speedCode = speedCode;
+  if (reg>=0) {
+    speedTable[reg].speedCode = speedCode;
+    speedTable[reg].lastChange = reminderTicks();
+    forgetSpeedReminder(reg);
+    noteRefresh(reg);  // the speed packet has just been sent
+  }
 }
 
 DCC::LOCO DCC::speedTable[MAX_LOCOS];
-int DCC::nextLoco = 0;
+LOCO_SLOT DCC::locoIndex[LOCO_INDEX_SIZE];
+byte DCC::locoOccupied[(MAX_LOCOS+7)/8];
+#ifdef ARDUINO_AVR_UNO
+DCC::FN_POOL_ENTRY DCC::fnPool[FN_POOL_SIZE];
+#endif
+int DCC::reminderReg = -1;
+uint16_t DCC::reminderGroups = 0;
+uint16_t DCC::evictTicks = ((unsigned long)EVICT_AGE*1000)>>REMINDER_TICK_SHIFT;
+uint16_t DCC::reminderMaxTicks = REMINDER_MAX_INTERVAL>>REMINDER_TICK_SHIFT;
+uint16_t DCC::worstRefresh[REMIND_CLASSES];
 
 //ACK MANAGER
 ackOp  const *  DCC::ackManagerProg;
@@ -696,21 +1169,112 @@ byte   DCC::ackManagerBitNum;
 bool   DCC::ackReceived;
 bool   DCC::ackManagerRejoin;
 
-ACK_CALLBACK DCC::ackManagerCallback;
+DCC::PROG_JOB DCC::progJobs[PROG_JOB_QUEUE_SIZE];
+byte   DCC::progJobCount=0;
+unsigned long DCC::progCvStart;
 
-void  DCC::ackManagerSetup(int cv, byte byteValueOrBitnum, ackOp const program[], ACK_CALLBACK callback) {
-  ackManagerCv = cv;
-  ackManagerProg = program;
-  ackManagerByte = byteValueOrBitnum;
-  ackManagerBitNum=byteValueOrBitnum;
-  ackManagerCallback = callback;
+// Queues a job for the ack manager. A plain ACK_CALLBACK is told of a full queue with -1.
+bool DCC::queueProgJob(ackOp const program[], int cv, byte byteValueOrBitnum, int wordval, const PROG_REPLY & reply) {
+  if (progJobCount==PROG_JOB_QUEUE_SIZE) {
+    if (Diag::ACK) DIAG(F("Prog job queue full"));
+    if (!reply.callback) progReply(reply, -1);
+    return false;
+  }
+  PROG_JOB & job=progJobs[progJobCount++];
+  job.program=program;
+  job.cv=cv;
+  job.byteValueOrBitnum=byteValueOrBitnum;
+  job.wordval=wordval;
+  job.deadline=progDeadline(reply, false);
+  job.lastCv=0;
+  job.listCount=0;
+  job.listIndex=0;
+  job.reply=reply;
+  if (Diag::ACK && progJobCount>1) DIAG(F("Prog job queued behind %d"), progJobCount-1);
+  return true;
+}
+
+// A job's own timeout runs from when it starts, so a job queued behind a long
+// bulk read is only failed by the longer bound on waiting.
+unsigned long DCC::progDeadline(const PROG_REPLY & reply, bool running) {
+  if (!running) return millis() + 1000UL * PROG_JOB_WAIT_TIMEOUT;
+  return millis() + 1000UL * (reply.timeout ? reply.timeout : PROG_JOB_TIMEOUT);
 }
 
-void  DCC::ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback) {
-  ackManagerWord=wordval;
-  ackManagerProg = program;
-  ackManagerCallback = callback;
+// Moves a bulk read on to its next CV, false when there are no more
+bool DCC::nextBulkCv(PROG_JOB & job) {
+  if (job.listCount) {
+    if (++job.listIndex >= job.listCount) return false;
+    job.cv=job.list[job.listIndex];
+    return true;
   }
+  if (job.cv >= job.lastCv) return false;
+  job.cv++;
+  return true;
+}
+
+// Keeps the order of the jobs behind it
+void DCC::removeProgJob(byte index) {
+  progJobCount--;
+  for (byte i=index; i<progJobCount; i++) progJobs[i]=progJobs[i+1];
+}
+
+void DCC::progReply(const PROG_REPLY & reply, int16_t result) {
+  if (reply.callback) reply.callback(result, reply);
+  else if (reply.ackCallback) reply.ackCallback(result);
+}
+
+PROG_REPLY DCC::ackReply(ACK_CALLBACK callback) {
+  PROG_REPLY reply={};
+  reply.ackCallback=callback;
+  return reply;
+}
+
+// Fails the jobs past their deadline, whether running or waiting
+void DCC::expireProgJobs() {
+  unsigned long now=millis();
+  for (byte i=progJobCount; i-- > 0; ) {
+    if ((long)(now - progJobs[i].deadline) < 0) continue;
+    if (Diag::ACK) DIAG(F("Prog job timeout"));
+    if (i==0 && ackManagerProg) ackManagerAbort();
+    PROG_REPLY reply=progJobs[i].reply;
+    reply.cv=progJobs[i].cv;
+    reply.ms=0;
+    reply.more=false;
+    removeProgJob(i);
+    progReply(reply, -1);
+  }
+}
+
+byte DCC::cancelProgJobs(void * owner) {
+  if (!owner) return 0;
+  byte cancelled=0;
+  for (byte i=progJobCount; i-- > 0; ) {
+    if (progJobs[i].reply.owner!=owner) continue;
+    cancelProgJob(i);
+    cancelled++;
+  }
+  return cancelled;
+}
+
+// The parser's jobs are known by the ring and client their replies go to
+byte DCC::cancelProgJobs(RingStream * ringStream, byte client) {
+  if (!ringStream) return 0;
+  byte cancelled=0;
+  for (byte i=progJobCount; i-- > 0; ) {
+    const PROG_REPLY & reply=progJobs[i].reply;
+    if (reply.ringStream!=ringStream || reply.client!=client) continue;
+    cancelProgJob(i);
+    cancelled++;
+  }
+  if (cancelled && Diag::ACK) DIAG(F("Prog jobs cancelled=%d"), cancelled);
+  return cancelled;
+}
+
+void DCC::cancelProgJob(byte index) {
+  if (index==0 && ackManagerProg) ackManagerAbort();
+  removeProgJob(index);
+}
 
 const byte RESET_MIN=8;  // tuning of reset counter before sending message
 
@@ -720,6 +1284,18 @@ bool DCC::checkResets(uint8_t numResets) {
 }
 
 void DCC::ackManagerLoop() {
+  expireProgJobs();
+  if (!ackManagerProg && progJobCount) {
+    PROG_JOB & job=progJobs[0];
+    ackManagerCv = job.cv;
+    ackManagerByte = job.byteValueOrBitnum;
+    ackManagerBitNum = job.byteValueOrBitnum;
+    ackManagerWord = job.wordval;
+    ackManagerProg = job.program;
+    if (job.program==READ_CV_PROG) startRead(job.cv, false);
+    progCvStart = millis();
+    job.deadline=progDeadline(job.reply, true);
+  }
   while (ackManagerProg) {
     byte opcode=GETFLASH(ackManagerProg);
     
@@ -751,7 +1327,7 @@ void DCC::ackManagerLoop() {
               if (Diag::ACK) DIAG(F("W%d cv=%d bit=%d"),opcode==W1, ackManagerCv,ackManagerBitNum); 
               byte instruction = WRITE_BIT | (opcode==W1 ? BIT_ON : BIT_OFF) | ackManagerBitNum;
               byte message[] = {cv1(BIT_MANIPULATE, ackManagerCv), cv2(ackManagerCv), instruction };
-              DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS);
+              if (!DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS)) return;  // queue full, try again next loop
               DCCWaveform::progTrack.setAckPending(); 
          }
             break; 
@@ -761,7 +1337,7 @@ void DCC::ackManagerLoop() {
 	      if (checkResets( RESET_MIN)) return;
               if (Diag::ACK) DIAG(F("WB cv=%d value=%d"),ackManagerCv,ackManagerByte);
               byte message[] = {cv1(WRITE_BYTE, ackManagerCv), cv2(ackManagerCv), ackManagerByte};
-              DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS);
+              if (!DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS)) return;  // queue full, try again next loop
               DCCWaveform::progTrack.setAckPending(); 
             }
             break;
@@ -771,7 +1347,7 @@ void DCC::ackManagerLoop() {
 	  if (checkResets( RESET_MIN)) return; 
           if (Diag::ACK) DIAG(F("VB cv=%d value=%d"),ackManagerCv,ackManagerByte);
           byte message[] = { cv1(VERIFY_BYTE, ackManagerCv), cv2(ackManagerCv), ackManagerByte};
-          DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS);
+          if (!DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS)) return;  // queue full, try again next loop
           DCCWaveform::progTrack.setAckPending(); 
         }
         break;
@@ -783,7 +1359,7 @@ void DCC::ackManagerLoop() {
           if (Diag::ACK) DIAG(F("V%d cv=%d bit=%d"),opcode==V1, ackManagerCv,ackManagerBitNum); 
           byte instruction = VERIFY_BIT | (opcode==V0?BIT_OFF:BIT_ON) | ackManagerBitNum;
           byte message[] = {cv1(BIT_MANIPULATE, ackManagerCv), cv2(ackManagerCv), instruction };
-          DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS);
+          if (!DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS)) return;  // queue full, try again next loop
           DCCWaveform::progTrack.setAckPending(); 
         }
         break;
@@ -850,6 +1426,8 @@ void DCC::ackManagerLoop() {
      case SETCV:
           ackManagerProg++; 
           ackManagerCv=GETFLASH(ackManagerProg);
+          ackManagerProg++; 
+          ackManagerCv|=GETFLASH(ackManagerProg)<<8;
           break;
 
      case SETBYTE:
@@ -875,12 +1453,8 @@ void DCC::ackManagerLoop() {
           return;            
 
      case ITSKIP:
-          if (!ackReceived) break; 
-          // SKIP opcodes until SKIPTARGET found
-          while (opcode!=SKIPTARGET) {
-            ackManagerProg++; 
-            opcode=GETFLASH(ackManagerProg);
-          }
+          ackManagerProg++;   // offset to SKIPTARGET, resolved by ACK_PROGRAM
+          if (ackReceived) ackManagerProg+=GETFLASH(ackManagerProg);
           break;
      case SKIPTARGET: 
           break;     
@@ -893,29 +1467,73 @@ void DCC::ackManagerLoop() {
     ackManagerProg++;
   }
 }
-void DCC::callback(int value) {
+// Ends the running job, leaving the prog track powered when another job is waiting
+void DCC::ackManagerAbort() {
     ackManagerProg=NULL;  // no more steps to execute
-    if (DCCWaveform::progTrack.autoPowerOff) {
+    if (DCCWaveform::progTrack.autoPowerOff && progJobCount<=1) {
       if (Diag::ACK) DIAG(F("Auto Prog power off"));
       DCCWaveform::progTrack.doAutoPowerOff();
     }
 
     // Restore <1 JOIN> to state before BASELINE
     setProgTrackSyncMain(ackManagerRejoin);
-    
-    if (Diag::ACK) DIAG(F("Callback(%d)"),value);
-    (ackManagerCallback)( value);
+}
+
+// A read starts by verifying the cached value, when there is one, and only 
+// reads bit by bit if that is not acked. VERIFY_BYTE_PROG returns the value either way.
+void DCC::startRead(int cv, bool skipBaseline) {
+  ackManagerCv=cv;
+  if (CVCache::get(cv, ackManagerByte)) {
+    if (Diag::ACK) DIAG(F("CV cache guess cv=%d value=%d"), cv, ackManagerByte);
+    ackManagerProg=VERIFY_BYTE_PROG;
+  }
+  else ackManagerProg=READ_CV_PROG;
+  if (skipBaseline) ackManagerProg++;   // both start with BASELINE
+}
+
+// Learn from the result of the running job
+void DCC::cacheResult(const PROG_JOB & job, int value) {
+  if (value<0) return;
+  if (job.program==READ_CV_PROG || job.program==VERIFY_BYTE_PROG)
+    CVCache::put(ackManagerCv, value);
+  else if (value!=1) return;
+  else if (job.program==WRITE_BYTE_PROG) 
+    CVCache::put(ackManagerCv, job.byteValueOrBitnum);
+  else if (job.program==WRITE_BIT0_PROG || job.program==WRITE_BIT1_PROG)
+    CVCache::putBit(ackManagerCv, job.byteValueOrBitnum, job.program==WRITE_BIT1_PROG);
+  else if (job.program==SHORT_LOCO_ID_PROG || job.program==LONG_LOCO_ID_PROG)
+    CVCache::forgetDecoder();
+}
+
+void DCC::callback(int value) {
+    PROG_JOB & job=progJobs[0];
+    cacheResult(job, value);
+    job.reply.cv=ackManagerCv;
+    job.reply.ms=millis()-progCvStart;
+    job.reply.more= value!=-2 && nextBulkCv(job);
+    if (Diag::ACK) DIAG(F("Callback(%d) cv=%d %dmS"),value, ackManagerCv, job.reply.ms);
+    if (job.reply.more) {
+      // Next CV of a bulk read, past the BASELINE power up and reset wait
+      startRead(job.cv, true);
+      progCvStart=millis();
+      job.deadline=progDeadline(job.reply, true);
+      progReply(job.reply, value);
+      return;
+    }
+    ackManagerAbort();
+    PROG_REPLY reply=job.reply;
+    removeProgJob(0);
+    if (progJobCount==0) CVCache::flush();
+    progReply(reply, value);
 }
 
  void DCC::displayCabList(Print * stream) {
 
     int used=0;
-    for (int reg = 0; reg < MAX_LOCOS; reg++) {
-       if (speedTable[reg].loco>0) {
+    for (int reg=nextLoco(0); reg>=0; reg=nextLoco(reg+1)) {
         used ++;
         StringFormatter::send(stream,F("cab=%d, speed=%d, dir=%c \n"),       
            speedTable[reg].loco,  speedTable[reg].speedCode & 0x7f,(speedTable[reg].speedCode & 0x80) ? 'F':'R');
-       }
      }
      StringFormatter::send(stream,F("Used=%d, max=%d\n"),used,MAX_LOCOS);
      
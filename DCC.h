@@ -21,46 +21,83 @@
 #include <Arduino.h>
 #include "MotorDriver.h"
 #include "MotorDrivers.h"
+#include "DCCWaveform.h"
 #include "FSH.h"
+#include "AckProgram.h"
 
 typedef void (*ACK_CALLBACK)(int16_t result);
 
-enum ackOp : byte
-{           // Program opcodes for the ack Manager
-  BASELINE, // ensure enough resets sent before starting and obtain baseline current
-  W0,
-  W1,               // issue write bit (0..1) packet
-  WB,               // issue write byte packet
-  VB,               // Issue validate Byte packet
-  V0,               // Issue validate bit=0 packet
-  V1,               // issue validate bit=1 packlet
-  WACK,             // wait for ack (or absence of ack)
-  ITC1,             // If True Callback(1)  (if prevous WACK got an ACK)
-  ITC0,             // If True callback(0);
-  ITCB,             // If True callback(byte)
-  ITCB7,            // If True callback(byte &0x7F)
-  NAKFAIL,          // if false callback(-1)
-  _FAIL,             // callback(-1) -- RM 2021-04-22
-  STARTMERGE,       // Clear bit and byte settings ready for merge pass
-  MERGE,            // Merge previous wack response with byte value and decrement bit number (use for readimng CV bytes)
-  SETBIT,           // sets bit number to next prog byte
-  SETCV,            // sets cv number to next prog byte
-  SETBYTE,          // sets current byte to next prog byte
-  SETBYTEH,         // sets current byte to word high byte
-  SETBYTEL,         // sets current byte to word low byte
-  STASHLOCOID,      // keeps current byte value for later
-  COMBINELOCOID,    // combines current value with stashed value and returns it
-  ITSKIP,           // skip to SKIPTARGET if ack true
-  SKIPTARGET = 0xFF // jump to target
+class RingStream;
+
+// Programming track jobs wait in a queue for the ack manager. Each job carries 
+// its reply, so a client need not stash anything while another job runs.
+struct PROG_REPLY;
+typedef void (*PROG_CALLBACK)(int16_t result, const PROG_REPLY & reply);
+const byte PROG_REPLY_PARAMS = 5;
+struct PROG_REPLY {
+  PROG_CALLBACK callback;
+  ACK_CALLBACK ackCallback;    // used instead when callback is NULL
+  Print * stream;              // where the reply goes
+  RingStream * ringStream;     // or the network client ring
+  byte client;                 // ringStream target mark
+  void * owner;                // for cancelProgJobs, eg a WiThrottle
+  byte timeout;                // seconds once running, 0 for PROG_JOB_TIMEOUT
+  int16_t p[PROG_REPLY_PARAMS];  // command parameters for the reply
+  int16_t cv;                  // set for each result: the CV it is for,
+  uint16_t ms;                 // the time it took
+  bool more;                   // and whether more bulk read results follow
 };
 
 // Allocations with memory implications..!
-// Base system takes approx 900 bytes + 8 per loco. Turnouts, Sensors etc are dynamically created
+// Base system takes approx 900 bytes + 26 per loco on AVR (32 on 32 bit processors,
+// 14 on an Uno plus 24 for the shared higher functions),
+// plus 1.5 to 3 bytes per loco for the loco index (3 to 6 above 254 locos).
+// Turnouts, Sensors etc are dynamically created.
+// The loco table can be enlarged with a build flag, eg -DMAX_LOCOS=100 on a Mega
+// (2.9KB of its 8KB RAM) or -DMAX_LOCOS=300 on an ESP32. On AVR the table 
+// may take at most half of the RAM, which is checked when compiling.
+#ifndef MAX_LOCOS
+#ifdef ARDUINO_AVR_UNO
+#define MAX_LOCOS 20
+#else
+#define MAX_LOCOS 50
+#endif
+#endif
+
+// Function states F0-F68 are remembered and refreshed, higher ones are sent once.
+const byte MAX_LOCO_FUNCTION = 68;
+const byte FN_BYTES = MAX_LOCO_FUNCTION/8 + 1;
+#ifdef ARDUINO_AVR_UNO
+// An Uno keeps F0-F31 in each loco and F32-F68 for a few locos at a time in a 
+// shared pool. Once the pool is full, a higher function is sent but not remembered.
+const byte FN_SLOT_BYTES = 4;
+const byte FN_POOL_SIZE = 4;
+#else
+const byte FN_SLOT_BYTES = FN_BYTES;
+#endif
+
+#if MAX_LOCOS < 255
+typedef byte LOCO_SLOT;
+#else
+typedef uint16_t LOCO_SLOT;
+#endif
+
+// The loco index is an open addressing hash of cab address to speed table slot.
+// Its size is a power of two with at least a third of the entries always empty.
+constexpr int locoIndexSize(int locos, int size=8) {
+  return size >= locos + locos/2 ? size : locoIndexSize(locos, size*2);
+}
+const int LOCO_INDEX_SIZE = locoIndexSize(MAX_LOCOS);
+
+// Programming track jobs, including the one running
 #ifdef ARDUINO_AVR_UNO
-const byte MAX_LOCOS = 20;
+const byte PROG_JOB_QUEUE_SIZE = 2;
 #else
-const byte MAX_LOCOS = 50;
+const byte PROG_JOB_QUEUE_SIZE = 6;
 #endif
+const byte PROG_JOB_TIMEOUT = 30;  // seconds, replies -1 after
+const unsigned int PROG_JOB_WAIT_TIMEOUT = 600;  // seconds waiting behind other jobs, eg a bulk read
+const byte PROG_LIST_SIZE = 9;     // CVs in one bulk read of a list, as many as <R LIST> can give
 
 class DCC
 {
@@ -73,14 +110,14 @@ public:
   static void setThrottle(uint16_t cab, uint8_t tSpeed, bool tDirection);
   static uint8_t getThrottleSpeed(int cab);
   static bool getThrottleDirection(int cab);
-  static void writeCVByteMain(int cab, int cv, byte bValue);
-  static void writeCVBitMain(int cab, int cv, byte bNum, bool bValue);
+  static bool writeCVByteMain(int cab, int cv, byte bValue);
+  static bool writeCVBitMain(int cab, int cv, byte bNum, bool bValue);
   static void setFunction(int cab, byte fByte, byte eByte);
   static void setFn(int cab, byte functionNumber, bool on);
   static int changeFn(int cab, byte functionNumber, bool pressed);
   static int  getFn(int cab, byte functionNumber);
-  static void updateGroupflags(byte &flags, int functionNumber);
-  static void setAccessory(int aAdd, byte aNum, bool activate);
+  static uint16_t updateGroupflags(uint16_t &flags, int functionNumber);
+  static bool setAccessory(int aAdd, byte aNum, bool activate);
   static bool writeTextPacket(byte *b, int nBytes);
   static void setProgTrackSyncMain(bool on); // when true, prog track becomes driveable
   static void setProgTrackBoost(bool on);    // when true, special prog track current limit does not apply
@@ -96,42 +133,136 @@ public:
   static void getLocoId(ACK_CALLBACK callback);
   static void setLocoId(int id,ACK_CALLBACK callback);
 
+  // Queued versions, false if the job queue is full
+  static bool readCV(int16_t cv, const PROG_REPLY & reply);
+  static bool readCVBit(int16_t cv, byte bitNum, const PROG_REPLY & reply);
+  static bool writeCVByte(int16_t cv, byte byteValue, const PROG_REPLY & reply);
+  static bool writeCVBit(int16_t cv, byte bitNum, bool bitValue, const PROG_REPLY & reply);
+  static bool verifyCVByte(int16_t cv, byte byteValue, const PROG_REPLY & reply);
+  static bool verifyCVBit(int16_t cv, byte bitNum, bool bitValue, const PROG_REPLY & reply);
+  static bool getLocoId(const PROG_REPLY & reply);
+  static bool setLocoId(int id, const PROG_REPLY & reply);
+  static byte cancelProgJobs(void * owner);  // without replies, returns the number cancelled
+  static byte cancelProgJobs(RingStream * ringStream, byte client);  // a network client's, when it has gone
+  // Queues a program from ACK_PROGRAM, starting with the cv, bit or byte and word given
+  static bool runAckProgram(const ackOp program[], const PROG_REPLY & reply,
+                            int cv=0, byte byteValueOrBitnum=0, int wordval=0);
+  // Bulk reads: one job reading the CVs first to last, or up to PROG_LIST_SIZE in cvs[],
+  // with a result for each CV in turn and reply.more set until the last.
+  static bool readCVRange(int16_t first, int16_t last, const PROG_REPLY & reply);
+  static bool readCVList(const int16_t cvs[], byte count, const PROG_REPLY & reply);
+
   // Enhanced API functions
   static void forgetLoco(int cab); // removes any speed reminders for this loco
   static void forgetAllLocos();    // removes all speed reminders
   static void displayCabList(Print *stream);
+  static void displayReminderStats(Print *stream);
+  static void setReminderMaxInterval(unsigned int ms);
+  static void setEvictAge(unsigned int seconds);   // 0 never evicts
+  static unsigned int getEvictAge();
+  static bool setLocoFlags(int cab, byte flags);  // decoder capabilities, see LocoFlags.h
+  static void setConsisted(int cab, bool on);     // loco takes its speed from an advanced consist
 
   static FSH *getMotorShieldName();
-  static inline void setGlobalSpeedsteps(byte s) {
-    globalSpeedsteps = s;
-  };
+  static void setGlobalSpeedsteps(byte s);
 
 private:
   struct LOCO
   {
     int loco;
     byte speedCode;
-    byte groupFlags;
-    unsigned long functions;
+    uint16_t groupFlags;   // function groups ever touched, FN_GROUP_x
+    byte locoFlags;        // copy of the persisted LocoFlags for this cab, and LOCO_CONSISTED
+#ifndef ARDUINO_AVR_UNO
+    byte speedPacketLength;  // 0 when speedPacket must be rebuilt
+    byte speedPacket[MAX_PACKET_SIZE+1];  // encoded speed reminder, checksum included
+#endif
+    byte functions[FN_SLOT_BYTES];  // bitset of F0-F68 (F0-F31 on an Uno), F0 in bit 0 of the first byte
+    uint16_t lastRefresh;  // reminder ticks when speed was last sent
+    uint16_t lastChange;   // reminder ticks when speed or functions were last changed
   };
+  enum REMINDER_CLASS : byte { REMIND_MOVING, REMIND_RECENT, REMIND_IDLE, REMIND_CLASSES };
   static byte joinRelay;
   static byte loopStatus;
-  static void setThrottle2(uint16_t cab, uint8_t speedCode);
+  static void setThrottle2(uint16_t cab, uint8_t speedCode, PACKET_PRIORITY priority=PACKET_PRIORITY::SPEED);
   static void updateLocoReminder(int loco, byte speedCode);
-  static void setFunctionInternal(int cab, byte fByte, byte eByte);
+  static void setFunctionInternal(int cab, byte fByte, byte eByte, PACKET_PRIORITY priority=PACKET_PRIORITY::REMINDER);
   static bool issueReminder(int reg);
-  static int nextLoco;
+  static int pickReminder();
+  static void noteRefresh(int reg);
+  static void issueFunctionGroup(int loco, const byte functions[], uint16_t groupMask, PACKET_PRIORITY priority);
+  static void changeFunction(int reg, byte functionNumber, bool on);
+  static const byte * locoFunctions(int reg, byte buffer[FN_BYTES]);
+  static bool setLocoFunction(int reg, byte functionNumber, bool on);
+  static byte encodeSpeedReminder(int reg, byte packet[]);
+  static void forgetSpeedReminder(int reg);
+  static byte buildSpeedPacket(byte b[], uint16_t cab, byte speedCode);
+  static byte buildSpeedAndFunctions(byte b[], int cab, byte speedCode, const byte functions[], uint16_t groupFlags);
+  static uint16_t reminderGroups;
+  static const byte LOCO_CONSISTED = 0x80;  // runtime only, never a stored LocoFlags bit
+  static int consistLead(int cab, bool & reversed);
+  static int reminderReg;
+  static uint16_t reminderMaxTicks;
+  static uint16_t worstRefresh[REMIND_CLASSES];
   static FSH *shieldName;
   static byte globalSpeedsteps;
 
   static LOCO speedTable[MAX_LOCOS];
+  static LOCO_SLOT locoIndex[LOCO_INDEX_SIZE];     // speed table slot+1, 0 is empty
+  static byte locoOccupied[(MAX_LOCOS+7)/8];       // bitmap of speed table slots in use
+#ifdef ARDUINO_AVR_UNO
+  struct FN_POOL_ENTRY {
+    LOCO_SLOT owner;                               // speed table slot+1, 0 is free
+    byte functions[FN_BYTES-FN_SLOT_BYTES];        // F32-F68
+  };
+  static FN_POOL_ENTRY fnPool[FN_POOL_SIZE];
+  static int fnPoolEntry(int reg, bool allocate);
+  static const int FN_POOL_BYTES = sizeof(FN_POOL_ENTRY)*FN_POOL_SIZE;
+#else
+  static const int FN_POOL_BYTES = 0;
+#endif
+#if defined(__AVR__)
+  static_assert(sizeof(LOCO)*MAX_LOCOS + sizeof(LOCO_SLOT)*LOCO_INDEX_SIZE + (MAX_LOCOS+7)/8 + FN_POOL_BYTES
+                <= (RAMEND-RAMSTART+1)/2, "MAX_LOCOS is too large for the RAM of this processor");
+#endif
   static byte cv1(byte opcode, int cv);
   static byte cv2(int cv);
-  static int lookupSpeedTable(int locoId);
+  static int lookupSpeedTable(int locoId, bool autoCreate=true);
+  static int findLocoIndex(int locoId);
+  static void removeLoco(int reg);
+  static int nextLoco(int reg);
+  static int evictLoco();
+  static uint16_t evictTicks;
   static void issueReminders();
   static void callback(int value);
 
   // ACK MANAGER
+  struct PROG_JOB
+  {
+    ackOp const *program;
+    int cv;
+    byte byteValueOrBitnum;
+    int wordval;
+    unsigned long deadline;   // millis, for waiting then for running
+    int lastCv;               // bulk read of a range
+    byte listCount;           // bulk read of list
+    byte listIndex;
+    int16_t list[PROG_LIST_SIZE];
+    PROG_REPLY reply;
+  };
+  static PROG_JOB progJobs[PROG_JOB_QUEUE_SIZE];   // [0] runs when ackManagerProg
+  static byte progJobCount;
+  static unsigned long progCvStart;
+  static bool nextBulkCv(PROG_JOB & job);
+  static void startRead(int cv, bool skipBaseline);
+  static void cacheResult(const PROG_JOB & job, int value);
+  static unsigned long progDeadline(const PROG_REPLY & reply, bool running);
+  static bool queueProgJob(ackOp const program[], int cv, byte byteValueOrBitnum, int wordval, const PROG_REPLY & reply);
+  static void removeProgJob(byte index);
+  static void cancelProgJob(byte index);
+  static void expireProgJobs();
+  static void progReply(const PROG_REPLY & reply, int16_t result);
+  static PROG_REPLY ackReply(ACK_CALLBACK callback);
   static ackOp const *ackManagerProg;
   static byte ackManagerByte;
   static byte ackManagerBitNum;
@@ -140,15 +271,14 @@ private:
   static byte ackManagerStash;
   static bool ackReceived;
   static bool ackManagerRejoin;
-  static ACK_CALLBACK ackManagerCallback;
-  static void ackManagerSetup(int cv, byte bitNumOrbyteValue, ackOp const program[], ACK_CALLBACK callback);
-  static void ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback);
+  static void ackManagerAbort();
   static void ackManagerLoop();
   static bool checkResets( uint8_t numResets);
   static const int PROG_REPEATS = 8; // repeats of programming commands (some decoders need at least 8 to be reliable)
 
   // NMRA codes #
   static const byte SET_SPEED = 0x3f;
+  static const byte SET_SPEED_AND_FUNCTIONS = 0x3c;  // RCN-212
   static const byte WRITE_BYTE_MAIN = 0xEC;
   static const byte WRITE_BIT_MAIN = 0xE8;
   static const byte WRITE_BYTE = 0x7C;
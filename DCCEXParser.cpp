@@ -24,6 +24,9 @@
 #include "Turnouts.h"
 #include "Outputs.h"
 #include "Sensors.h"
+#include "LocoFlags.h"
+#include "Consists.h"
+#include "ISRProfile.h"
 #include "freeMemory.h"
 #include "GITHUB_SHA.h"
 #include "version.h"
@@ -61,13 +64,17 @@ const int16_t HASH_KEYWORD_LCN = 15137;
 const int16_t HASH_KEYWORD_RESET = 26133;
 const int16_t HASH_KEYWORD_SPEED28 = -17064;
 const int16_t HASH_KEYWORD_SPEED128 = 25816;
+const int16_t HASH_KEYWORD_QUEUE = -27247;
+const int16_t HASH_KEYWORD_REMINDERS = 21405;
+const int16_t HASH_KEYWORD_RCN212 = -29972;
+const int16_t HASH_KEYWORD_EVICT = 26029;
+const int16_t HASH_KEYWORD_CV19 = 32711;
+const int16_t HASH_KEYWORD_ISR = 12328;
+const int16_t HASH_KEYWORD_BULK = -23792;
+const int16_t HASH_KEYWORD_LIST = -30366;
+static_assert(PROG_LIST_SIZE == DCCEXParser::MAX_COMMAND_PARAMS-1, "<R LIST> takes every CV the parser splits out");
 
-int16_t DCCEXParser::stashP[MAX_COMMAND_PARAMS];
-bool DCCEXParser::stashBusy;
 
-Print *DCCEXParser::stashStream = NULL;
-RingStream *DCCEXParser::stashRingStream = NULL;
-byte DCCEXParser::stashTarget=0;
 
 // This is a JMRI command parser, one instance per incoming stream
 // It doesnt know how the string got here, nor how it gets back.
@@ -351,7 +358,7 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
           || ((p[activep]  & 0x01) != p[activep]) // invalid activate 0|1
           ) break; 
             
-          DCC::setAccessory(address, subaddress,p[activep]==1);
+          if (!DCC::setAccessory(address, subaddress,p[activep]==1)) break; // track busy
         }
         return;
      
@@ -370,12 +377,22 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
             return;
         break;
 
+    case 'C': // CONSIST <C ...>
+        if (parseC(stream, params, p))
+            return;
+        break;
+
+    case 'L': // LOCO DECODER FLAGS <L ...>
+        if (parseL(stream, params, p))
+            return;
+        break;
+
     case 'w': // WRITE CV on MAIN <w CAB CV VALUE>
-        DCC::writeCVByteMain(p[0], p[1], p[2]);
+        if (!DCC::writeCVByteMain(p[0], p[1], p[2])) break; // track busy
         return;
 
     case 'b': // WRITE CV BIT ON MAIN <b CAB CV BIT VALUE>
-        DCC::writeCVBitMain(p[0], p[1], p[2], p[3]);
+        if (!DCC::writeCVBitMain(p[0], p[1], p[2], p[3])) break; // track busy
         return;
 
     case 'M': // WRITE TRANSPARENT DCC PACKET MAIN <M REG X1 ... X9>
@@ -389,55 +406,67 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
             packet[i]=(byte)p[i+1];
             if (Diag::CMD) DIAG(F("packet[%d]=%d (0x%x)"), i, packet[i], packet[i]);
           }
-          (opcode=='M'?DCCWaveform::mainTrack:DCCWaveform::progTrack).schedulePacket(packet,params,3);  
+          if (!(opcode=='M'?DCCWaveform::mainTrack:DCCWaveform::progTrack).schedulePacket(packet,params,3))
+            break; // track busy
         }
         return;
         
+    // Prog track commands are queued, <X> only when the queue is full
     case 'W': // WRITE CV ON PROG <W CV VALUE CALLBACKNUM CALLBACKSUB>
-            if (!stashCallback(stream, p, ringStream))
+        if (params == 1) { // <W id> Write new loco id (clearing consist and managing short/long)
+            if (!DCC::setLocoId(p[0], progReply(stream, p, ringStream, callback_Wloco)))
+                break;
+        }
+        else { // WRITE CV ON PROG <W CV VALUE [CALLBACKNUM] [CALLBACKSUB]>
+            if (!DCC::writeCVByte(p[0], p[1], progReply(stream, p, ringStream, callback_W)))
                 break;
-        if (params == 1) // <W id> Write new loco id (clearing consist and managing short/long)
-            DCC::setLocoId(p[0],callback_Wloco);
-        else // WRITE CV ON PROG <W CV VALUE [CALLBACKNUM] [CALLBACKSUB]>
-            DCC::writeCVByte(p[0], p[1], callback_W);
+        }
         return;
 
     case 'V': // VERIFY CV ON PROG <V CV VALUE> <V CV BIT 0|1>
         if (params == 2)
         { // <V CV VALUE>
-            if (!stashCallback(stream, p, ringStream))
+            if (!DCC::verifyCVByte(p[0], p[1], progReply(stream, p, ringStream, callback_Vbyte)))
                 break;
-            DCC::verifyCVByte(p[0], p[1], callback_Vbyte);
             return;
         }
         if (params == 3)
         {
-            if (!stashCallback(stream, p, ringStream))
+            if (!DCC::verifyCVBit(p[0], p[1], p[2], progReply(stream, p, ringStream, callback_Vbit)))
                 break;
-            DCC::verifyCVBit(p[0], p[1], p[2], callback_Vbit);
             return;
         }
         break;
 
     case 'B': // WRITE CV BIT ON PROG <B CV BIT VALUE CALLBACKNUM CALLBACKSUB>
-        if (!stashCallback(stream, p, ringStream))
+        if (!DCC::writeCVBit(p[0], p[1], p[2], progReply(stream, p, ringStream, callback_B)))
             break;
-        DCC::writeCVBit(p[0], p[1], p[2], callback_B);
         return;
 
     case 'R': // READ CV ON PROG
+        if (params == 3 && p[0] == HASH_KEYWORD_BULK)
+        { // <R BULK FIRSTCV LASTCV> one job reading a range, <r CV VALUE MS> for each
+            if (!DCC::readCVRange(p[1], p[2], progReply(stream, p, ringStream, callback_Rbulk)))
+                break;
+            return;
+        }
+        if (params >= 2 && params <= PROG_LIST_SIZE+1 && p[0] == HASH_KEYWORD_LIST)
+        { // <R LIST CV ...> as BULK, for up to 9 CVs: any more are not split out, and
+          // the command must fit the 50 character buffer, eg 9 CVs of up to 3 digits
+            if (!DCC::readCVList(p+1, params-1, progReply(stream, p, ringStream, callback_Rbulk)))
+                break;
+            return;
+        }
         if (params == 3)
         { // <R CV CALLBACKNUM CALLBACKSUB>
-            if (!stashCallback(stream, p, ringStream))
+            if (!DCC::readCV(p[0], progReply(stream, p, ringStream, callback_R)))
                 break;
-            DCC::readCV(p[0], callback_R);
             return;
         }
         if (params == 0)
         { // <R> New read loco id
-            if (!stashCallback(stream, p, ringStream))
+            if (!DCC::getLocoId(progReply(stream, p, ringStream, callback_Rloco)))
                 break;
-            DCC::getLocoId(callback_Rloco);
             return;
         }
         break;
@@ -679,9 +708,8 @@ bool DCCEXParser::parseT(Print *stream, int16_t params, int16_t p[])
     case 2: // <T id 0|1>  activate turnout
     {
         Turnout *tt = Turnout::get(p[0]);
-        if (!tt)
-            return false;
-        tt->activate(p[1]);
+        if (!tt || !tt->activate(p[1]))
+            return false;  // unknown or track busy
         StringFormatter::send(stream, F("<H %d %d>\n"), tt->data.id, (tt->data.tStatus & STATUS_ACTIVE)!=0);
     }
         return true;
@@ -729,6 +757,65 @@ bool DCCEXParser::parseS(Print *stream, int16_t params, int16_t p[])
     return false;
 }
 
+bool DCCEXParser::parseL(Print *stream, int16_t params, int16_t p[])
+{
+    switch (params)
+    {
+    case 3: // <L cab RCN212 0|1> decoder accepts the combined speed and functions instruction
+    {
+        if (p[0] <= 0 || p[1] != HASH_KEYWORD_RCN212 || (p[2] != 0 && p[2] != 1))
+            return false;
+        byte flags = LocoFlags::get(p[0]);
+        if (p[2]) flags |= LOCO_FLAG_RCN212;
+        else flags &= ~LOCO_FLAG_RCN212;
+        if (!DCC::setLocoFlags(p[0], flags))
+            return false;
+        LocoFlags::print(stream, p[0]);
+        return true;
+    }
+
+    case 1: // <L cab> show flags for one loco
+        if (p[0] <= 0)
+            return false;
+        LocoFlags::print(stream, p[0]);
+        return true;
+
+    case 0: // <L> list locos with flags
+        LocoFlags::printAll(stream);
+        return true;
+
+    default: // invalid number of arguments
+        break;
+    }
+    return false;
+}
+
+bool DCCEXParser::parseC(Print *stream, int16_t params, int16_t p[])
+{
+    switch (params)
+    {
+    case 0: // <C> list consists
+        Consist::printAll(stream);
+        return true;
+
+    case 1: // <C id> dissolve consist
+        if (!Consist::remove(p[0]))
+            return false;
+        StringFormatter::send(stream, F("<O>\n"));
+        return true;
+
+    default: // <C id [CV19] loco1 loco2 ...> create consist, negative loco runs reversed
+    {
+        bool advanced = p[1] == HASH_KEYWORD_CV19;
+        byte first = advanced ? 2 : 1;
+        if (params <= first || !Consist::create(p[0], advanced, params - first, p + first))
+            return false;
+        StringFormatter::send(stream, F("<O>\n"));
+        return true;
+    }
+    }
+}
+
 bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
 {
     if (params == 0)
@@ -744,6 +831,28 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
         StringFormatter::send(stream, F("Free memory=%d\n"), minimumFreeMemory());
         break;
 
+    case HASH_KEYWORD_REMINDERS: // <D REMINDERS [maxIntervalmS]>
+        if (params >= 2) DCC::setReminderMaxInterval(p[1]);
+        DCC::displayReminderStats(stream);
+        return true;
+
+    case HASH_KEYWORD_EVICT: // <D EVICT [seconds]>  0 never evicts
+        if (params >= 2) DCC::setEvictAge(p[1]);
+        StringFormatter::send(stream, F("Evict stopped locos unused for %dS\n"), DCC::getEvictAge());
+        return true;
+
+    case HASH_KEYWORD_QUEUE: // <D QUEUE>
+        DCCWaveform::mainTrack.displayQueueStats(stream);
+        DCCWaveform::progTrack.displayQueueStats(stream);
+        return true;
+
+#ifdef DCC_ISR_PROFILE
+    case HASH_KEYWORD_ISR: // <D ISR [RESET]>  only with -DDCC_ISR_PROFILE
+        ISRProfile::print(stream);
+        if (params >= 2 && p[1] == HASH_KEYWORD_RESET) ISRProfile::reset();
+        return true;
+#endif
+
     case HASH_KEYWORD_ACK: // <D ACK ON/OFF> <D ACK [LIMIT|MIN|MAX] Value>
 	if (params >= 3) {
 	    if (p[1] == HASH_KEYWORD_LIMIT) {
@@ -814,71 +923,77 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
     return false;
 }
 
-// CALLBACKS must be static
-bool DCCEXParser::stashCallback(Print *stream, int16_t p[MAX_COMMAND_PARAMS], RingStream * ringStream)
+// CALLBACKS must be static, what they need to reply travels with the prog job
+PROG_REPLY DCCEXParser::progReply(Print *stream, int16_t p[MAX_COMMAND_PARAMS], RingStream * ringStream, PROG_CALLBACK callback)
 {
-    if (stashBusy )
-        return false;
-    stashBusy = true;
-    stashStream = stream;
-    stashRingStream=ringStream;
-    if (ringStream) stashTarget= ringStream->peekTargetMark();
-    memcpy(stashP, p, MAX_COMMAND_PARAMS * sizeof(p[0]));
-    return true;
+    PROG_REPLY reply={};
+    reply.callback=callback;
+    reply.stream = stream;
+    reply.ringStream=ringStream;
+    if (ringStream) reply.client= ringStream->peekTargetMark();
+    memcpy(reply.p, p, PROG_REPLY_PARAMS * sizeof(p[0]));
+    return reply;
 }
 
-Print * DCCEXParser::getAsyncReplyStream() {
-       if (stashRingStream) {
-           stashRingStream->mark(stashTarget);
-           return stashRingStream;
+Print * DCCEXParser::getAsyncReplyStream(const PROG_REPLY & reply) {
+       if (reply.ringStream) {
+           reply.ringStream->mark(reply.client);
+           return reply.ringStream;
        }
-       return stashStream;
+       return reply.stream;
 }
 
-void DCCEXParser::commitAsyncReplyStream() {
-     if (stashRingStream) stashRingStream->commit();
-     stashBusy = false;
+void DCCEXParser::commitAsyncReplyStream(const PROG_REPLY & reply) {
+     if (reply.ringStream) reply.ringStream->commit();
 }
 
-void DCCEXParser::callback_W(int16_t result)
+void DCCEXParser::callback_W(int16_t result, const PROG_REPLY & reply)
 {
-    StringFormatter::send(getAsyncReplyStream(),
-          F("<r%d|%d|%d %d>\n"), stashP[2], stashP[3], stashP[0], result == 1 ? stashP[1] : -1);
-    commitAsyncReplyStream();
+    StringFormatter::send(getAsyncReplyStream(reply),
+          F("<r%d|%d|%d %d>\n"), reply.p[2], reply.p[3], reply.p[0], result == 1 ? reply.p[1] : -1);
+    commitAsyncReplyStream(reply);
 }
 
-void DCCEXParser::callback_B(int16_t result)
+void DCCEXParser::callback_B(int16_t result, const PROG_REPLY & reply)
+{
+    StringFormatter::send(getAsyncReplyStream(reply), 
+          F("<r%d|%d|%d %d %d>\n"), reply.p[3], reply.p[4], reply.p[0], reply.p[1], result == 1 ? reply.p[2] : -1);
+    commitAsyncReplyStream(reply);
+}
+void DCCEXParser::callback_Vbit(int16_t result, const PROG_REPLY & reply)
 {
-    StringFormatter::send(getAsyncReplyStream(), 
-          F("<r%d|%d|%d %d %d>\n"), stashP[3], stashP[4], stashP[0], stashP[1], result == 1 ? stashP[2] : -1);
-    commitAsyncReplyStream();
+    StringFormatter::send(getAsyncReplyStream(reply), F("<v %d %d %d>\n"), reply.p[0], reply.p[1], result);
+    commitAsyncReplyStream(reply);
 }
-void DCCEXParser::callback_Vbit(int16_t result)
+void DCCEXParser::callback_Vbyte(int16_t result, const PROG_REPLY & reply)
 {
-    StringFormatter::send(getAsyncReplyStream(), F("<v %d %d %d>\n"), stashP[0], stashP[1], result);
-    commitAsyncReplyStream();
+    StringFormatter::send(getAsyncReplyStream(reply), F("<v %d %d>\n"), reply.p[0], result);
+    commitAsyncReplyStream(reply);
 }
-void DCCEXParser::callback_Vbyte(int16_t result)
+
+void DCCEXParser::callback_R(int16_t result, const PROG_REPLY & reply)
 {
-    StringFormatter::send(getAsyncReplyStream(), F("<v %d %d>\n"), stashP[0], result);
-    commitAsyncReplyStream();
+    StringFormatter::send(getAsyncReplyStream(reply), F("<r%d|%d|%d %d>\n"), reply.p[1], reply.p[2], reply.p[0], result);
+    commitAsyncReplyStream(reply);
 }
 
-void DCCEXParser::callback_R(int16_t result)
+void DCCEXParser::callback_Rbulk(int16_t result, const PROG_REPLY & reply)
 {
-    StringFormatter::send(getAsyncReplyStream(), F("<r%d|%d|%d %d>\n"), stashP[1], stashP[2], stashP[0], result);
-    commitAsyncReplyStream();
+    Print * stream=getAsyncReplyStream(reply);
+    StringFormatter::send(stream, F("<r %d %d %d>\n"), reply.cv, result, reply.ms);
+    if (!reply.more) StringFormatter::send(stream, F("<r BULK END>\n"));
+    commitAsyncReplyStream(reply);
 }
 
-void DCCEXParser::callback_Rloco(int16_t result)
+void DCCEXParser::callback_Rloco(int16_t result, const PROG_REPLY & reply)
 {
-    StringFormatter::send(getAsyncReplyStream(), F("<r %d>\n"), result);
-    commitAsyncReplyStream();
+    StringFormatter::send(getAsyncReplyStream(reply), F("<r %d>\n"), result);
+    commitAsyncReplyStream(reply);
 }
 
-void DCCEXParser::callback_Wloco(int16_t result)
+void DCCEXParser::callback_Wloco(int16_t result, const PROG_REPLY & reply)
 {
-    if (result==1) result=stashP[0]; // pick up original requested id from command
-    StringFormatter::send(getAsyncReplyStream(), F("<w %d>\n"), result);
-    commitAsyncReplyStream();
+    if (result==1) result=reply.p[0]; // pick up original requested id from command
+    StringFormatter::send(getAsyncReplyStream(reply), F("<w %d>\n"), result);
+    commitAsyncReplyStream(reply);
 }
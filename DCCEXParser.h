@@ -21,6 +21,7 @@
 #include <Arduino.h>
 #include "FSH.h"
 #include "RingStream.h"
+#include "DCC.h"
 
 typedef void (*FILTER_CALLBACK)(Print * stream, byte & opcode, byte & paramCount, int16_t p[]);
 typedef void (*AT_COMMAND_CALLBACK)(const byte * command);
@@ -49,26 +50,23 @@ struct DCCEXParser
      bool parseT(Print * stream, int16_t params, int16_t p[]);
      bool parseZ(Print * stream, int16_t params, int16_t p[]);
      bool parseS(Print * stream,  int16_t params, int16_t p[]);
+     bool parseL(Print * stream,  int16_t params, int16_t p[]);
+     bool parseC(Print * stream,  int16_t params, int16_t p[]);
      bool parsef(Print * stream,  int16_t params, int16_t p[]);
      bool parseD(Print * stream,  int16_t params, int16_t p[]);
 
-     static Print * getAsyncReplyStream();
-     static void commitAsyncReplyStream();
+     static Print * getAsyncReplyStream(const PROG_REPLY & reply);
+     static void commitAsyncReplyStream(const PROG_REPLY & reply);
 
-    static bool stashBusy;
-    static byte stashTarget;
-    static Print * stashStream;
-    static RingStream * stashRingStream;
-    
-    static int16_t stashP[MAX_COMMAND_PARAMS];
-    bool stashCallback(Print * stream, int16_t p[MAX_COMMAND_PARAMS], RingStream * ringStream);
-    static void callback_W(int16_t result);
-    static void callback_B(int16_t result);        
-    static void callback_R(int16_t result);
-    static void callback_Rloco(int16_t result);
-    static void callback_Wloco(int16_t result);
-    static void callback_Vbit(int16_t result);
-    static void callback_Vbyte(int16_t result);
+    static PROG_REPLY progReply(Print * stream, int16_t p[MAX_COMMAND_PARAMS], RingStream * ringStream, PROG_CALLBACK callback);
+    static void callback_W(int16_t result, const PROG_REPLY & reply);
+    static void callback_B(int16_t result, const PROG_REPLY & reply);        
+    static void callback_R(int16_t result, const PROG_REPLY & reply);
+    static void callback_Rbulk(int16_t result, const PROG_REPLY & reply);
+    static void callback_Rloco(int16_t result, const PROG_REPLY & reply);
+    static void callback_Wloco(int16_t result, const PROG_REPLY & reply);
+    static void callback_Vbit(int16_t result, const PROG_REPLY & reply);
+    static void callback_Vbyte(int16_t result, const PROG_REPLY & reply);
     static FILTER_CALLBACK  filterCallback;
     static FILTER_CALLBACK  filterRMFTCallback;
     static AT_COMMAND_CALLBACK  atCommandCallback;
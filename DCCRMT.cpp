@@ -0,0 +1,228 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "DCCRMT.h"
+
+uint8_t DCCRMTEncoder::encode(uint32_t items[], uint8_t count, const uint8_t image[], uint8_t bitCount, uint8_t & bit) {
+  uint8_t n=0;
+  for (; n<count && bit<bitCount; n++, bit++) {
+    bool one=image[bit>>3] & (0x80>>(bit&7));
+    uint16_t half = one ? RMT_ONE_HALF_US : RMT_ZERO_HALF_US;
+    items[n]=item(half, half);
+  }
+  return n;
+}
+
+uint32_t DCCRMTEncoder::durationUs(const uint32_t items[], uint8_t count) {
+  uint32_t us=0;
+  for (uint8_t i=0; i<count; i++) us+=(items[i] & 0x7FFF) + ((items[i] >> 16) & 0x7FFF);
+  return us;
+}
+
+void DCCRMTRing::begin(volatile uint32_t * memory, NEXT_IMAGE next, void * context) {
+  this->memory=memory;
+  this->nextImage=next;
+  this->context=context;
+  image=NULL;
+  bitCount=0;
+  bit=0;
+  sending=0;
+}
+
+void DCCRMTRing::start() {
+  bit=0;   // the image that was going into the ring goes again from its beginning
+  for (uint8_t quarter=0; quarter<3; quarter++) fill(quarter);
+  memory[3*RMT_QUARTER_ITEMS]=0;
+  sending=0;
+}
+
+uint32_t DCCRMTRing::sent(uint8_t reading) {
+  uint32_t us=0;
+  // More than one quarter when the interrupt was held off
+  while (sending!=reading) {
+    us+=quarterUs[sending];
+    fill((sending+3) & 3);                  // over the end marker
+    memory[sending*RMT_QUARTER_ITEMS]=0;    // which moves on to the quarter just sent
+    sending=(sending+1) & 3;
+  }
+  return us;
+}
+
+void DCCRMTRing::fill(uint8_t quarter) {
+  uint32_t items[RMT_QUARTER_ITEMS];
+  uint8_t count=0;
+  while (count<RMT_QUARTER_ITEMS) {
+    if (bit==bitCount) {
+      image=nextImage(context, bitCount);
+      bit=0;
+    }
+    count+=DCCRMTEncoder::encode(items+count, RMT_QUARTER_ITEMS-count, image, bitCount, bit);
+  }
+  volatile uint32_t * to=memory+quarter*RMT_QUARTER_ITEMS;
+  for (uint8_t i=0; i<RMT_QUARTER_ITEMS; i++) to[i]=items[i];
+  quarterUs[quarter]=DCCRMTEncoder::durationUs(items, RMT_QUARTER_ITEMS);
+}
+
+#if defined(ESP32)
+#include <Arduino.h>
+#include <rom/gpio.h>
+#include <soc/gpio_sig_map.h>
+#include <soc/rmt_struct.h>
+#include "DCCWaveform.h"
+#include "DIAG.h"
+#include "ISRProfile.h"
+
+// Each channel uses two memory blocks, the ring of RMT_RING_ITEMS items.
+const rmt_channel_t MAIN_CHANNEL = RMT_CHANNEL_0;
+const rmt_channel_t PROG_CHANNEL = RMT_CHANNEL_2;
+const uint8_t RMT_BLOCK_ITEMS = 64;     // memory block of each channel
+const uint8_t RMT_CLOCK_DIVIDER = 80;   // 80MHz APB clock to 1uS
+const TickType_t ACK_CHECK_TICKS = 1;   // 1mS, ack pulses are at least 2000uS 
+const BaseType_t ACK_TASK_PRIORITY = 2; // above loop(), as the interrupt is elsewhere
+static_assert(configTICK_RATE_HZ >= 1000, "the ack task needs a 1mS tick");
+
+DCCRMTRing DCCRMT::rings[2];
+bool DCCRMT::progJoined=false;
+
+void DCCRMT::begin() {
+  MotorDriver * mainDriver=DCCWaveform::mainTrack.motorDriver;
+  MotorDriver * progDriver=DCCWaveform::progTrack.motorDriver;
+  bool mainOn=startChannel(MAIN_CHANNEL, mainDriver->getSignalPin(), mainDriver->getSignalPin2());
+  bool progOn=startChannel(PROG_CHANNEL, progDriver->getSignalPin(), progDriver->getSignalPin2());
+
+  // Items are written straight into channel memory, which the RMT sends
+  // round and round until it meets an end marker.
+  RMT.apb_conf.fifo_mask=RMT_DATA_MODE_MEM;
+  RMT.apb_conf.mem_tx_wrap_en=1;
+  // The RMT driver is not installed, this handles all the RMT interrupts. 
+  // Not ESP_INTR_FLAG_IRAM: refill needs the packet queue code, which is in 
+  // flash. So while flash is written (EEPROM commits) the refills are held 
+  // back, and after two quarters of the ring the RMT stops at the end marker
+  // with the signal low, until the write is done and the ring starts again.
+  rmt_isr_register(interrupt, NULL, 0, NULL);
+
+  // checkAck samples the current, which cannot be done in the RMT interrupt. 
+  // Its task runs on loop()'s core, so it interrupts the ack manager just as 
+  // the timer interrupt does on other boards, and never runs alongside it.
+  xTaskCreatePinnedToCore(ackTask, "ack", 2048, NULL, ACK_TASK_PRIORITY, NULL, xPortGetCoreID());
+
+  if (mainOn) startRing(MAIN_CHANNEL);
+  if (progOn) startRing(PROG_CHANNEL);
+  DIAG(F("RMT waveform main=%d prog=%d"), mainOn, progOn);
+}
+
+bool DCCRMT::startChannel(rmt_channel_t channel, uint8_t pin, uint8_t pin2) {
+  if (pin==UNUSED_PIN) return false;
+  rmt_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.rmt_mode=RMT_MODE_TX;
+  config.channel=channel;
+  config.gpio_num=(gpio_num_t)pin;
+  config.mem_block_num=RMT_RING_ITEMS/RMT_BLOCK_ITEMS;
+  config.clk_div=RMT_CLOCK_DIVIDER;
+  config.tx_config.loop_en=false;
+  config.tx_config.carrier_en=false;
+  config.tx_config.idle_output_en=true;
+  config.tx_config.idle_level=RMT_IDLE_LEVEL_LOW;
+  if (rmt_config(&config)!=ESP_OK) return false;
+  routePin(pin, pin2, channel);
+  return true;
+}
+
+void DCCRMT::startRing(rmt_channel_t channel) {
+  bool isMain= channel==MAIN_CHANNEL;
+  DCCRMTRing & ring=rings[isMain ? 0 : 1];
+  DCCWaveform * track= isMain ? &DCCWaveform::mainTrack : &DCCWaveform::progTrack;
+  ring.begin((volatile uint32_t *)&RMTMEM.chan[channel].data32[0].val, nextImage, track);
+  ring.start();
+  rmt_set_tx_thr_intr_en(channel, true, RMT_QUARTER_ITEMS);
+  rmt_tx_start(channel, true);   // also enables the end interrupt
+}
+
+// Connect the signal pins to an RMT channel output, pin2 inverted.
+void DCCRMT::routePin(uint8_t pin, uint8_t pin2, rmt_channel_t channel) {
+  gpio_matrix_out(pin, RMT_SIG_OUT0_IDX + channel, false, false);
+  if (pin2!=UNUSED_PIN) {
+    pinMode(pin2, OUTPUT);
+    gpio_matrix_out(pin2, RMT_SIG_OUT0_IDX + channel, true, false);
+  }
+}
+
+void DCCRMT::interrupt(void * arg) {
+  (void) arg;
+  uint32_t status=RMT.int_st.val;
+  RMT.int_clr.val=status;
+  refill(MAIN_CHANNEL, status);
+  refill(PROG_CHANNEL, status);
+}
+
+// A quarter of the ring has been sent, or the RMT has stopped at the end 
+// marker and starts again. JOIN takes effect here, by routing the prog pins 
+// to the main channel. Runs from flash, like the rest of the waveform code.
+void DCCRMT::refill(rmt_channel_t channel, uint32_t status) {
+  bool ended= status & BIT(channel*3);      // RMT_CHn_TX_END_INT
+  bool sent= status & BIT(24+channel);      // RMT_CHn_TX_THR_EVENT_INT
+  if (!ended && !sent) return;
+  bool isMain= channel==MAIN_CHANNEL;
+#ifdef DCC_ISR_PROFILE
+  uint32_t mark=ISRProfile::now();
+#endif
+  if (!isMain && progJoined!=DCCWaveform::progTrackSyncMain) {
+    progJoined=DCCWaveform::progTrackSyncMain;
+    MotorDriver * progDriver=DCCWaveform::progTrack.motorDriver;
+    routePin(progDriver->getSignalPin(), progDriver->getSignalPin2(), progJoined ? MAIN_CHANNEL : PROG_CHANNEL);
+  }
+  DCCRMTRing & ring=rings[isMain ? 0 : 1];
+  uint32_t sentUs=0;
+  if (ended) {
+    ring.start();
+    rmt_tx_start(channel, true);
+  }
+  else {
+    // The read address counts items from the start of the RMT memory
+    uint32_t reading=((RMT.status_ch[channel].val >> 12) & 0x3FF) - channel*RMT_BLOCK_ITEMS;
+    sentUs=ring.sent((reading/RMT_QUARTER_ITEMS) & 3);
+  }
+#ifdef DCC_ISR_PROFILE
+  if (isMain) {
+    ISRProfile::tick(mark, sentUs);
+    ISRProfile::record(ISR_MAIN, mark);
+    ISRProfile::end();
+  }
+  else ISRProfile::record(ISR_PROG, mark);
+#else
+  (void) sentUs;
+#endif
+}
+
+const uint8_t * DCCRMT::nextImage(void * track, uint8_t & bitCount) {
+  DCCWaveform * wave=(DCCWaveform *)track;
+  wave->endOfImage();
+  bitCount=wave->transmitBitCount;
+  return wave->transmitImage;
+}
+
+void DCCRMT::ackTask(void * arg) {
+  (void) arg;
+  TickType_t wake=xTaskGetTickCount();
+  for (;;) {
+    vTaskDelayUntil(&wake, ACK_CHECK_TICKS);
+    if (DCCWaveform::progTrack.ackPending) DCCWaveform::progTrack.checkAck();
+  }
+}
+#endif
@@ -0,0 +1,102 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef DCCRMT_h
+#define DCCRMT_h
+#include <stdint.h>
+#include <stddef.h>
+
+// The ESP32 generates the DCC signal with its RMT peripheral rather than a 
+// timer interrupt per half bit. Packet wire images are converted into RMT 
+// items, one per bit, and streamed through the channel's memory as a ring 
+// without an end, so one packet follows another with no gap. The RMT 
+// interrupts each time it has sent a quarter of the ring, and the CPU then
+// refills the quarter before the one being sent. 
+//
+// An RMT item is 32 bits: duration0 (bits 0-14), level0 (bit 15), 
+// duration1 (bits 16-30), level1 (bit 31). Durations are in uS.
+
+// NMRA S-9.1: a '1' half bit is 55 to 61uS from a command station, a '0' half 
+// bit 95 to 9900uS.
+const uint16_t RMT_ONE_HALF_US = 58;
+const uint16_t RMT_ZERO_HALF_US = 100;
+
+// Two memory blocks of 64 items, refilled a quarter at a time
+const uint8_t RMT_RING_ITEMS = 128;
+const uint8_t RMT_QUARTER_ITEMS = RMT_RING_ITEMS/4;
+
+class DCCRMTEncoder {
+  public:
+    static inline uint32_t item(uint16_t highUs, uint16_t lowUs) {
+      return (uint32_t)highUs | 0x8000UL | ((uint32_t)lowUs << 16);
+    }
+    // Converts the bits of image (MSB first) from bit on into at most count 
+    // items. Moves bit on and returns the number of items.
+    static uint8_t encode(uint32_t items[], uint8_t count, const uint8_t image[], uint8_t bitCount, uint8_t & bit);
+    // Time taken to send count items
+    static uint32_t durationUs(const uint32_t items[], uint8_t count);
+};
+
+// The ring of items in a channel's memory. Two quarters are always ready
+// ahead of the one being sent, and the quarter behind it starts with a zero 
+// end marker. If the interrupt is held off for longer than two quarters 
+// take to send (flash writes do this), the RMT stops at the marker rather 
+// than send items again, and start() sends the image it was on from the
+// beginning. 
+class DCCRMTRing {
+  public:
+    // Returns the next image to send, and its length in bits
+    typedef const uint8_t * (*NEXT_IMAGE)(void * context, uint8_t & bitCount);
+    void begin(volatile uint32_t * memory, NEXT_IMAGE next, void * context);
+    // Fills all but the last quarter, for the RMT to send from the start
+    void start();
+    // The RMT is now sending the quarter reading. Refills the quarters that it
+    // has sent since the last call and returns the time they took.
+    uint32_t sent(uint8_t reading);
+  private:
+    void fill(uint8_t quarter);
+    volatile uint32_t * memory;
+    NEXT_IMAGE nextImage;
+    void * context;
+    const uint8_t * image;
+    uint8_t bitCount;
+    uint8_t bit;         // next bit of image to put in the ring
+    uint8_t sending;     // quarter the RMT was sending at the last call
+    uint32_t quarterUs[4];
+};
+
+#if defined(ESP32)
+#include <driver/rmt.h>
+
+class DCCRMT {
+  public:
+    static void begin();
+  private:
+    static bool startChannel(rmt_channel_t channel, uint8_t pin, uint8_t pin2);
+    static void startRing(rmt_channel_t channel);
+    static void routePin(uint8_t pin, uint8_t pin2, rmt_channel_t channel);
+    static void interrupt(void * arg);
+    static void refill(rmt_channel_t channel, uint32_t status);
+    static const uint8_t * nextImage(void * track, uint8_t & bitCount);
+    static void ackTask(void * arg);
+    static DCCRMTRing rings[2];
+    static bool progJoined;   // prog pins are routed to the main channel
+};
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "DCCSlotEncoder.h"
+
+DCCSlotEncoder::DCCSlotEncoder() {
+  slotByte=0;
+  image=0;
+  bitCount=0;
+  bit=0;
+  pairs=0;
+  zeroPending=false;
+}
+
+void DCCSlotEncoder::setImage(const uint8_t newImage[], uint8_t newBitCount) {
+  image=newImage;
+  bitCount=newBitCount;
+  bit=0;
+}
+
+bool DCCSlotEncoder::fill() {
+  if (pairs==4) {
+    pairs=0;
+    slotByte=0;
+  }
+  while (pairs<4) {
+    uint8_t pair;
+    if (zeroPending) {
+      pair=0b00;
+      zeroPending=false;
+    }
+    else {
+      if (bit==bitCount) return false;
+      bool one=image[bit>>3] & (0x80>>(bit&7));
+      bit++;
+      pair= one ? 0b10 : 0b11;
+      zeroPending=!one;
+    }
+    slotByte=(slotByte<<2) | pair;
+    pairs++;
+  }
+  return true;
+}
@@ -0,0 +1,52 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef DCCSlotEncoder_h
+#define DCCSlotEncoder_h
+#include <stdint.h>
+
+// Converts packet wire images into a stream of half bit slots, 8 to a byte, 
+// MSB first, for hardware that shifts the signal out at one slot per 58uS 
+// (see DCCTimer::beginShift). A '1' bit is the slots 10 and a '0' bit is 1100, 
+// so bits always start on an even slot and a byte holds 4 pairs of slots.
+// The stream runs on from one image to the next without a gap.
+
+const uint8_t DCC_SLOT_US = 58;
+
+// NMRA S-9.1 timing for a command station
+static_assert(DCC_SLOT_US >= 55 && DCC_SLOT_US <= 61, "a '1' half bit must be 55 to 61uS");
+static_assert(2*DCC_SLOT_US >= 95 && 2*DCC_SLOT_US <= 9900, "a '0' half bit must be 95 to 9900uS");
+
+class DCCSlotEncoder {
+  public:
+    DCCSlotEncoder();
+    // Starts the next image, bitCount bits MSB first. The second half of 
+    // a '0' bit left over from the previous image is sent first.
+    void setImage(const uint8_t image[], uint8_t bitCount);
+    // Adds slots to slotByte. Returns true when slotByte is complete, false
+    // when the image has run out first and setImage must be called.
+    bool fill();
+    uint8_t slotByte;
+  private:
+    const uint8_t * image;
+    uint8_t bitCount;
+    uint8_t bit;        // next bit of image
+    uint8_t pairs;      // pairs of slots already in slotByte
+    bool zeroPending;   // second half of a '0' bit still to send
+};
+#endif
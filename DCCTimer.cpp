@@ -25,6 +25,9 @@
  *  DCCEX works on a single timer interrupt at a regular 58uS interval.
  *  The DCCWaveform class generates the signals to the motor shield  
  *  based on this timer. 
+ *  Where the timer allows it and the PWM pins are not used, the waveform 
+ *  instead sets the period to the next signal edge on either track, 
+ *  one or two 58uS ticks, which skips the interrupts that change nothing.
  *  
  *  If the motor drivers are BOTH configured to use the correct 2 pins for the architecture,
  *  (see isPWMPin() function. )
@@ -36,6 +39,10 @@
  *  Fortunately, a standard motor shield on a Mega uses pins that qualify for PWM... 
  *  Other shields may be jumpered to PWM pins or run directly using the software interrupt.
  *  
+ *  On a Mega, signal pins jumpered to TX3 (main) and TX2 (prog) let the USARTs 
+ *  shift the waveform out 8 half bits at a time (see beginShift()), 
+ *  so that the CPU is interrupted 8 times less often.
+ *  
  *  Because the PWM-based waveform is effectively set half a cycle after the software version,
  *  it is not acceptable to drive the two tracks on different methiods or it would cause
  *  problems for <1 JOIN> etc.
@@ -43,6 +50,7 @@
  */
 
 #include "DCCTimer.h"
+#include "DCCSlotEncoder.h"
 const int DCC_SIGNAL_TIME=58;  // this is the 58uS DCC 1-bit waveform half-cycle 
 const long CLOCK_CYCLES=(F_CPU / 1000000 * DCC_SIGNAL_TIME) >>1;
 
@@ -71,6 +79,45 @@ INTERRUPT_CALLBACK interruptHandler=0;
     interruptHandler();
   }
 
+  bool DCCTimer::canVaryPeriod() {
+    return true;
+  }
+
+  // The counter has just been cleared by the compare match so the new value 
+  // applies to the period now running.
+  void DCCTimer::setPeriod(byte ticks) {
+    TCB0.CCMP = CLOCK_CYCLES * ticks - 1;
+  }
+
+  bool DCCTimer::canShift(byte mainPin, byte progPin) {
+    (void) mainPin;
+    (void) progPin;
+    return false;
+  }
+
+  void DCCTimer::beginShift(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+  }
+
+  void DCCTimer::shift(byte mainSlots, byte progSlots) {
+    (void) mainSlots;
+    (void) progSlots;
+  }
+
+  bool DCCTimer::beginADC(const byte pins[], byte count, ADC_CALLBACK callback) {
+    (void) pins;
+    (void) count;
+    (void) callback;
+    return false;
+  }
+
+  bool DCCTimer::attachPinChange(byte pin, INTERRUPT_CALLBACK callback) {
+    int interrupt=digitalPinToInterrupt(pin);
+    if (interrupt==NOT_AN_INTERRUPT) return false;
+    attachInterrupt(interrupt, callback, CHANGE);
+    return true;
+  }
+
   bool DCCTimer::isPWMPin(byte pin) {
        (void) pin; 
        return false;  // TODO what are the relevant pins? 
@@ -98,6 +145,45 @@ INTERRUPT_CALLBACK interruptHandler=0;
 
   }
 
+  // IntervalTimer::update only applies after the period now running, 
+  // which is one interrupt too late for the waveform.
+  bool DCCTimer::canVaryPeriod() {
+    return false;
+  }
+
+  void DCCTimer::setPeriod(byte ticks) {
+    (void) ticks;
+  }
+
+  bool DCCTimer::canShift(byte mainPin, byte progPin) {
+    (void) mainPin;
+    (void) progPin;
+    return false;
+  }
+
+  void DCCTimer::beginShift(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+  }
+
+  void DCCTimer::shift(byte mainSlots, byte progSlots) {
+    (void) mainSlots;
+    (void) progSlots;
+  }
+
+  bool DCCTimer::beginADC(const byte pins[], byte count, ADC_CALLBACK callback) {
+    (void) pins;
+    (void) count;
+    (void) callback;
+    return false;
+  }
+
+  bool DCCTimer::attachPinChange(byte pin, INTERRUPT_CALLBACK callback) {
+    int interrupt=digitalPinToInterrupt(pin);
+    if (interrupt==NOT_AN_INTERRUPT) return false;
+    attachInterrupt(interrupt, callback, CHANGE);
+    return true;
+  }
+
   bool DCCTimer::isPWMPin(byte pin) {
        //Teensy: digitalPinHasPWM, todo
       (void) pin;
@@ -158,10 +244,49 @@ void DCCTimer::read(uint8_t word, uint8_t *mac, uint8_t offset) {
     return false;
   }
 
+  bool DCCTimer::canVaryPeriod() {
+    return false;
+  }
+
+  void DCCTimer::setPeriod(byte ticks) {
+    (void) ticks;
+  }
+
   void DCCTimer::setPWM(byte pin, bool high) {
     DIAG(F("@@@ DCC Timer setPWM No-Op"));
   }
 
+  bool DCCTimer::canShift(byte mainPin, byte progPin) {
+    (void) mainPin;
+    (void) progPin;
+    return false;
+  }
+
+  void DCCTimer::beginShift(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+  }
+
+  void DCCTimer::shift(byte mainSlots, byte progSlots) {
+    (void) mainSlots;
+    (void) progSlots;
+  }
+
+  bool DCCTimer::beginADC(const byte pins[], byte count, ADC_CALLBACK callback) {
+    (void) pins;
+    (void) count;
+    (void) callback;
+    return false;
+  }
+
+  // Every pin can interrupt. The core does not install the GPIO interrupt in
+  // IRAM, so the callback may be in flash.
+  bool DCCTimer::attachPinChange(byte pin, INTERRUPT_CALLBACK callback) {
+    int interrupt=digitalPinToInterrupt(pin);
+    if (interrupt==NOT_AN_INTERRUPT) return false;
+    attachInterrupt(interrupt, callback, CHANGE);
+    return true;
+  }
+
   void DCCTimer::getSimulatedMacAddress(byte mac[6]) {
     DIAG(F("@@@ DCC Timer getSimulatedMacAddress No-Op"));
     for (byte i=0; i<6; i++) {
@@ -197,6 +322,143 @@ void DCCTimer::read(uint8_t word, uint8_t *mac, uint8_t offset) {
 // ISR called by timer interrupt every 58uS
   ISR(TIMER1_OVF_vect){ interruptHandler(); }
 
+  bool DCCTimer::canVaryPeriod() {
+    return true;
+  }
+
+  // The overflow interrupt is at BOTTOM and ICR1 is not double buffered, so the new 
+  // TOP applies to the period now running. It must be written early in the interrupt,
+  // while TCNT1 is still below the smallest TOP.
+  void DCCTimer::setPeriod(byte ticks) {
+    ICR1 = CLOCK_CYCLES * ticks;
+  }
+
+#if (defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)) && defined(DCC_USART_SHIFT)
+  // Alternative signal generation by USART3 (main, TX3 pin 14) and USART2 
+  // (prog, TX2 pin 16) in master SPI mode, shifting one half bit slot per 58uS
+  // bit time. The transmit buffer holds the next byte while the current one 
+  // is shifted, so there is one interrupt per 8 slots (464uS) for both tracks. 
+  // Both USARTs run from the same clock and are started together so that 
+  // their bytes stay aligned, which lets JOIN send the same bytes to both.
+  // Only with -DDCC_USART_SHIFT: the USART3 interrupt vector is then ours, so 
+  // Serial2 and Serial3 cannot be used (WifiInterface leaves them alone).
+  // In master SPI mode a bit takes 2*(UBRR+1) cycles.
+  const long SLOT_CYCLES=F_CPU / 1000000 * DCC_SLOT_US;
+  const int SHIFT_UBRR=SLOT_CYCLES / 2 - 1;
+  static_assert(SLOT_CYCLES % 2 == 0 && SHIFT_UBRR >= 0 && SHIFT_UBRR <= 4095, 
+                "the USART cannot shift at one slot per DCC_SLOT_US");
+  static_assert(2L*(SHIFT_UBRR+1) == SLOT_CYCLES, "USART bit time must be DCC_SLOT_US");
+  INTERRUPT_CALLBACK shiftHandler=0;
+
+  bool DCCTimer::canShift(byte mainPin, byte progPin) {
+    return mainPin==14 && progPin==16;
+  }
+
+  void DCCTimer::beginShift(INTERRUPT_CALLBACK callback) {
+    shiftHandler=callback;
+    noInterrupts();
+    ADCSRA = (ADCSRA & 0b11111000) | 0b00000100;   // speed up analogRead sample time 
+    DDRJ |= _BV(PJ2);   // XCK3 output selects master mode
+    DDRH |= _BV(PH2);   // XCK2
+    UBRR3 = 0;
+    UBRR2 = 0;
+    UCSR3C = _BV(UMSEL31) | _BV(UMSEL30);   // master SPI, MSB first, mode 0
+    UCSR2C = _BV(UMSEL21) | _BV(UMSEL20);
+    UCSR3B = _BV(TXEN3);
+    UCSR2B = _BV(TXEN2);
+    UBRR3 = SHIFT_UBRR;   // set the baud rate after enabling the transmitter
+    UBRR2 = SHIFT_UBRR;
+    UCSR3B |= _BV(UDRIE3);  // interrupt when the transmit buffer is free
+    interrupts();
+  }
+
+  ISR(USART3_UDRE_vect) { shiftHandler(); }
+
+  void DCCTimer::shift(byte mainSlots, byte progSlots) {
+    UDR3 = mainSlots;
+    UDR2 = progSlots;
+  }
+#else
+  bool DCCTimer::canShift(byte mainPin, byte progPin) {
+    (void) mainPin;
+    (void) progPin;
+    return false;
+  }
+
+  void DCCTimer::beginShift(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+  }
+
+  void DCCTimer::shift(byte mainSlots, byte progSlots) {
+    (void) mainSlots;
+    (void) progSlots;
+  }
+#endif
+
+#if defined(DCC_ADC_SAMPLING)
+// Free running ADC, only with -DDCC_ADC_SAMPLING as analogRead cannot be used
+// alongside it. Each conversion is started by the interrupt that takes 
+// the previous result, with the ADC clock at F_CPU/128: 104uS per conversion
+// at 16MHz, slower than the analogRead setting above to keep the interrupt load
+// down, about 10% of the CPU.
+  static const byte * adcPins;
+  static byte adcCount;
+  static volatile byte adcIndex;
+  static ADC_CALLBACK adcCallback=0;
+
+  static inline void startConversion(byte pin) {
+    byte channel = pin >= A0 ? pin - A0 : pin;
+#if defined(MUX5)
+    ADCSRB = (ADCSRB & ~_BV(MUX5)) | (((channel >> 3) & 0x01) << MUX5);
+#endif
+    ADMUX = _BV(REFS0) | (channel & 0x07);    // AVcc reference, as analogRead DEFAULT
+    ADCSRA |= _BV(ADSC);
+  }
+
+  bool DCCTimer::beginADC(const byte pins[], byte count, ADC_CALLBACK callback) {
+    if (count==0) return false;
+    adcPins=pins;
+    adcCount=count;
+    adcIndex=0;
+    adcCallback=callback;
+    noInterrupts();
+    ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    startConversion(adcPins[0]);
+    interrupts();
+    return true;
+  }
+
+  // Interrupts are enabled at once so the waveform interrupt is never held up by 
+  // the callback. The next conversion ends long after this one is done.
+  ISR(ADC_vect, ISR_NOBLOCK) {
+    int value=ADC;
+    byte index=adcIndex;
+    byte next=index+1;
+    if (next==adcCount) next=0;
+    adcIndex=next;
+    startConversion(adcPins[next]);
+    adcCallback(index, value);
+  }
+#else
+  // Current is read by analogRead as it is needed
+  bool DCCTimer::beginADC(const byte pins[], byte count, ADC_CALLBACK callback) {
+    (void) pins;
+    (void) count;
+    (void) callback;
+    return false;
+  }
+#endif
+
+// Only the external interrupt pins (2 and 3, and 18 to 21 on a Mega). The pin 
+// change vectors are left alone, as SoftwareSerial and other libraries define 
+// them. Other fault pins are checked by the power manager as before.
+  bool DCCTimer::attachPinChange(byte pin, INTERRUPT_CALLBACK callback) {
+    int interrupt=digitalPinToInterrupt(pin);
+    if (interrupt==NOT_AN_INTERRUPT) return false;
+    attachInterrupt(interrupt, callback, CHANGE);
+    return true;
+  }
+
 // Alternative pin manipulation via PWM control.
   bool DCCTimer::isPWMPin(byte pin) {
        return pin==TIMER1_A_PIN 
@@ -3,10 +3,30 @@
 #include "Arduino.h"
 
 typedef void (*INTERRUPT_CALLBACK)();
+typedef void (*ADC_CALLBACK)(byte index, int value);
 
 class DCCTimer {
   public:
   static void begin(INTERRUPT_CALLBACK interrupt);
+  // Variable period: called from the interrupt to set the time until the next one
+  // in DCC ticks (58uS). Only where canVaryPeriod() and not using PWM pins.
+  static bool canVaryPeriod();
+  static void setPeriod(byte ticks);
+  // Shifted signal: serial hardware shifts out 8 half bit slots (58uS each) per 
+  // byte for both tracks, and calls back when it needs the next bytes.
+  // Only where canShift() for the signal pins: on a Mega built with 
+  // -DDCC_USART_SHIFT, main on pin 14 and prog on pin 16.
+  static bool canShift(byte mainPin, byte progPin);
+  static void beginShift(INTERRUPT_CALLBACK callback);
+  static void shift(byte mainSlots, byte progSlots);
+  // Free running ADC: converts the analog pins in turn for ever, calling back 
+  // from the ADC interrupt with the index of each pin and its value. analogRead
+  // must not be used afterwards. Only on the Uno, Nano and Mega built with 
+  // -DDCC_ADC_SAMPLING, returns false elsewhere.
+  static bool beginADC(const byte pins[], byte count, ADC_CALLBACK callback);
+  // Interrupt on any change of the pin. One callback serves all the attached
+  // pins. Returns false where the pin cannot interrupt.
+  static bool attachPinChange(byte pin, INTERRUPT_CALLBACK callback);
   static void getSimulatedMacAddress(byte mac[6]);
   static bool isPWMPin(byte pin);
   static void setPWM(byte pin, bool high);
@@ -24,11 +24,20 @@
 #include "DCCTimer.h"
 #include "DIAG.h"
 #include "freeMemory.h"
+#include "StringFormatter.h"
+#include "ISRProfile.h"
+#include "DCCRMT.h"
 
 DCCWaveform  DCCWaveform::mainTrack(PREAMBLE_BITS_MAIN, true);
 DCCWaveform  DCCWaveform::progTrack(PREAMBLE_BITS_PROG, false);
 
+DCCWaveform * DCCWaveform::districts[MAX_DISTRICTS]={&mainTrack, &progTrack};
+byte DCCWaveform::districtCount=2;
+DCCWaveform * DCCWaveform::streams[MAX_SIGNAL_STREAMS]={&mainTrack, &progTrack};
+byte DCCWaveform::streamBits=0;
+
 bool DCCWaveform::progTrackSyncMain=false; 
+byte DCCWaveform::currentPeriod=1;
 bool DCCWaveform::progTrackBoosted=false; 
 int  DCCWaveform::progTripValue=0;
   
@@ -42,67 +51,229 @@ void DCCWaveform::begin(MotorDriver * mainDriver, MotorDriver * progDriver) {
   MotorDriver::commonFaultPin = ((mainDriver->getFaultPin() == progDriver->getFaultPin())
 				 && (mainDriver->getFaultPin() != UNUSED_PIN));
   // Only use PWM if both pins are PWM capable. Otherwise JOIN does not work
-  MotorDriver::usePWM= mainDriver->isPWMCapable() && progDriver->isPWMCapable();
+  // Booster districts are not on PWM pins, and must not lag the main track.
+  MotorDriver::usePWM= mainDriver->isPWMCapable() && progDriver->isPWMCapable() && districtCount==2;
   if (MotorDriver::usePWM)
     DIAG(F("Signal pin config: high accuracy waveform"));
   else
     DIAG(F("Signal pin config: normal accuracy waveform"));
-  if (false) { // RM 2021-04-22
-    DIAG(F("@@@ DCC Timer Begin"));
-    DCCTimer::begin(DCCWaveform::interruptHandler);     
-  } else {
-    DIAG(F("@@@ DCC Timer Begin DISABLED "));
+  bool sliced=!MotorDriver::usePWM;
+  for (byte d=0; d<districtCount && sliced; d++) 
+    sliced=districts[d]->motorDriver->addSignalPins(districts[d]->stream);
+  MotorDriver::slicedSignals=sliced;
+  for (byte d=0; d<districtCount; d++) districts[d]->motorDriver->addToSampling();
+  MotorDriver::beginSampling();
+  for (byte d=0; d<districtCount; d++) districts[d]->motorDriver->watchFault();
+  if (districtCount>2) DIAG(F("Districts=%d"), districtCount);
+#ifdef DCC_ISR_PROFILE
+  ISRProfile::reset();
+#endif
+#if defined(ESP32)
+  // The RMT peripheral generates the waveform, the DCC timer is not used.
+  DCCRMT::begin();
+#else
+  if (districtCount==2 && !MotorDriver::usePWM 
+      && mainDriver->getSignalPin2()==UNUSED_PIN && progDriver->getSignalPin2()==UNUSED_PIN
+      && DCCTimer::canShift(mainDriver->getSignalPin(), progDriver->getSignalPin())) {
+    DIAG(F("Signal pin config: shifted waveform"));
+    DCCTimer::beginShift(DCCWaveform::interruptHandlerShift);
+  }
+  // The PWM pins change half a period after being set, so they need a fixed period
+  else if (!MotorDriver::usePWM && DCCTimer::canVaryPeriod()) {
+    // each track's first edge is a tick away, and needs the length of its level
+    for (byte s=0; s<MAX_SIGNAL_STREAMS; s++) streams[s]->levelTicks=streams[s]->nextEdge();
+    DCCTimer::begin(DCCWaveform::interruptHandlerVariable);
   }
+  else
+    DCCTimer::begin(DCCWaveform::interruptHandler);     
+#endif
+}
+
+int DCCWaveform::addDistrict(MotorDriver * driver) {
+#if defined(ESP32)
+  (void) driver;
+  return -1;
+#else
+  if (mainTrack.motorDriver) return -1;    // too late, the signal pins are set up
+  if (districtCount==MAX_DISTRICTS) return -1;
+  DCCWaveform * district=new DCCWaveform(PREAMBLE_BITS_MAIN, true);
+  district->motorDriver=driver;
+  district->setPowerMode(POWERMODE::OFF);
+  district->stream=0;
+  districts[districtCount]=district;
+  return districtCount++;
+#endif
 }
 
 void DCCWaveform::loop(bool ackManagerActive) {
-  mainTrack.checkPowerOverload(false);
-  progTrack.checkPowerOverload(ackManagerActive);
+  // ackManagerActive only applies to the prog track
+  for (byte d=0; d<districtCount; d++) districts[d]->checkPowerOverload(ackManagerActive);
+  // Stack painting sees what the interrupt and checkAck use, so no allowance is needed.
+  updateMinimumFreeMemory();
+}
+
+// Sets the signal pins of all districts. Bit n of bits is the signal of stream n.
+inline void DCCWaveform::setSignals(byte bits) {
+  if (progTrackSyncMain) bits = (bits & ~0x02) | ((bits & 0x01) << 1);
+  if (MotorDriver::slicedSignals) MotorDriver::setSignals(bits);
+  else {
+    for (byte d=0; d<districtCount; d++) 
+      districts[d]->motorDriver->setSignal(bits & (1 << districts[d]->stream));
+  }
 }
 
 void DCCWaveform::interruptHandler() {
+  ISR_PROFILE_START(mark, 1);
   // call the timer edge sensitive actions for progtrack and maintrack
   // member functions would be cleaner but have more overhead
-  byte sigMain=signalTransform[mainTrack.state];
-  byte sigProg=progTrackSyncMain? sigMain : signalTransform[progTrack.state];
+  byte bits=signalTransform[mainTrack.state] | (signalTransform[progTrack.state] << 1);
   
-  // Set the signal state for both tracks
-  mainTrack.motorDriver->setSignal(sigMain);
-  progTrack.motorDriver->setSignal(sigProg);
+  // Set the signal state for all tracks
+  setSignals(bits);
+  ISR_PROFILE_SECTION(ISR_SIGNALS, mark);
   
   // Move on in the state engine
+  // WAVE_PENDING means we dont yet know what the next bit is
   mainTrack.state=stateTransform[mainTrack.state];    
+  if (mainTrack.state==WAVE_PENDING) mainTrack.interrupt2();  
+  ISR_PROFILE_SECTION(ISR_MAIN, mark);
+
   progTrack.state=stateTransform[progTrack.state];    
+  if (progTrack.state==WAVE_PENDING) {
+    progTrack.interrupt2();
+    ISR_PROFILE_SECTION(ISR_PROG, mark);
+  }
+  else {
+    ISR_PROFILE_SECTION(ISR_PROG, mark);
+    if (progTrack.ackPending) {
+      progTrack.checkAck();
+      ISR_PROFILE_SECTION(ISR_ACK, mark);
+    }
+  }
+  ISR_PROFILE_END();
+}
 
+// Variable period version of interruptHandler. The timer is set to interrupt only when
+// a track has an edge due: a '1' half bit lasts one tick and a '0' half bit two, 
+// as the states that leave the signal unchanged (WAVE_HIGH_0, WAVE_LOW_0) are skipped.
+// The timer must be given the next period while its count is still below the 
+// shortest period (29uS at 16MHz), so each track works out how long a level lasts 
+// one edge ahead: levelTicks is ready when the edge is due, and the state engine 
+// moves on to the following edge only after the signals and timer have been set.
+void DCCWaveform::interruptHandlerVariable() {
+  byte elapsed=currentPeriod;
+  ISR_PROFILE_START(mark, elapsed);
+
+  // Every edge changes the signal, and lasts the ticks worked out last time.
+  // The two streams are written out rather than looped over, as this runs at every edge.
+  byte mainTicks=mainTrack.ticksToEdge-elapsed;
+  byte progTicks=progTrack.ticksToEdge-elapsed;
+  byte due=0;
+  if (mainTicks==0) {
+    due=0x01;
+    mainTicks=mainTrack.levelTicks;
+  }
+  if (progTicks==0) {
+    due|=0x02;
+    progTicks=progTrack.levelTicks;
+  }
+  mainTrack.ticksToEdge=mainTicks;
+  progTrack.ticksToEdge=progTicks;
+  byte period= mainTicks<progTicks ? mainTicks : progTicks;
+  streamBits^=due;
+  setSignals(streamBits);
+  if (period!=elapsed) DCCTimer::setPeriod(period);
+  currentPeriod=period;
+  ISR_PROFILE_SECTION(ISR_SIGNALS, mark);
+
+  if (due & 0x01) mainTrack.levelTicks=mainTrack.nextEdge();
+  ISR_PROFILE_SECTION(ISR_MAIN, mark);
+
+  bool progBit=false;  // prog track has chosen its next bit this time
+  if (due & 0x02) {
+    progBit= progTrack.state==WAVE_START;
+    progTrack.levelTicks=progTrack.nextEdge();
+  }
+  ISR_PROFILE_SECTION(ISR_PROG, mark);
 
-  // WAVE_PENDING means we dont yet know what the next bit is
-  if (mainTrack.state==WAVE_PENDING) mainTrack.interrupt2();  
-  if (progTrack.state==WAVE_PENDING) progTrack.interrupt2();
-  else if (progTrack.ackPending) progTrack.checkAck();
+  if (!progBit && progTrack.ackPending) {
+    progTrack.checkAck();
+    ISR_PROFILE_SECTION(ISR_ACK, mark);
+  }
+  ISR_PROFILE_END();
+}
 
+// Shifted version of interruptHandler, called once the serial hardware can take
+// the next 8 half bit slots for each track. 
+void DCCWaveform::interruptHandlerShift() {
+  ISR_PROFILE_START(mark, 8);
+  byte mainSlots=mainTrack.nextSlots();
+  ISR_PROFILE_SECTION(ISR_MAIN, mark);
+  byte progSlots=progTrack.nextSlots();
+  DCCTimer::shift(mainSlots, progTrackSyncMain ? mainSlots : progSlots);
+  ISR_PROFILE_SECTION(ISR_PROG, mark);
+  if (progTrack.ackPending) {
+    progTrack.checkAck();
+    ISR_PROFILE_SECTION(ISR_ACK, mark);
+  }
+  ISR_PROFILE_END();
 }
 
+byte DCCWaveform::nextSlots() {
+  while (!slotEncoder.fill()) {
+    endOfImage();
+    slotEncoder.setImage(transmitImage, transmitBitCount);
+  }
+  return slotEncoder.slotByte;
+}
 
-// An instance of this class handles the DCC transmissions for one track. (main or prog)
-// Interrupts are marshalled via the statics.
-// A track has a current transmit buffer, and a pending buffer.
-// When the current buffer is exhausted, either the pending buffer (if there is one waiting) or an idle buffer.
+// Move the state engine on from the state whose signal is set at an edge and
+// return the number of ticks until the signal changes, which is the next edge.
+// The only states at an edge are WAVE_START (high) and WAVE_MID_1 or WAVE_MID_0 
+// (low), so this goes straight to the next one rather than a tick at a time.
+byte DCCWaveform::nextEdge() {
+  if (state!=WAVE_START) {      // low to the end of the bit
+    byte ticks= state==WAVE_MID_1 ? 1 : 2;
+    state=WAVE_START;
+    return ticks;
+  }
+  interrupt2();                 // high for the first half of the next bit
+  if (state==WAVE_MID_1) return 1;
+  state=WAVE_MID_0;
+  return 2;
+}
 
 
-// This bitmask has 9 entries as each byte is trasmitted as a zero + 8 bits.
-const byte bitMask[] = {0x00, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+// An instance of this class handles the DCC transmissions for one track. (main or prog)
+// Interrupts are marshalled via the statics.
+// A track has a current transmit buffer, and a queue of pending packets.
+// When the current buffer is exhausted, either the first queued packet (if there is one waiting) or an idle buffer.
+// The queue is kept in priority order by schedulePacket so the interrupt only ever takes the head.
 
 
 DCCWaveform::DCCWaveform( byte preambleBits, bool isMain) {
   isMainTrack = isMain;
-  packetPending = false;
-  memcpy(transmitPacket, idlePacket, sizeof(idlePacket));
+  stream = isMain ? 0 : 1;
+  queueHead = QUEUE_END;
+  queueHighWater = 0;
+  packetsRejected = 0;
+  packetsSuperseded = 0;
+  for (byte slot=0; slot<PACKET_QUEUE_SIZE; slot++) queue[slot].inUse=false;
   state = WAVE_START;
-  // The +1 below is to allow the preamble generator to create the stop bit
-  // for the previous packet. 
-  requiredPreambles = preambleBits+1;  
-  bytes_sent = 0;
-  bits_sent = 0;
+  ticksToEdge = 1;
+  levelTicks = 1;
+  requiredPreambles = preambleBits;  
+  // idle and reset packets are encoded once, with their checksum
+  byte packet[sizeof(idlePacket)];
+  memcpy(packet, isMainTrack ? idlePacket : resetPacket, sizeof(idlePacket));
+  idleBitCount = encodeImage(idleImage, packet, sizeof(packet));
+  transmitImage = idleImage;
+  transmitSlot = QUEUE_END;
+  transmitBitCount = idleBitCount;
+  transmitRepeats = 0;
+  transmitByte = transmitImage;
+  transmitMask = 0x80;
+  bitsSent = 0;
   sampleDelay = 0;
   lastSampleTaken = millis();
   ackPending=false;
@@ -116,6 +287,19 @@ void DCCWaveform::setPowerMode(POWERMODE mode) {
   powerMode = mode;
   bool ison = (mode == POWERMODE::ON);
   motorDriver->setPower( ison);
+  if (this!=&mainTrack || mode==POWERMODE::OVERLOAD) return;
+  // Boosters are switched with the main track, but each recovers from its own overloads.
+  for (byte d=2; d<districtCount && d<MAX_DISTRICTS; d++) {   // none on an Uno
+    DCCWaveform * district=districts[d];
+    if (mode==POWERMODE::OFF || district->powerMode==POWERMODE::OFF)
+      district->setPowerMode(mode);
+  }
+}
+
+const FSH * DCCWaveform::trackName() {
+  if (this==&mainTrack) return F("MAIN");
+  if (this==&progTrack) return F("PROG");
+  return F("BOOSTER");
 }
 
 
@@ -125,15 +309,18 @@ void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
   int tripValue= motorDriver->getRawCurrentTripValue();
   if (!isMainTrack && !ackManagerActive && !progTrackSyncMain && !progTrackBoosted)
     tripValue=progTripValue;
+  motorDriver->setTripRaw(tripValue);
   
   switch (powerMode) {
     case POWERMODE::OFF:
       sampleDelay = POWER_SAMPLE_OFF_WAIT;
       break;
-    case POWERMODE::ON:
+    case POWERMODE::ON: {
       // Check current
+      unsigned long faultAge=motorDriver->getFaultAge();
       lastCurrent=motorDriver->getCurrentRaw();
-      if (lastCurrent < 0) {
+      bool faulted = lastCurrent < 0;
+      if (faulted) {
 	  // We have a fault pin condition to take care of
 	  lastCurrent = -lastCurrent;
 	  setPowerMode(POWERMODE::OVERLOAD); // Turn off, decide later how fast to turn on again
@@ -143,16 +330,23 @@ void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
 	      }
 	      // Write this after the fact as we want to turn on as fast as possible
 	      // because we don't know which output actually triggered the fault pin
-	      DIAG(F("*** COMMON FAULT PIN ACTIVE - TOGGLED POWER on %S ***"), isMainTrack ? F("MAIN") : F("PROG"));
+	      DIAG(F("*** COMMON FAULT PIN ACTIVE %luS ago - TOGGLED POWER on %S ***"), faultAge, trackName());
 	  } else {
-	      DIAG(F("*** %S FAULT PIN ACTIVE - OVERLOAD ***"), isMainTrack ? F("MAIN") : F("PROG"));
+	      DIAG(F("*** %S FAULT PIN ACTIVE %luS ago - OVERLOAD ***"), trackName(), faultAge);
 	      if (lastCurrent < tripValue) {
 		  lastCurrent = tripValue; // exaggerate
 	      }
 	  }
       }
-      if (lastCurrent < tripValue) {
-        sampleDelay = POWER_SAMPLE_ON_WAIT;
+      bool overload = lastCurrent >= tripValue;
+      if (!faulted && motorDriver->isSampled()) {
+        // The ADC interrupt keeps an I2t model, which lets decoders through
+        // their inrush and has already cut the power on a short.
+        overload = motorDriver->isOverloaded();
+        lastCurrent = motorDriver->getCurrentMeanRaw();
+      }
+      if (!overload) {
+        sampleDelay = motorDriver->isSampled() ? POWER_SAMPLE_ON_WAIT_FAST : POWER_SAMPLE_ON_WAIT;
 	if(power_good_counter<100)
 	  power_good_counter++;
 	else
@@ -163,19 +357,20 @@ void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
         unsigned int maxmA=motorDriver->raw2mA(tripValue);
 	power_good_counter=0;
         sampleDelay = power_sample_overload_wait;
-        DIAG(F("*** %S TRACK POWER OVERLOAD current=%d max=%d  offtime=%d ***"), isMainTrack ? F("MAIN") : F("PROG"), mA, maxmA, sampleDelay);
+        DIAG(F("*** %S TRACK POWER OVERLOAD current=%d max=%d  offtime=%d ***"), trackName(), mA, maxmA, sampleDelay);
 	if (power_sample_overload_wait >= 10000)
 	    power_sample_overload_wait = 10000;
 	else
 	    power_sample_overload_wait *= 2;
       }
       break;
+    }
     case POWERMODE::OVERLOAD:
       // Try setting it back on after the OVERLOAD_WAIT
       setPowerMode(POWERMODE::ON);
       sampleDelay = POWER_SAMPLE_ON_WAIT;
       // Debug code....
-      DIAG(F("*** %S TRACK POWER RESET delay=%d ***"), isMainTrack ? F("MAIN") : F("PROG"), sampleDelay);
+      DIAG(F("*** %S TRACK POWER RESET delay=%d ***"), trackName(), sampleDelay);
       break;
     default:
       sampleDelay = 999; // cant get here..meaningless statement to avoid compiler warning.
@@ -203,76 +398,213 @@ void DCCWaveform::interrupt2() {
   // calculate the next bit to be sent:
   // set state WAVE_MID_1  for a 1=bit
   //        or WAVE_HIGH_0 for a 0 bit.
-
-  if (remainingPreambles > 0 ) {
-    state=WAVE_MID_1;  // switch state to trigger LOW on next interrupt
-    remainingPreambles--;
-    // Update free memory diagnostic as we don't have anything else to do this time.
-    // Allow for checkAck and its called functions using 22 bytes more.
-    updateMinimumFreeMemory(22); 
-    return;
+  // The wire image already holds the preamble, start, data and end bits.
+  state=(*transmitByte & transmitMask)? WAVE_MID_1 : WAVE_HIGH_0; 
+  transmitMask>>=1;
+  if (transmitMask==0) {
+    transmitMask=0x80;
+    transmitByte++;
   }
+  bitsSent++;
 
-  // Wave has gone HIGH but what happens next depends on the bit to be transmitted
-  // beware OF 9-BIT MASK  generating a zero to start each byte
-  state=(transmitPacket[bytes_sent] & bitMask[bits_sent])? WAVE_MID_1 : WAVE_HIGH_0; 
-  bits_sent++;
-
-  // If this is the last bit of a byte, prepare for the next byte
-
-  if (bits_sent == 9) { // zero followed by 8 bits of a byte
-    //end of Byte
-    bits_sent = 0;
-    bytes_sent++;
-    // if this is the last byte, prepere for next packet
-    if (bytes_sent >= transmitLength) {
-      // end of transmission buffer... repeat or switch to next message
-      bytes_sent = 0;
-      remainingPreambles = requiredPreambles;
-
-      if (transmitRepeats > 0) {
-        transmitRepeats--;
-      }
-      else if (packetPending) {
-        // Copy pending packet to transmit packet
-        // a fixed length memcpy is faster than a variable length loop for these small lengths
-        // for (int b = 0; b < pendingLength; b++) transmitPacket[b] = pendingPacket[b];
-        memcpy( transmitPacket, pendingPacket, sizeof(pendingPacket));
-        
-        transmitLength = pendingLength;
-        transmitRepeats = pendingRepeats;
-        packetPending = false;
-        sentResetsSincePacket=0;
-      }
-      else {
-        // Fortunately reset and idle packets are the same length
-        memcpy( transmitPacket, isMainTrack ? idlePacket : resetPacket, sizeof(idlePacket));
-        transmitLength = sizeof(idlePacket);
-        transmitRepeats = 0;
-        if (sentResetsSincePacket<250) sentResetsSincePacket++;
-      }
+  if (bitsSent < transmitBitCount) return;
+  endOfImage();
+}
+
+// end of image... repeat or switch to next message
+void DCCWaveform::endOfImage() {
+  bitsSent = 0;
+  transmitMask = 0x80;
+  byte next=queueHead;
+  // An emergency stop cuts short the repeats of whatever is being sent.
+  if (transmitRepeats > 0 && (next==QUEUE_END || queue[next].priority!=PACKET_PRIORITY::ESTOP)) {
+    transmitRepeats--;
+  }
+  else {
+    // release the slot just sent, then send straight from the head of the queue
+    if (transmitSlot!=QUEUE_END) queue[transmitSlot].inUse = false;
+    transmitSlot = next;
+    if (next!=QUEUE_END) {
+      QueuedPacket & packet=queue[next];
+      transmitImage = packet.image;
+      transmitBitCount = packet.bitCount;
+      transmitRepeats = packet.repeats;
+      queueHead = packet.next;
+      sentResetsSincePacket=0;
     }
-  }  
+    else {
+      transmitImage = idleImage;
+      transmitBitCount = idleBitCount;
+      transmitRepeats = 0;
+      if (sentResetsSincePacket<250) sentResetsSincePacket++;
+    }
+  }
+  transmitByte = transmitImage;
+}
+
+
+
+// Add a packet to the queue behind any others of the same or higher priority.
+// This never waits for the interrupt: if the queue is full the packet is refused
+// and the caller decides what to do, except for an emergency stop which 
+// displaces the least urgent packet still waiting.
+bool DCCWaveform::schedulePacket(const byte buffer[], byte byteCount, byte repeats, 
+                                 PACKET_PRIORITY priority, unsigned long supersedeKey) {
+  if (byteCount > MAX_PACKET_SIZE) return false; // allow for chksum
+  byte packet[MAX_PACKET_SIZE+1];
+  byte length=encodePacket(packet, buffer, byteCount);
+  return scheduleEncodedPacket(packet, length, repeats, priority, supersedeKey);
 }
 
+bool DCCWaveform::scheduleEncodedPacket(const byte packet[], byte length, byte repeats, 
+                                        PACKET_PRIORITY priority, unsigned long supersedeKey) {
+  // encode the wire image now so that the interrupt only has to shift it out
+  byte image[PACKET_IMAGE_BYTES];
+  byte bitCount=encodeImage(image, packet, length);
+
+  if (supersedeKey!=0 && supersedePacket(image, bitCount, repeats, priority, supersedeKey))
+    return true;
+
+  byte slot;
+  for (slot=0; slot<PACKET_QUEUE_SIZE; slot++) if (!queue[slot].inUse) break;
+
+  if (slot==PACKET_QUEUE_SIZE) {
+    slot= (priority==PACKET_PRIORITY::ESTOP) ? dropLastPacket() : QUEUE_END;
+    if (slot==QUEUE_END) {
+      packetsRejected++;
+      return false;
+    }
+  }
+
+  QueuedPacket & queued=queue[slot];
+  fillPacket(queued, image, bitCount, repeats, supersedeKey);
+  queued.priority = priority;
+  queued.inUse = true;
+
+  byte depth=1;
+  noInterrupts();  // the interrupt may take the head of the queue while we walk it
+  volatile byte * link=&queueHead;
+  while (*link!=QUEUE_END && queue[*link].priority <= priority) {
+    link=&queue[*link].next;
+    depth++;
+  }
+  queued.next=*link;
+  *link=slot;
+  sentResetsSincePacket=0;
+  interrupts();
+
+  if (depth>queueHighWater) queueHighWater=depth;
+  return true;
+}
 
+// Latest wins: overwrite a waiting packet with the same key where it stands in 
+// the queue, and drop any further matches. A waiting packet that is less urgent
+// than the new one is dropped instead so that the new one is queued at its own priority.
+// Returns true if the new packet has been placed in the queue.
+bool DCCWaveform::supersedePacket(const byte image[], byte bitCount, byte repeats, 
+                                  PACKET_PRIORITY priority, unsigned long supersedeKey) {
+  bool broadcast = (supersedeKey & 0xFFFF) == 0;
+  bool replaced = false;
+  noInterrupts();
+  volatile byte * link=&queueHead;
+  while (*link!=QUEUE_END) {
+    QueuedPacket & queued=queue[*link];
+    if (queued.supersedeKey!=supersedeKey
+        && !(broadcast && (queued.supersedeKey>>16)==(supersedeKey>>16))) {
+      link=&queued.next;
+      continue;
+    }
+    packetsSuperseded++;
+    if (!replaced && queued.priority <= priority) {
+      fillPacket(queued, image, bitCount, repeats, supersedeKey);
+      replaced=true;
+      link=&queued.next;
+      continue;
+    }
+    *link=queued.next;  // unlink and free
+    queued.inUse=false;
+  }
+  if (replaced) sentResetsSincePacket=0;
+  interrupts();
+  return replaced;
+}
 
-// Wait until there is no packet pending, then make this pending
-void DCCWaveform::schedulePacket(const byte buffer[], byte byteCount, byte repeats) {
-  if (byteCount > MAX_PACKET_SIZE) return; // allow for chksum
-  while (packetPending);
+void DCCWaveform::dropPackets(unsigned long supersedeKey, PACKET_PRIORITY priority) {
+  noInterrupts();
+  volatile byte * link=&queueHead;
+  while (*link!=QUEUE_END) {
+    QueuedPacket & queued=queue[*link];
+    if (queued.supersedeKey!=supersedeKey || queued.priority < priority) {
+      link=&queued.next;
+      continue;
+    }
+    *link=queued.next;  // unlink and free
+    queued.inUse=false;
+    packetsSuperseded++;
+  }
+  interrupts();
+}
 
+byte DCCWaveform::encodePacket(byte packet[], const byte buffer[], byte byteCount) {
   byte checksum = 0;
   for (byte b = 0; b < byteCount; b++) {
     checksum ^= buffer[b];
-    pendingPacket[b] = buffer[b];
+    packet[b] = buffer[b];
   }
-  // buffer is MAX_PACKET_SIZE but pendingPacket is one bigger
-  pendingPacket[byteCount] = checksum;
-  pendingLength = byteCount + 1;
-  pendingRepeats = repeats;
-  packetPending = true;
-  sentResetsSincePacket=0;
+  // buffer is MAX_PACKET_SIZE but packet is one bigger
+  packet[byteCount] = checksum;
+  return byteCount + 1;
+}
+
+// Wire image of a packet (checksum included): preamble, then each byte preceded 
+// by a 0 start bit, then the 1 end bit which also begins the next preamble.
+// Returns the number of bits.
+byte DCCWaveform::encodeImage(byte image[], const byte packet[], byte length) {
+  memset(image, 0, PACKET_IMAGE_BYTES);
+  byte bit=0;
+  for (byte p=0; p<requiredPreambles; p++, bit++) image[bit>>3] |= 0x80>>(bit&7);
+  for (byte b=0; b<length; b++) {
+    bit++;  // start bit 0
+    for (byte mask=0x80; mask; mask>>=1, bit++) 
+      if (packet[b] & mask) image[bit>>3] |= 0x80>>(bit&7);
+  }
+  image[bit>>3] |= 0x80>>(bit&7);  // end bit
+  return bit+1;
+}
+
+void DCCWaveform::fillPacket(QueuedPacket & queued, const byte image[], byte bitCount, byte repeats, unsigned long supersedeKey) {
+  memcpy(queued.image, image, (bitCount+7)>>3);
+  queued.bitCount = bitCount;
+  queued.repeats = repeats;
+  queued.supersedeKey = supersedeKey;
+}
+
+// Unlink the least urgent waiting packet, if it is not itself an emergency stop,
+// and return its slot (or QUEUE_END if there is nothing that may be dropped).
+byte DCCWaveform::dropLastPacket() {
+  byte slot=QUEUE_END;
+  noInterrupts();
+  volatile byte * link=&queueHead;
+  if (*link!=QUEUE_END) {
+    while (queue[*link].next!=QUEUE_END) link=&queue[*link].next;
+    if (queue[*link].priority!=PACKET_PRIORITY::ESTOP) {
+      slot=*link;
+      *link=QUEUE_END;
+    }
+  }
+  interrupts();
+  if (slot!=QUEUE_END) packetsRejected++;
+  return slot;
+}
+
+void DCCWaveform::displayQueueStats(Print * stream) {
+  byte waiting=0;
+  noInterrupts();
+  for (byte slot=0; slot<PACKET_QUEUE_SIZE; slot++) if (queue[slot].inUse && slot!=transmitSlot) waiting++;
+  interrupts();
+  StringFormatter::send(stream,F("%S queue waiting=%d max=%d size=%d rejected=%d superseded=%l\n"),
+                        trackName(), waiting, queueHighWater, PACKET_QUEUE_SIZE, 
+                        packetsRejected, packetsSuperseded);
 }
 
 // Operations applicable to PROG track ONLY.
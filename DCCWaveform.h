@@ -21,9 +21,11 @@
 #define DCCWaveform_h
 
 #include "MotorDriver.h"
+#include "DCCSlotEncoder.h"
 
 // Wait times for power management. Unit: milliseconds
 const int  POWER_SAMPLE_ON_WAIT = 100;
+const int  POWER_SAMPLE_ON_WAIT_FAST = 1;  // when the ADC interrupt samples the current
 const int  POWER_SAMPLE_OFF_WAIT = 1000;
 const int  POWER_SAMPLE_OVERLOAD_WAIT = 20;
 
@@ -31,6 +33,25 @@ const int  POWER_SAMPLE_OVERLOAD_WAIT = 20;
 const int   PREAMBLE_BITS_MAIN = 16;
 const int   PREAMBLE_BITS_PROG = 22;
 const byte   MAX_PACKET_SIZE = 5;  // NMRA standard extended packets, payload size WITHOUT checksum.
+// Packets are queued as their complete wire image: preamble, then a start bit and 8 bits
+// for each byte including the checksum, then the end bit.
+const byte   PACKET_IMAGE_BYTES = (PREAMBLE_BITS_PROG + 9*(MAX_PACKET_SIZE+1) + 1 + 7)/8;
+
+// Number of packets that may wait for transmission on each track,
+// plus the slot that the interrupt is transmitting from.
+#ifdef ARDUINO_AVR_UNO
+const byte   PACKET_QUEUE_SIZE = 5;
+#else
+const byte   PACKET_QUEUE_SIZE = 9;
+#endif
+const byte   QUEUE_END = 0xFF;    // end of queue link
+
+// Tracks with their own motor driver and overload protection: main, prog and boosters.
+#ifdef ARDUINO_AVR_UNO
+const byte   MAX_DISTRICTS = 2;
+#else
+const byte   MAX_DISTRICTS = 8;
+#endif
 
 // The WAVE_STATE enum is deliberately numbered because a change of order would be catastrophic
 // to the transform array.
@@ -43,6 +64,30 @@ enum  WAVE_STATE : byte {WAVE_START=0,WAVE_MID_1=1,WAVE_HIGH_0=2,WAVE_MID_0=3,WA
 
 enum class POWERMODE : byte { OFF, ON, OVERLOAD };
 
+// Packet priorities, most urgent first. Queued packets are transmitted in 
+// priority order, and in order of scheduling within the same priority.
+// ESTOP is only for a stop the user has just issued: it cuts short the repeats 
+// of the packet being sent and may displace a waiting packet.
+enum class PACKET_PRIORITY : byte { ESTOP, SPEED, FUNCTION, ACCESSORY, REMINDER };
+
+// A waiting packet may be superseded by a later one with the same key, which 
+// is made of the kind of instruction (high word) and the loco address (low word).
+// Key 0 is never superseded. A key for address 0 (broadcast) supersedes that
+// kind of instruction for all addresses.
+inline unsigned long supersedeKey(uint16_t kind, uint16_t address) {
+  return ((unsigned long)kind << 16) | address;
+}
+
+struct QueuedPacket {
+  byte image[PACKET_IMAGE_BYTES]; // wire image, first bit is bit 7 of image[0]
+  byte bitCount;
+  byte repeats;
+  PACKET_PRIORITY priority;
+  unsigned long supersedeKey;
+  volatile byte next;           // next slot in transmission order or QUEUE_END
+  volatile bool inUse;          // cleared by the interrupt once its transmission has finished
+};
+
 const byte idlePacket[] = {0xFF, 0x00, 0xFF};
 const byte resetPacket[] = {0x00, 0x00, 0x00};
 
@@ -53,6 +98,13 @@ class DCCWaveform {
     static void loop(bool ackManagerActive);
     static DCCWaveform  mainTrack;
     static DCCWaveform  progTrack;
+    // Adds a booster district with its own motor driver and overload protection.
+    // It sends the main track's packets. Must be called before DCC::begin.
+    // Returns the district number, or -1 if there is no room or on ESP32, where
+    // the RMT channels only drive the main and prog signal pins.
+    static int addDistrict(MotorDriver * driver);
+    static DCCWaveform * districts[MAX_DISTRICTS];  // 0 is main, 1 is prog
+    static byte districtCount;
 
     void beginTrack();
     void setPowerMode(POWERMODE);
@@ -60,7 +112,7 @@ class DCCWaveform {
     void checkPowerOverload(bool ackManagerActive);
     inline int get1024Current() {
 	  if (powerMode == POWERMODE::ON)
-	      return (int)(lastCurrent*(long int)1024/motorDriver->getRawCurrentTripValue());
+	      return motorDriver->raw2Trip1024(lastCurrent);
 	  return 0;
     }
     inline int getCurrentmA() {
@@ -80,8 +132,20 @@ class DCCWaveform {
       }
       return tripmA;        
     }
-    void schedulePacket(const byte buffer[], byte byteCount, byte repeats);
-    volatile bool packetPending;
+    // Returns false if the packet could not be queued (track busy). Never waits.
+    bool schedulePacket(const byte buffer[], byte byteCount, byte repeats,
+                        PACKET_PRIORITY priority=PACKET_PRIORITY::ACCESSORY, unsigned long supersedeKey=0);
+    // As schedulePacket, for a packet already encoded (checksum included) by encodePacket
+    bool scheduleEncodedPacket(const byte packet[], byte length, byte repeats,
+                               PACKET_PRIORITY priority, unsigned long supersedeKey);
+    // Drops the waiting packets with this key at this priority or less urgent
+    void dropPackets(unsigned long supersedeKey, PACKET_PRIORITY priority);
+    // Copies the buffer to packet (MAX_PACKET_SIZE+1 bytes) adding the checksum, returns the length
+    static byte encodePacket(byte packet[], const byte buffer[], byte byteCount);
+    inline bool isPacketPending() {
+      return queueHead!=QUEUE_END;
+    }
+    void displayQueueStats(Print * stream);
     volatile byte sentResetsSincePacket;
     volatile bool autoPowerOff=false;
     void setAckBaseline();  //prog track only
@@ -117,23 +181,49 @@ class DCCWaveform {
    static const bool signalTransform[6];
   
     static void interruptHandler();
+    static void interruptHandlerVariable();
+    static void interruptHandlerShift();
+    byte nextSlots();
+    static inline void setSignals(byte streamBits) __attribute__((always_inline));  // in both interrupt handlers
+    const FSH * trackName();
     void interrupt2();
+    void endOfImage();
+    friend class DCCRMT;  // ESP32 streams the images through the RMT peripheral
+    byte nextEdge();
     void checkAck();
+    byte dropLastPacket();
+    bool supersedePacket(const byte image[], byte bitCount, byte repeats, 
+                         PACKET_PRIORITY priority, unsigned long supersedeKey);
+    static void fillPacket(QueuedPacket & queued, const byte image[], byte bitCount, byte repeats, unsigned long supersedeKey);
+    byte encodeImage(byte image[], const byte packet[], byte length);
     
     bool isMainTrack;
     MotorDriver*  motorDriver;
+    byte stream;              // packet stream whose signal this district outputs
+    static DCCWaveform * streams[MAX_SIGNAL_STREAMS];  // 0 is main, 1 is prog
+    static byte streamBits;   // variable period mode: signal now output by each stream
     // Transmission controller
-    byte transmitPacket[MAX_PACKET_SIZE+1]; // +1 for checksum
-    byte transmitLength;
+    const byte * transmitImage;  // wire image being sent, a queue slot or idleImage
+    byte transmitSlot;         // queue slot held by transmitImage, or QUEUE_END
+    byte transmitBitCount;
     byte transmitRepeats;      // remaining repeats of transmission
-    byte remainingPreambles;
+    const byte * transmitByte; // next bit to send is transmitMask in *transmitByte
+    byte transmitMask;
+    byte bitsSent;
     byte requiredPreambles;
-    byte bits_sent;           // 0-8 (yes 9 bits) sent for current byte
-    byte bytes_sent;          // number of bytes sent from transmitPacket
+    byte idleImage[PACKET_IMAGE_BYTES];  // idle packet (main) or reset packet (prog)
+    byte idleBitCount;
     WAVE_STATE state;         // wave generator state machine
-    byte pendingPacket[MAX_PACKET_SIZE+1]; // +1 for checksum
-    byte pendingLength;
-    byte pendingRepeats;
+    byte ticksToEdge;         // variable period mode: ticks until this track's next edge
+    byte levelTicks;          // and the ticks the signal then lasts, state is that far ahead
+    DCCSlotEncoder slotEncoder;  // shifted mode: image to half bit slots
+    static byte currentPeriod;  // variable period mode: ticks in the timer period now running
+    // Pending packets, linked in transmission order from queueHead
+    QueuedPacket queue[PACKET_QUEUE_SIZE];
+    volatile byte queueHead;
+    byte queueHighWater;
+    unsigned int packetsRejected;
+    unsigned long packetsSuperseded;
     int  lastCurrent;
     static int progTripValue;
     int maxmA;
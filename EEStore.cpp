@@ -22,6 +22,8 @@
 #include "Turnouts.h"
 #include "Sensors.h"
 #include "Outputs.h"
+#include "LocoFlags.h"
+#include "CVCache.h"
 #include "DIAG.h"
 
 #if defined(ARDUINO_ARCH_SAMD)
@@ -49,6 +51,8 @@ void EEStore::init(){
     Turnout::load();    // load turnout definitions
     Sensor::load();     // load sensor definitions
     Output::load();     // load output definitions
+    LocoFlags::load();  // load loco decoder flags
+    CVCache::load();    // load decoder CV values
 
 }
 
@@ -61,6 +65,9 @@ void EEStore::clear(){
     eeStore->data.nSensors=0;
     eeStore->data.nOutputs=0;
     EEPROM.put(0,eeStore->data);
+    reset();
+    LocoFlags::clear();
+    CVCache::clear();
 
 }
 
@@ -71,6 +78,8 @@ void EEStore::store(){
     Turnout::store();
     Sensor::store();
     Output::store();
+    LocoFlags::store();
+    CVCache::store();
     EEPROM.put(0,eeStore->data);
 }
 
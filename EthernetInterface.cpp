@@ -29,6 +29,7 @@
 #include "DIAG.h"
 #include "CommandDistributor.h"
 #include "DCCTimer.h"
+#include "DCC.h"
 
 EthernetInterface * EthernetInterface::singleton=NULL;
 /**
@@ -167,6 +168,7 @@ void EthernetInterface::loop()
      if (clients[socket] && !clients[socket].connected()) {
       clients[socket].stop();
       if (Diag::ETHERNET)  DIAG(F("Ethernet: disconnect %d "), socket);             
+      DCC::cancelProgJobs(outboundRing, socket);
      }
     }
     
@@ -0,0 +1,113 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef DCC_ISR_PROFILE
+#include "ISRProfile.h"
+#include "StringFormatter.h"
+
+const uint32_t CYCLES_PER_US = F_CPU / 1000000UL;
+const uint32_t MAX_COUNT = 0xFFFFFFFFUL;
+
+ISRProfile::Stats ISRProfile::sections[ISR_SECTIONS];
+ISRProfile::Stats ISRProfile::jitter;
+uint32_t ISRProfile::histogram[ISR_HISTOGRAM_BUCKETS];
+uint32_t ISRProfile::lastStart=0;
+bool ISRProfile::started=false;
+
+// Called with interrupts disabled, from the interrupt itself.
+void ISRProfile::add(Stats & stats, uint32_t value) {
+  if (stats.count==MAX_COUNT) return;
+  if (stats.count==0 || value<stats.min) stats.min=value;
+  if (value>stats.max) stats.max=value;
+  stats.sum+=value;
+  stats.count++;
+}
+
+void ISRProfile::tick(uint32_t start, uint32_t expectedUs) {
+  if (timerClock) {
+#if defined(__AVR__) && !defined(ARDUINO_ARCH_MEGAAVR) && !defined(DCC_USART_SHIFT)
+    TIFR1 = _BV(ICF1);   // now() looks for the top of this period
+#endif
+    add(jitter, start);  // cycles since the timer interrupted
+  }
+  else if (started) {
+    uint32_t interval=start-lastStart;
+    uint32_t expected=expectedUs*CYCLES_PER_US;
+    add(jitter, interval>expected ? interval-expected : expected-interval);
+  }
+  lastStart=start;
+  started=true;
+}
+
+uint32_t ISRProfile::record(ISR_SECTION section, uint32_t start) {
+  uint32_t end=now();
+  add(sections[section], end-start);
+  return end;
+}
+
+void ISRProfile::end() {
+  uint32_t cycles=now()-lastStart;
+  add(sections[ISR_TOTAL], cycles);
+  uint32_t bucket=cycles / (8*CYCLES_PER_US);
+  uint32_t & count=histogram[bucket<ISR_HISTOGRAM_BUCKETS ? bucket : ISR_HISTOGRAM_BUCKETS-1];
+  if (count!=MAX_COUNT) count++;
+}
+
+void ISRProfile::reset() {
+  noInterrupts();
+  memset(sections, 0, sizeof(sections));
+  memset(&jitter, 0, sizeof(jitter));
+  memset(histogram, 0, sizeof(histogram));
+  started=false;
+  interrupts();
+#if defined(TEENSYDUINO)
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;          // the cycle counter is not running on all Teensy 3.x
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+}
+
+void ISRProfile::printStats(Print * stream, const FSH * name, const Stats & stats) {
+  StringFormatter::send(stream, F("ISR %S n=%l min=%l max=%l mean=%l\n"), name, stats.count,
+                        stats.min, stats.max, stats.count ? (uint32_t)(stats.sum/stats.count) : 0);
+}
+
+void ISRProfile::print(Print * stream) {
+  Stats copySections[ISR_SECTIONS];
+  Stats copyJitter;
+  uint32_t copyHistogram[ISR_HISTOGRAM_BUCKETS];
+  noInterrupts();
+  memcpy(copySections, sections, sizeof(sections));
+  copyJitter=jitter;
+  memcpy(copyHistogram, histogram, sizeof(histogram));
+  interrupts();
+
+  StringFormatter::send(stream, F("ISR cycles, %l per uS\n"), CYCLES_PER_US);
+  printStats(stream, F("TOTAL "), copySections[ISR_TOTAL]);
+  printStats(stream, F("SIGNAL"), copySections[ISR_SIGNALS]);
+  printStats(stream, F("MAIN  "), copySections[ISR_MAIN]);
+  printStats(stream, F("PROG  "), copySections[ISR_PROG]);
+  printStats(stream, F("ACK   "), copySections[ISR_ACK]);
+  printStats(stream, F("JITTER"), copyJitter);
+  StringFormatter::send(stream, F("ISR TOTAL uS"));
+  for (byte b=0; b<ISR_HISTOGRAM_BUCKETS; b++) {
+    if (b<ISR_HISTOGRAM_BUCKETS-1) StringFormatter::send(stream, F(" <%d:%l"), (b+1)*8, copyHistogram[b]);
+    else StringFormatter::send(stream, F(" >=%d:%l"), b*8, copyHistogram[b]);
+  }
+  StringFormatter::send(stream, F("\n"));
+}
+#endif
@@ -0,0 +1,121 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef ISRProfile_h
+#define ISRProfile_h
+
+// Optional profiler for the DCC waveform interrupt, reported by <D ISR>.
+// Build with -DDCC_ISR_PROFILE to enable it, otherwise the macros below 
+// compile to nothing and the profiler takes no code or RAM.
+//
+// Times are in CPU cycles. Teensy and ESP32 read the cycle counter. AVR and
+// megaAVR read the DCC timer's counter, which gives the cycles since the 
+// timer interrupted; JITTER is then the delay in entering the interrupt. Times
+// that run on past the next timer interrupt are too short by whole periods.
+// With -DDCC_USART_SHIFT the timer is not running and micros() is used, 
+// with a resolution of 4uS on a 16MHz Mega.
+// On ESP32 the RMT peripheral interrupts each time it has sent a quarter of 
+// the main track's ring of items, and JITTER is the time since the last
+// interrupt less the time those items took. The signal has no gap unless
+// the interrupt is two quarters late, when the RMT stops and MAIN is the
+// restart, with a JITTER of the whole time since the last interrupt.
+// Counts stop at 2^32-1 so that the mean stays right.
+
+#ifdef DCC_ISR_PROFILE
+#include <Arduino.h>
+#include "FSH.h"
+
+enum ISR_SECTION : byte { 
+  ISR_TOTAL,   // whole interrupt
+  ISR_SIGNALS, // setting the signal pins of all tracks, and the timer period
+  ISR_MAIN,    // main track state and next bit, signals too when shifted
+  ISR_PROG,    // prog track signal, state and next bit
+  ISR_ACK,     // checkAck on the prog track, with analogRead unless the ADC is free running
+  ISR_SECTIONS 
+};
+
+const byte ISR_HISTOGRAM_BUCKETS = 8;   // of ISR_TOTAL, 8uS wide, last one open ended
+const uint32_t ISR_TICK_US = 58;        // DCC_SIGNAL_TIME in DCCTimer.cpp
+
+class ISRProfile {
+  public:
+    static inline uint32_t now() {
+#if defined(ESP32)
+      return ESP.getCycleCount();
+#elif defined(TEENSYDUINO)
+      return ARM_DWT_CYCCNT;
+#elif defined(ARDUINO_ARCH_MEGAAVR)
+      // TCB0 counts at F_CPU/2 up to CCMP, clears and interrupts
+      uint32_t count=TCB0.CNT;
+      if (TCB0.INTFLAGS & TCB_CAPT_bm) count+=TCB0.CCMP+1UL;   // the next interrupt is due
+      return 2*count;
+#elif defined(__AVR__) && !defined(DCC_USART_SHIFT)
+      // Timer1 counts up to ICR1 and back down at one count per cycle, interrupting at 0.
+      // ICF1 is set at the top and cleared by tick(), TOV1 is cleared entering the interrupt.
+      uint16_t count=TCNT1;
+      byte flags=TIFR1;
+      uint32_t top=ICR1;
+      if (flags & _BV(TOV1)) return 2*top + count;   // the next interrupt is due
+      if (flags & _BV(ICF1)) return 2*top - count;
+      return count;
+#else
+      return micros() * (F_CPU / 1000000UL);
+#endif
+    }
+    // The clock restarts at each timer interrupt
+    static const bool timerClock=
+#if defined(ARDUINO_ARCH_MEGAAVR) || (defined(__AVR__) && !defined(DCC_USART_SHIFT))
+      true;
+#else
+      false;
+#endif
+    static void tick(uint32_t start, uint32_t expectedUs);  // at interrupt entry
+    static uint32_t record(ISR_SECTION section, uint32_t start);  // returns now() 
+    static void end();                                    // at interrupt exit
+    static void reset();
+    static void print(Print * stream);
+  private:
+    struct Stats {
+      uint32_t min;
+      uint32_t max;
+      uint64_t sum;
+      uint32_t count;     // stops at 2^32-1
+    };
+    static void add(Stats & stats, uint32_t value);
+    static void printStats(Print * stream, const FSH * name, const Stats & stats);
+    static Stats sections[ISR_SECTIONS];
+    static Stats jitter;        // difference between actual and expected interval between interrupts
+    static uint32_t histogram[ISR_HISTOGRAM_BUCKETS];
+    static uint32_t lastStart;
+    static bool started;
+};
+
+// Sections follow on from each other: ISR_PROFILE_SECTION records the time since
+// the start or the previous section and moves the mark on.
+#define ISR_PROFILE_START(mark, periodTicks) ISR_PROFILE_START_US(mark, (periodTicks)*ISR_TICK_US)
+#define ISR_PROFILE_START_US(mark, expectedUs) uint32_t mark=ISRProfile::now(); ISRProfile::tick(mark, expectedUs)
+#define ISR_PROFILE_SECTION(section, mark) mark=ISRProfile::record(section, mark)
+#define ISR_PROFILE_END() ISRProfile::end()
+#else
+#define ISR_PROFILE_START(mark, periodTicks)
+#define ISR_PROFILE_START_US(mark, expectedUs)
+#define ISR_PROFILE_SECTION(section, mark)
+#define ISR_PROFILE_END()
+#endif
+
+#endif
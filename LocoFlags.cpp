@@ -0,0 +1,142 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/**********************************************************************
+
+Loco flags record decoder capabilities per cab address so that packets
+can be built to suit the decoder.
+
+  <L>                      lists all locos with flags as <L CAB FLAGS>
+  <L CAB>                  shows the flags for one cab
+  <L CAB RCN212 0|1>       the decoder does (1) or does not (0) accept the RCN-212
+                           speed, direction and functions instruction.
+                           Reminders for such a loco need far fewer packets.
+
+Flags are stored to EEPROM as soon as they are changed. A cab with no
+flags set is not stored. The loco flags follow the outputs in EEPROM,
+behind their own header so that an EEPROM written by older versions,
+which has nothing there, is read as having no loco flags.
+
+**********************************************************************/
+
+#include "LocoFlags.h"
+#include "EEStore.h"
+#include "StringFormatter.h"
+
+#define LOCOFLAGS_ID "LF"
+
+struct LocoFlagsHeader {
+  char id[sizeof(LOCOFLAGS_ID)];
+  int nLocos;
+};
+
+byte LocoFlags::get(int cab) {
+  LocoFlags *tt;
+  for(tt=firstLoco;tt!=NULL && tt->data.cab!=cab;tt=tt->nextLoco);
+  return tt ? tt->data.flags : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Returns false if a new entry could not be allocated
+bool LocoFlags::set(int cab, byte flags) {
+  LocoFlags *tt,*pp=NULL;
+  for(tt=firstLoco;tt!=NULL && tt->data.cab!=cab;pp=tt,tt=tt->nextLoco);
+
+  if (flags==0) {
+    if (tt==NULL) return true;
+    if (pp==NULL) firstLoco=tt->nextLoco;
+    else pp->nextLoco=tt->nextLoco;
+    free(tt);
+  }
+  else {
+    if (tt==NULL) {
+      tt=(LocoFlags *)calloc(1,sizeof(LocoFlags));
+      if (tt==NULL) return false;
+      tt->nextLoco=firstLoco;
+      firstLoco=tt;
+      tt->data.cab=cab;
+    }
+    tt->data.flags=flags;
+  }
+  EEStore::store();
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void LocoFlags::load(){
+  struct LocoFlagsHeader header;
+  EEPROM.get(EEStore::pointer(),header);
+  if (strncmp(header.id,LOCOFLAGS_ID,sizeof(LOCOFLAGS_ID))!=0) return;
+  EEStore::advance(sizeof(header));
+
+  struct LocoFlagsData data;
+  for(int i=0;i<header.nLocos;i++){
+    EEPROM.get(EEStore::pointer(),data);
+    LocoFlags *tt=(LocoFlags *)calloc(1,sizeof(LocoFlags));
+    if (tt==NULL) return;
+    tt->data=data;
+    tt->nextLoco=firstLoco;
+    firstLoco=tt;
+    EEStore::advance(sizeof(tt->data));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void LocoFlags::store(){
+  struct LocoFlagsHeader header;
+  int headerAddress=EEStore::pointer();
+  EEStore::advance(sizeof(header));
+
+  strncpy(header.id,LOCOFLAGS_ID,sizeof(LOCOFLAGS_ID));
+  header.nLocos=0;
+  for(LocoFlags *tt=firstLoco;tt!=NULL;tt=tt->nextLoco){
+    EEPROM.put(EEStore::pointer(),tt->data);
+    EEStore::advance(sizeof(tt->data));
+    header.nLocos++;
+  }
+  EEPROM.put(headerAddress,header);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Mark the EEPROM as holding no loco flags, used when the whole store is cleared
+void LocoFlags::clear(){
+  struct LocoFlagsHeader header;
+  strncpy(header.id,LOCOFLAGS_ID,sizeof(LOCOFLAGS_ID));
+  header.nLocos=0;
+  EEPROM.put(EEStore::pointer(),header);
+  EEStore::advance(sizeof(header));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void LocoFlags::printAll(Print *stream){
+  for (LocoFlags *tt=firstLoco;tt!=NULL;tt=tt->nextLoco)
+    StringFormatter::send(stream, F("<L %d %d>\n"), tt->data.cab, tt->data.flags);
+}
+
+void LocoFlags::print(Print *stream, int cab){
+  StringFormatter::send(stream, F("<L %d %d>\n"), cab, get(cab));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+LocoFlags *LocoFlags::firstLoco=NULL;
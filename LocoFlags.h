@@ -0,0 +1,46 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef LocoFlags_h
+#define LocoFlags_h
+
+#include <Arduino.h>
+
+// Decoder capabilities that change how packets are built for a loco
+const byte LOCO_FLAG_RCN212=0x01;   // accepts the RCN-212 speed, direction and functions instruction
+
+struct LocoFlagsData {
+  int cab;
+  byte flags;
+};
+
+class LocoFlags {
+  public:
+  static LocoFlags *firstLoco;
+  LocoFlagsData data;
+  LocoFlags *nextLoco;
+  static byte get(int cab);
+  static bool set(int cab, byte flags);
+  static void load();
+  static void store();
+  static void clear();
+  static void printAll(Print *);
+  static void print(Print *, int cab);
+}; // LocoFlags
+
+#endif
@@ -21,13 +21,44 @@
 #include "DCCTimer.h"
 #include "DIAG.h"
 
+#if defined(ESP32)
+// GPIO_OUT_REG and GPIO_OUT1_REG are each followed by their W1TS and W1TC
+// registers, which set and clear pins without touching those that other 
+// tasks, maybe on the other core, are writing.
+#define setHIGH(fastpin)  *(fastpin.inout+1) = fastpin.maskHIGH
+#define setLOW(fastpin)   *(fastpin.inout+2) = fastpin.maskHIGH
+#else
 #define setHIGH(fastpin)  *fastpin.inout |= fastpin.maskHIGH
 #define setLOW(fastpin)   *fastpin.inout &= fastpin.maskLOW
+#endif
 #define isHIGH(fastpin)   (*fastpin.inout & fastpin.maskHIGH)
 #define isLOW(fastpin)    (!isHIGH(fastpin))
 
 bool MotorDriver::usePWM=false;
 bool MotorDriver::commonFaultPin=false;
+bool MotorDriver::slicedSignals=false;
+SIGNALPORT MotorDriver::signalPorts[MAX_SIGNAL_PORTS];
+byte MotorDriver::signalPortCount=0;
+volatile portreg_t MotorDriver::dummyPort=0;
+MotorDriver * MotorDriver::sampledDrivers[MAX_SAMPLED_DRIVERS];
+byte MotorDriver::sampledPins[MAX_SAMPLED_DRIVERS];
+byte MotorDriver::sampledCount=0;
+MotorDriver * MotorDriver::faultDrivers[MAX_SAMPLED_DRIVERS];
+byte MotorDriver::faultCount=0;
+
+// An int is read in two halves on AVR, which must not be split by the interrupt 
+// writing it. Also used from the waveform interrupt, so restores the interrupt state.
+static inline int atomicRead(volatile int & value) {
+#if defined(__AVR__)
+  byte sreg=SREG;
+  cli();
+  int result=value;
+  SREG=sreg;
+  return result;
+#else
+  return value;
+#endif
+}
        
 MotorDriver::MotorDriver(byte power_pin, byte signal_pin, byte signal_pin2, int8_t brake_pin,
                          byte current_pin, float sense_factor, unsigned int trip_milliamps, byte fault_pin) {
@@ -43,6 +74,11 @@ MotorDriver::MotorDriver(byte power_pin, byte signal_pin, byte signal_pin2, int8
     getFastPin(F("SIG"),signalPin,fastSignalPin);
     pinMode(signalPin, OUTPUT);
   }
+  else {
+    fastSignalPin.inout=&dummyPort;
+    fastSignalPin.maskHIGH=0;
+    fastSignalPin.maskLOW=~0;
+  }
   
   signalPin2=signal_pin2;
   if (signalPin2!=UNUSED_PIN) {
@@ -52,6 +88,9 @@ MotorDriver::MotorDriver(byte power_pin, byte signal_pin, byte signal_pin2, int8
   }
   else {
     dualSignal=false; 
+    fastSignalPin2.inout=&dummyPort;
+    fastSignalPin2.maskHIGH=0;
+    fastSignalPin2.maskLOW=~0;
   }
   
   brakePin=brake_pin;
@@ -76,9 +115,12 @@ MotorDriver::MotorDriver(byte power_pin, byte signal_pin, byte signal_pin2, int8
     pinMode(faultPin, INPUT);
   }
 
-  senseFactor=sense_factor;
+  // The only float arithmetic, so the calibrations in MotorDrivers.h stay as they are
+  senseScale=(uint32_t)(sense_factor * (1UL<<SENSE_SHIFT) + 0.5);
+  rawScale=(uint32_t)((1UL<<RAW_SHIFT) / sense_factor + 0.5);
   tripMilliamps=trip_milliamps;
   rawCurrentTripValue=(int)(trip_milliamps / sense_factor);
+  trip1024Scale= rawCurrentTripValue>0 ? ((1024UL<<RAW_SHIFT) / rawCurrentTripValue) : 0;
   
   if (currentPin==UNUSED_PIN) {
     DIAG(F("MotorDriver ** WARNING ** No current or short detection"));  
@@ -102,6 +144,11 @@ void MotorDriver::setPower(bool on) {
     // on the Pololu board if brake is wired to ^D2.
     setBrake(true);
     setBrake(false);
+    noInterrupts();
+    heat=0;
+    overloaded=false;
+    faultTripped=false;
+    interrupts();
     setHIGH(fastPowerPin);
   }
   else setLOW(fastPowerPin);
@@ -121,22 +168,33 @@ void MotorDriver::setBrake(bool on) {
   else setLOW(fastBrakePin);
 }
 
-void MotorDriver::setSignal( bool high) {
-  if (signalPin == UNUSED_PIN) return;
+// Add this driver's signal pins to the signal port table, to follow the given 
+// packet stream. Pins on a port already in the table cost nothing more in the 
+// interrupt, so shields such as the standard motor shield (pins 12 and 13) and
+// the Pololu (pins 7 and 8) need one port write for both tracks.
+bool MotorDriver::addSignalPins(byte stream) {
+  if (signalPin==UNUSED_PIN) return true;
+  if (!addSignalPin(fastSignalPin, stream, false)) return false;
+  return !dualSignal || addSignalPin(fastSignalPin2, stream, true);
+}
 
-   if (usePWM) {
-    DCCTimer::setPWM(signalPin,high);
-   }
-   else {
-     if (high) {
-        setHIGH(fastSignalPin);
-        if (dualSignal) setLOW(fastSignalPin2);
-     }
-     else {
-        setLOW(fastSignalPin);
-        if (dualSignal) setHIGH(fastSignalPin2);
-     }
-   }
+bool MotorDriver::addSignalPin(const FASTPIN & pin, byte stream, bool invert) {
+  byte p;
+  for (p=0; p<signalPortCount; p++) if (signalPorts[p].inout==pin.inout) break;
+  if (p==signalPortCount) {
+    if (p==MAX_SIGNAL_PORTS) return false;
+    signalPorts[p].inout=pin.inout;
+    signalPorts[p].keepMask=~0;
+    for (byte i=0; i<(1 << MAX_SIGNAL_STREAMS); i++) signalPorts[p].bits[i]=0;
+    signalPortCount++;
+  }
+  SIGNALPORT & port=signalPorts[p];
+  port.keepMask &= pin.maskLOW;
+  for (byte i=0; i<(1 << MAX_SIGNAL_STREAMS); i++) {
+    bool high=(i >> stream) & 1;
+    if (high != invert) port.bits[i] |= pin.maskHIGH;
+  }
+  return true;
 }
 
 #if defined(ARDUINO_TEENSY32) || defined(ARDUINO_TEENSY35)|| defined(ARDUINO_TEENSY36)
@@ -157,51 +215,159 @@ bool MotorDriver::canMeasureCurrent() {
 int MotorDriver::getCurrentRaw() {
   if (currentPin==UNUSED_PIN) return 0; 
   int current;
+  if (sampled) {
+    current = atomicRead(samples[(sampleIndex-1) & (CURRENT_SAMPLES-1)]);
+  }
+  else {
 #if defined(ARDUINO_TEENSY40) || defined(ARDUINO_TEENSY41)
-  bool irq = disableInterrupts();
-  current = analogRead(currentPin)-senseOffset;
-  enableInterrupts(irq);
+    bool irq = disableInterrupts();
+    current = analogRead(currentPin)-senseOffset;
+    enableInterrupts(irq);
 #elif defined(ARDUINO_TEENSY32) || defined(ARDUINO_TEENSY35)|| defined(ARDUINO_TEENSY36)
-  unsigned char sreg_backup;
-  sreg_backup = SREG;   /* save interrupt enable/disable state */
-  cli();
-  current = analogRead(currentPin)-senseOffset;
-  overflow_count = 0;
-  SREG = sreg_backup;    /* restore interrupt state */
+    unsigned char sreg_backup;
+    sreg_backup = SREG;   /* save interrupt enable/disable state */
+    cli();
+    current = analogRead(currentPin)-senseOffset;
+    overflow_count = 0;
+    SREG = sreg_backup;    /* restore interrupt state */
 #else
-  current = analogRead(currentPin)-senseOffset;
+    current = analogRead(currentPin)-senseOffset;
 #endif
-  if (current<0) current=0-current;
+    if (current<0) current=0-current;
+  }
+  if (faultTripped) {
+    // power already cut, so report the current at the time
+    current=faultCurrent;
+    return (current == 0 ? -1 : -current);
+  }
   if ((faultPin != UNUSED_PIN)  && isLOW(fastFaultPin) && isHIGH(fastPowerPin))
       return (current == 0 ? -1 : -current);
   return current;
   // IMPORTANT:  This function can be called in Interrupt() time within the 56uS timer
   //             The default analogRead takes ~100uS which is catastrphic
   //             so DCCTimer has set the sample time to be much faster.  
+  //             Where the ADC is free running it only reads the latest sample.
+}
+
+// Register for sampling by the ADC interrupt, before beginSampling.
+void MotorDriver::addToSampling() {
+  if (currentPin==UNUSED_PIN || sampledCount==MAX_SAMPLED_DRIVERS) return;
+  for (byte i=0; i<CURRENT_SAMPLES; i++) samples[i]=0;
+  setTripRaw(rawCurrentTripValue);
+  sampledDrivers[sampledCount]=this;
+  sampledPins[sampledCount]=currentPin;
+  sampledCount++;
+}
+
+void MotorDriver::beginSampling() {
+  if (!DCCTimer::beginADC(sampledPins, sampledCount, sampleCallback)) return;
+  for (byte i=0; i<sampledCount; i++) sampledDrivers[i]->sampled=true;
+  DIAG(F("MotorDriver current sampled by ADC interrupt"));
 }
 
+void MotorDriver::sampleCallback(byte index, int value) {
+  sampledDrivers[index]->takeSample(value);
+}
+
+// ADC interrupt time, with other interrupts enabled. The heat rises with the 
+// square of the current above the trip current and falls below it. At the 
+// limit the power is cut at once, the power manager reports it at its next check.
+// Only the sample, which the waveform and fault interrupts read, and the power 
+// pin, whose port they write, are changed with interrupts disabled.
+void MotorDriver::takeSample(int raw) {
+  int current=raw-senseOffset;
+  if (current<0) current=-current;
+  noInterrupts();
+  samples[sampleIndex]=current;
+  sampleIndex=(sampleIndex+1) & (CURRENT_SAMPLES-1);
+  interrupts();
+  uint32_t squared=(uint32_t)current*current;
+  if (squared>tripSquared) heat+=squared-tripSquared;
+  else {
+    uint32_t cooling=tripSquared-squared;
+    heat= heat>cooling ? heat-cooling : 0;
+  }
+  if (heat>heatLimit && !overloaded) {
+    overloaded=true;
+    noInterrupts();
+    if (powerPin!=UNUSED_PIN) setLOW(fastPowerPin);
+    interrupts();
+  }
+}
+
+// Attach the fault pin interrupt. Drivers sharing a fault pin attach it once
+// and are all cut by it, like the common fault pin shields.
+void MotorDriver::watchFault() {
+  if (faultPin==UNUSED_PIN || faultCount==MAX_SAMPLED_DRIVERS) return;
+  bool attached=false;
+  for (byte i=0; i<faultCount; i++) 
+    if (faultDrivers[i]->faultPin==faultPin) attached=true;
+  noInterrupts();
+  faultDrivers[faultCount++]=this;
+  interrupts();
+  if (attached) return;
+  if (DCCTimer::attachPinChange(faultPin, faultInterrupt))
+    DIAG(F("MotorDriver fault pin %d on interrupt"), faultPin);
+}
+
+// Interrupt time, on any change of a fault pin.
+void MotorDriver::faultInterrupt() {
+  for (byte i=0; i<faultCount; i++) {
+    MotorDriver * driver=faultDrivers[i];
+    if (isLOW(driver->fastFaultPin) && isHIGH(driver->fastPowerPin)) {
+      setLOW(driver->fastPowerPin);
+      driver->faultCurrent= driver->sampled ? 
+                       driver->samples[(driver->sampleIndex-1) & (CURRENT_SAMPLES-1)] : 0;
+      driver->faultMicros=micros();
+      driver->faultTripped=true;
+    }
+  }
+}
+
+unsigned long MotorDriver::getFaultAge() {
+  noInterrupts();
+  unsigned long age= faultTripped ? micros()-faultMicros : 0;
+  interrupts();
+  return age;
+}
+
+int MotorDriver::getCurrentMeanRaw() {
+  if (!sampled) return getCurrentRaw();
+  long total=0;
+  for (byte i=0; i<CURRENT_SAMPLES; i++) total+=atomicRead(samples[i]);
+  return total/CURRENT_SAMPLES;
+}
+
+void MotorDriver::setTripRaw(int raw) {
+  if (raw==tripRaw) return;
+  uint32_t squared=(uint32_t)raw*raw;
+  noInterrupts();
+  tripRaw=raw;
+  tripSquared=squared;
+  heatLimit=squared*OVERLOAD_I2T_SAMPLES;
+  interrupts();
+}
+
+// Both rounded to the nearest unit, where the float versions truncated 
+// (and a float product such as 100*2.99 can fall just short of 299).
 unsigned int MotorDriver::raw2mA( int raw) {
-  return (unsigned int)(raw * senseFactor);
+  if (raw<=0) return 0;
+  return (unsigned int)(((uint32_t)raw * senseScale + (1UL<<(SENSE_SHIFT-1))) >> SENSE_SHIFT);
 }
 int MotorDriver::mA2raw( unsigned int mA) {
-  return (int)(mA / senseFactor);
+  return (int)(((uint32_t)mA * rawScale + (1UL<<(RAW_SHIFT-1))) >> RAW_SHIFT);
 }
 
 void  MotorDriver::getFastPin(const FSH* type,int pin, bool input, FASTPIN & result) {
     DIAG(F("MotorDriver %S Pin=%d,"),type,pin);
     (void) type; // avoid compiler warning if diag not used above. 
-#if !defined(ESP32) // RM 2021-04-22
+    // On ESP32 the ports are GPIO_OUT_REG and GPIO_OUT1_REG (GPIO_IN_REG, GPIO_IN1_REG)
     uint8_t port = digitalPinToPort(pin);
     if (input)
       result.inout = portInputRegister(port);
     else
       result.inout = portOutputRegister(port);
     result.maskHIGH = digitalPinToBitMask(pin);
-#else
-    uint8_t port = pin;
-    result.inout = (volatile uint8_t*) malloc(2);
-    result.maskHIGH = 0;
-#endif
     result.maskLOW = ~result.maskHIGH;
     DIAG(F(" port=0x%x, inoutpin=0x%x, isinput=%d, mask=0x%x"),port, result.inout,input,result.maskHIGH);
 }
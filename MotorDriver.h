@@ -19,6 +19,7 @@
 #ifndef MotorDriver_h
 #define MotorDriver_h
 #include "FSH.h"
+#include "DCCTimer.h"
 
 // Virtualised Motor shield 1-track hardware Interface
 
@@ -26,50 +27,146 @@
 #define UNUSED_PIN 127 // inside int8_t
 #endif
 
-#if defined(__IMXRT1062__)
-struct FASTPIN {
-  volatile uint32_t *inout;
-  uint32_t maskHIGH;  
-  uint32_t maskLOW;  
-};
+#if defined(__IMXRT1062__) || defined(ESP32)
+typedef uint32_t portreg_t;
 #else
+typedef uint8_t portreg_t;
+#endif
 struct FASTPIN {
-  volatile uint8_t *inout;
-  uint8_t maskHIGH;  
-  uint8_t maskLOW;  
+  volatile portreg_t *inout;
+  portreg_t maskHIGH;  
+  portreg_t maskLOW;  
 };
+
+// The signal pins of all tracks are written by the interrupt from a table for
+// each port, indexed by the signal of both packet streams at once (bit 0 main, 
+// bit 1 prog). This is one write per port however many motor drivers share a 
+// stream.
+const byte MAX_SIGNAL_STREAMS = 2;
+#ifdef ARDUINO_AVR_UNO
+const byte MAX_SIGNAL_PORTS = 2;
+#else
+const byte MAX_SIGNAL_PORTS = 4;
 #endif
+struct SIGNALPORT {
+  volatile portreg_t *inout;
+  portreg_t keepMask;                      // pins that are not signal pins
+  portreg_t bits[1 << MAX_SIGNAL_STREAMS]; // signal pins to set high
+};
+
+// Motor drivers whose current is sampled by the free running ADC
+const byte MAX_SAMPLED_DRIVERS = 8;
+const byte CURRENT_SAMPLES = 8;     // ring of latest samples per driver, power of 2
+// I2t overload: the heat allowance in units of (trip current squared x samples).
+// With a sample every ~200uS per driver (2 drivers) this allows 1.5x the trip 
+// current for ~40mS and 2x for ~18mS, but trips a 5x short in ~2mS.
+const uint16_t OVERLOAD_I2T_SAMPLES = 256;
+// Fixed point current conversions, to keep float out of the running code.
+const byte SENSE_SHIFT = 12;     // mA per raw unit x 4096, good for sense factors up to 1000
+const byte RAW_SHIFT = 16;       // raw units per mA x 65536, good for sense factors from 1
 
 class MotorDriver {
   public:
     MotorDriver(byte power_pin, byte signal_pin, byte signal_pin2, int8_t brake_pin, 
                 byte current_pin, float senseFactor, unsigned int tripMilliamps, byte faultPin);
     virtual void setPower( bool on);
-    virtual void setSignal( bool high);
+    // setSignal is called from the waveform interrupt so it is inline and has no tests 
+    // other than usePWM: a signal pin that is not fitted writes to a dummy register.
+    inline void setSignal( bool high) {
+      if (usePWM) {
+        DCCTimer::setPWM(signalPin,high);
+      }
+      else if (high) {
+        *fastSignalPin.inout |= fastSignalPin.maskHIGH;
+        *fastSignalPin2.inout &= fastSignalPin2.maskLOW;
+      }
+      else {
+        *fastSignalPin.inout &= fastSignalPin.maskLOW;
+        *fastSignalPin2.inout |= fastSignalPin2.maskHIGH;
+      }
+    }
+    // Sets the signal pins of every driver in the signal port table, 
+    // only valid when slicedSignals.
+    static inline void setSignals(byte streamBits) {
+      for (byte p=0; p<signalPortCount; p++) {
+        SIGNALPORT & port=signalPorts[p];
+        *port.inout = (*port.inout & port.keepMask) | port.bits[streamBits];
+      }
+    }
+    bool addSignalPins(byte stream);  // false if the signal port table is full
     virtual void setBrake( bool on);
     virtual int  getCurrentRaw();
+    // Current sampling by the ADC interrupt, where DCCTimer supports it.
+    void addToSampling();
+    static void beginSampling();
+    inline bool isSampled() {
+      return sampled;
+    }
+    int getCurrentMeanRaw();        // of the latest samples
+    void setTripRaw(int raw);       // for the I2t model
+    inline bool isOverloaded() {    // the I2t model has tripped and cut the power
+      return overloaded;
+    }
+    // Fault pin interrupt, where DCCTimer supports it for the pin.
+    void watchFault();
+    unsigned long getFaultAge();    // uS since the fault interrupt cut the power, or 0
     virtual unsigned int raw2mA( int raw);
     virtual int mA2raw( unsigned int mA);
     inline int getRawCurrentTripValue() {
 	    return rawCurrentTripValue;
     }
+    inline int raw2Trip1024(int raw) {   // current in 1024ths of the trip current
+      return (int)(((uint32_t)raw * trip1024Scale) >> RAW_SHIFT);
+    }
     bool isPWMCapable();
     bool canMeasureCurrent();
     static bool usePWM;
     static bool commonFaultPin; // This is a stupid motor shield which has only a common fault pin for both outputs
+    static bool slicedSignals;    // all signal pins are in the signal port table
     inline byte getFaultPin() {
 	return faultPin;
     }
+    inline byte getSignalPin() {
+      return signalPin;
+    }
+    inline byte getSignalPin2() {
+      return signalPin2;
+    }
   private:
     void  getFastPin(const FSH* type,int pin, bool input, FASTPIN & result);
     void  getFastPin(const FSH* type,int pin, FASTPIN & result) {
 	    getFastPin(type, pin, 0, result);
     }
+    static bool addSignalPin(const FASTPIN & pin, byte stream, bool invert);
+    static SIGNALPORT signalPorts[MAX_SIGNAL_PORTS];
+    static byte signalPortCount;
+    static volatile portreg_t dummyPort;   // target of pins that are not fitted
+    static void sampleCallback(byte index, int value);
+    void takeSample(int raw);
+    static MotorDriver * sampledDrivers[MAX_SAMPLED_DRIVERS];
+    static byte sampledPins[MAX_SAMPLED_DRIVERS];
+    static byte sampledCount;
+    bool sampled=false;
+    volatile int samples[CURRENT_SAMPLES];
+    volatile byte sampleIndex=0;
+    volatile uint32_t heat=0;          // I2t above the trip current
+    uint32_t tripSquared=0;
+    uint32_t heatLimit=0;
+    volatile bool overloaded=false;
+    int tripRaw=0;
+    static void faultInterrupt();
+    static MotorDriver * faultDrivers[MAX_SAMPLED_DRIVERS];
+    static byte faultCount;
+    volatile bool faultTripped=false;  // power cut by the fault interrupt
+    volatile int faultCurrent=0;       // latest sample when cut, 0 if not sampled
+    volatile unsigned long faultMicros;
     byte powerPin, signalPin, signalPin2, currentPin, faultPin, brakePin;
     FASTPIN fastPowerPin,fastSignalPin, fastSignalPin2, fastBrakePin,fastFaultPin;
     bool dualSignal;       // true to use signalPin2
     bool invertBrake;       // brake pin passed as negative means pin is inverted
-    float senseFactor;
+    uint32_t senseScale;      // mA per raw unit << SENSE_SHIFT
+    uint32_t rawScale;        // raw units per mA << RAW_SHIFT
+    uint32_t trip1024Scale;   // 1024ths of the trip current per raw unit << RAW_SHIFT
     int senseOffset;
     unsigned int tripMilliamps;
     int rawCurrentTripValue;
@@ -38,8 +38,7 @@ bool Turnout::activate(int n,bool state){
 #endif
   Turnout * tt=get(n);
   if (tt==NULL) return false;
-  tt->activate(state);
-  EEStore::store();
+  if (!tt->activate(state)) return false;
   turnoutlistHash++;
   return true;
 }
@@ -51,24 +50,26 @@ bool Turnout::isActive(int n){
 }
 
 // activate is virtual here so that it can be overridden by a non-DCC turnout mechanism
-void Turnout::activate(bool state) {
+// Returns false, leaving the turnout as it was, if the accessory packet could not be queued.
+bool Turnout::activate(bool state) {
 #ifdef EESTOREDEBUG
   DIAG(F("Turnout::activate(%d)"),state);
 #endif
   if (data.address==LCN_TURNOUT_ADDRESS) {
      // A LCN turnout is transmitted to the LCN master.
      LCN::send('T',data.id,state);
-     return;   // The tStatus will be updated by a message from the LCN master, later.    
+     return true;   // The tStatus will be updated by a message from the LCN master, later.    
   }
+  if (data.tStatus & STATUS_PWM)
+    PWMServoDriver::setServo(data.tStatus & STATUS_PWMPIN, (data.inactiveAngle+(state?data.moveAngle:0)));
+  else if (!DCC::setAccessory(data.address,data.subAddress, state))
+    return false;  // track busy
   if (state)
     data.tStatus|=STATUS_ACTIVE;
   else
     data.tStatus &= ~STATUS_ACTIVE;
-  if (data.tStatus & STATUS_PWM)
-    PWMServoDriver::setServo(data.tStatus & STATUS_PWMPIN, (data.inactiveAngle+(state?data.moveAngle:0)));
-  else
-    DCC::setAccessory(data.address,data.subAddress, state);
   EEStore::store();
+  return true;
 }
 ///////////////////////////////////////////////////////////////////////////////
 
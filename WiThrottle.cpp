@@ -87,6 +87,7 @@ WiThrottle::WiThrottle( int wificlientid) {
 }
 
 WiThrottle::~WiThrottle() {
+  DCC::cancelProgJobs(this);  // no drive away for a client that has gone
   if (firstThrottle== this) {
     firstThrottle=this->nextThrottle;
     return;
@@ -154,7 +155,7 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
                     case 'C': newstate=false; break;
                     case '2': newstate=!Turnout::isActive(id);                 
                 }
-		            Turnout::activate(id,newstate);
+		            if (!Turnout::activate(id,newstate)) newstate=Turnout::isActive(id);  // track busy
                 StringFormatter::send(stream, F("PTA%c%d\n"),newstate?'4':'2',id );   
             }
             break;
@@ -220,13 +221,16 @@ void WiThrottle::multithrottle(RingStream * stream, byte * cmd){
           case '+':  // add loco request
                 if (cmd[3]=='*') { 
                   // M+* means get loco from prog track, then join tracks ready to drive away
-                  // Stash the things the callback will need later
-                  stashStream= stream;
-                  stashClient=stream->peekTargetMark();
-                  stashThrottleChar=throttleChar;
-                  stashInstance=this;
+                  // The prog job carries the things the callback will need later
+                  PROG_REPLY reply={};
+                  reply.callback=getLocoCallback;
+                  reply.ringStream=stream;
+                  reply.client=stream->peekTargetMark();
+                  reply.owner=this;
+                  reply.p[0]=throttleChar;
                   // ask DCC to call us back when the loco id has been read
-                  DCC::getLocoId(getLocoCallback); // will remove any previous join                    
+                  if (!DCC::getLocoId(reply)) // will remove any previous join                    
+                    StringFormatter::send(stream, F("HMProg track busy\n"));
                   return; // return nothing in stream as response is sent later in the callback 
                 }
                 //return error if address zero requested
@@ -383,20 +387,16 @@ char WiThrottle::LorS(int cab) {
 
 // Drive Away feature. Callback handling
  
-RingStream * WiThrottle::stashStream;
-WiThrottle * WiThrottle::stashInstance;
-byte         WiThrottle::stashClient;
-char         WiThrottle::stashThrottleChar;
-
-void WiThrottle::getLocoCallback(int16_t locoid) {
-  stashStream->mark(stashClient);
-  if (locoid<0) StringFormatter::send(stashStream,F("HMNo loco found on prog track\n"));
+void WiThrottle::getLocoCallback(int16_t locoid, const PROG_REPLY & reply) {
+  RingStream * stream=reply.ringStream;
+  stream->mark(reply.client);
+  if (locoid<0) StringFormatter::send(stream,F("HMNo loco found on prog track\n"));
   else {
-    char addcmd[20]={'M',stashThrottleChar,'+',LorS(locoid) };
+    char addcmd[20]={'M',(char)reply.p[0],'+',LorS(locoid) };
     itoa(locoid,addcmd+4,10);
-    stashInstance->multithrottle(stashStream, (byte *)addcmd);
+    ((WiThrottle *)reply.owner)->multithrottle(stream, (byte *)addcmd);
     DCCWaveform::progTrack.setPowerMode(POWERMODE::ON);
     DCC::setProgTrackSyncMain(true);  // <1 JOIN> so we can drive loco away
   }
-  stashStream->commit();
+  stream->commit();
 }
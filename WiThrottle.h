@@ -20,6 +20,7 @@
 #define WiThrottle_h
 
 #include "RingStream.h"
+#include "DCC.h"
 
 struct MYLOCO {
     char throttle; //indicates which throttle letter on client, often '0','1' or '2'
@@ -62,12 +63,8 @@ class WiThrottle {
       void accessory(RingStream *, byte* cmd);
       void checkHeartbeat(); 
 
-       // callback stuff to support prog track acquire
-       static RingStream * stashStream;
-       static WiThrottle * stashInstance;
-       static byte         stashClient;
-       static char         stashThrottleChar;
-       static void         getLocoCallback(int16_t locoid);
+       // callback to support prog track acquire
+       static void         getLocoCallback(int16_t locoid, const PROG_REPLY & reply);
 
 };
 #endif
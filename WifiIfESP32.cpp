@@ -132,6 +132,7 @@
 #include "DIAG.h"
 #include "CommandDistributor.h"
 #include "DCCTimer.h"
+#include "DCC.h"
 
 WifiIfESP32 * WifiIfESP32::singleton = NULL;
 
@@ -227,6 +228,7 @@ void WifiIfESP32::loop2() {
      if (clients[socket] && !clients[socket].connected()) {
       clients[socket].stop();
       if (Diag::WIFI) DIAG(F("WiFi: disconnect %d"), socket);             
+      DCC::cancelProgJobs(outboundRing, socket);
      }
     }
     
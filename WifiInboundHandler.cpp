@@ -23,6 +23,7 @@
 #include "RingStream.h"
 #include "CommandDistributor.h"
 #include "DIAG.h"
+#include "DCC.h"
 
 WifiInboundHandler * WifiInboundHandler::singleton;
 
@@ -229,6 +230,8 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
         if (ch=='C') {
          // got "x C" before CLOSE or CONNECTED, or CONNECT FAILED
          if (runningClientId==clientPendingCIPSEND) purgeCurrentCIPSEND();
+         // either way any client that had this id has gone
+         DCC::cancelProgJobs(outboundRing, runningClientId);
         }
         loopState=SKIPTOEND;   
         break;
@@ -50,8 +50,13 @@ Stream * WifiInterface::wifiStream;
 #endif
  
 #if (defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560))
+#if defined(DCC_USART_SHIFT)
+// Serial2 and Serial3 shift out the DCC signal
+#define NUM_SERIAL 1
+#else
 #define NUM_SERIAL 3
 #endif
+#endif
 
 #ifndef NUM_SERIAL
 #define NUM_SERIAL 1
@@ -122,3 +122,24 @@ The configuration file for DCC-EX Command Station
 
 /////////////////////////////////////////////////////////////////////////////////////
 
+//
+// OPTIONAL BUILD FLAGS
+//
+// These are not read from this file: they must be given to the compiler, 
+// for example in build_flags in platformio.ini.
+//
+// -DDCC_USART_SHIFT (Mega only): the DCC signal is shifted out by the serial
+//   hardware, main track on pin 14 (TX3) and prog track on pin 16 (TX2), which
+//   must then be the signal pins of the motor shield. Serial2 and Serial3 are 
+//   used up by this and cannot be used for anything else, so a WiFi board must
+//   be on Serial1.
+//
+// -DDCC_ADC_SAMPLING (Uno, Nano and Mega): the current sense pins are read all
+//   the time by the ADC interrupt, which cuts the power within milliseconds 
+//   of a short while letting sound decoders through their inrush, and the 
+//   ack is detected from the latest reading. analogRead() must then not be 
+//   used once the tracks are set up, by your own code or by any library: it 
+//   would get the wrong pin's value or hang, and upset the current sampling.
+//   Without it the current is read by analogRead() when it is needed.
+//
+/////////////////////////////////////////////////////////////////////////////////////
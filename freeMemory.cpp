@@ -34,8 +34,6 @@ extern char *__malloc_heap_start;
 #endif
 
 
-static volatile int minimum_free_memory = __INT_MAX__;
-
 #if defined(ESP32)
 static inline int freeMemory() {
   return heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
@@ -45,79 +43,96 @@ int minimumFreeMemory() {
   return freeMemory();
 }
 
-#elif !defined(__IMXRT1062__)
+void updateMinimumFreeMemory(unsigned char extraBytes) {
+  (void) extraBytes;
+}
 
-static inline int freeMemory() {
-  char top;
-#if defined(__arm__)
-  return &top - reinterpret_cast<char*>(sbrk(0));
-#elif defined(__AVR__)
-  return __brkval ? &top - __brkval : &top - __malloc_heap_start;
 #else
-#error bailed out already above
-#endif
-}
+// The free RAM between the heap and the stack is painted with a known value,
+// and updateMinimumFreeMemory looks for the lowest address that the stack has
+// overwritten.  This catches the stack used by interrupts without any cost in 
+// the interrupt itself.
 
-// Return low memory value.
-int minimumFreeMemory() {
-  byte sreg_save = SREG;
-  noInterrupts(); // Disable interrupts
-  int retval = minimum_free_memory;
-  SREG = sreg_save; // Restore interrupt state
-  return retval;
-}
+const char STACK_PAINT = 0xC5;
+const byte SCAN_BYTES_PER_CALL = 32;  // keeps each call to a few uS
+const byte STACK_MARGIN = 64;         // left unpainted below the caller's frame on ARM
 
-#else
-#if defined(ARDUINO_TEENSY40)
-  static const unsigned DTCM_START = 0x20000000UL;
-  static const unsigned OCRAM_START = 0x20200000UL;
-  static const unsigned OCRAM_SIZE = 512;
-  static const unsigned FLASH_SIZE = 1984;
-#elif defined(ARDUINO_TEENSY41)
-  static const unsigned DTCM_START = 0x20000000UL;
-  static const unsigned OCRAM_START = 0x20200000UL;
-  static const unsigned OCRAM_SIZE = 512;
-  static const unsigned FLASH_SIZE = 7936;
-#if TEENSYDUINO>151
-  extern "C" uint8_t external_psram_size;
+#if defined(__IMXRT1062__)
+  // Teensy 4: the stack grows down towards the variables in DTCM, the heap is elsewhere
+  extern unsigned long _ebss;
 #endif
+
+// Lowest address the stack can use
+static inline char * stackLimit() {
+#if defined(__AVR__)
+  return __brkval ? __brkval : __malloc_heap_start;
+#elif defined(__IMXRT1062__)
+  return (char *)&_ebss;
+#else
+  return reinterpret_cast<char*>(sbrk(0));
 #endif
+}
 
-static inline int freeMemory() {
-  extern unsigned long _ebss;
-  extern unsigned long _sdata;
-  extern unsigned long _estack;
-  const unsigned DTCM_START = 0x20000000UL;
-  unsigned dtcm = (unsigned)&_estack - DTCM_START;
-  unsigned stackinuse = (unsigned) &_estack -  (unsigned) __builtin_frame_address(0);
-  unsigned varsinuse = (unsigned)&_ebss - (unsigned)&_sdata;
-  unsigned freemem = dtcm - (stackinuse + varsinuse);
-  return freemem;
+static int minimum_free_memory = __INT_MAX__;  // only written from loop()
+static char * stackLowWater = NULL;  // lowest address found written by the stack
+static char * scanPoint = NULL;      // next painted address to check
+static char * paintStart = NULL;     // the paint starts here, at the heap as it was
+
+#if defined(__AVR__)
+// Paint before main(), with the stack still empty. Runs in .init3 with
+// r1 already cleared and SP set up by .init2.
+extern char __heap_start;
+void paintStack() __attribute__((naked, used, section(".init3")));
+void paintStack() {
+  for (char * p=&__heap_start; p < (char *)SP; p++) *p=STACK_PAINT;
 }
+#endif
 
 // Return low memory value.
 int minimumFreeMemory() {
-  //byte sreg_save = SREG;
-  //noInterrupts(); // Disable interrupts
-  int retval = minimum_free_memory;
-  //SREG = sreg_save; // Restore interrupt state
-  return retval;
+  return minimum_free_memory;
 }
-#endif
 
-
-// Update low ram level.  Allow for extra bytes to be specified
-// by estimation or inspection, that may be used by other 
-// called subroutines.  Must be called with interrupts disabled.
+// Update low ram level, called from loop(). Each call checks a few more 
+// painted bytes, working up from the top of the heap until it meets the
+// lowest address already known to be used by the stack, then starts again. 
+// Extra bytes may be specified by estimation or inspection for stack use 
+// that has not yet been seen.
 // 
 // Although __brkval may go up and down as heap memory is allocated
 // and freed, this function records only the worst case encountered.
 // So even if all of the heap is freed, the reported minimum free 
-// memory will not increase.
+// memory will not increase. Heap that has been given back still holds
+// what was stored there, so it is painted again before being scanned.
 //
 void updateMinimumFreeMemory(unsigned char extraBytes) {
-  int spare = freeMemory()-extraBytes;
+  char * limit = stackLimit();
+  if (stackLowWater == NULL) {
+    char top;
+    stackLowWater = &top - STACK_MARGIN;
+#if defined(__AVR__)
+    paintStart = &__heap_start;
+#else
+    // ARM has no early init hook here, so paint what the stack has not yet used.
+    for (char * p=limit; p < stackLowWater; p++) *p=STACK_PAINT;
+    paintStart = limit;
+#endif
+  }
+  if (limit < paintStart) {  // heap has shrunk
+    for (char * p=limit; p < paintStart && p < stackLowWater; p++) *p=STACK_PAINT;
+  }
+  paintStart = limit;
+  if (scanPoint < limit) scanPoint = limit;   // heap has grown
+  for (byte n=0; n<SCAN_BYTES_PER_CALL && scanPoint < stackLowWater; n++, scanPoint++) {
+    if (*scanPoint != STACK_PAINT) {
+      stackLowWater = scanPoint;
+      break;
+    }
+  }
+  if (scanPoint >= stackLowWater) scanPoint = limit;
+
+  int spare = (stackLowWater - limit) - extraBytes;
   if (spare < 0) spare = 0;
   if (spare < minimum_free_memory) minimum_free_memory = spare;
 }
-
+#endif
@@ -0,0 +1,107 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Compares the fixed point current conversions of MotorDriver with the float
+// versions they replaced, for the sense factor of every driver in MotorDrivers.h.
+// raw2mA must round raw*senseFactor and mA2raw mA/senseFactor, to within the
+// error of the scales, and so be the float version's truncated result or one more.
+
+#include <Arduino.h>
+#include <math.h>
+#include "MotorDriver.h"
+#include "MotorDrivers.h"
+#include "StringFormatter.h"
+
+static int failures=0;
+
+static void check(bool ok, const char * what) {
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+// Takes the place of MotorDriver in the shield macros, to keep the calibrations
+struct Calibration {
+  float senseFactor;
+  unsigned int tripMilliamps;
+  Calibration(byte powerPin, byte signalPin, byte signalPin2, int8_t brakePin, byte currentPin,
+              float sense_factor, unsigned int trip_milliamps, byte faultPin) {
+    senseFactor=sense_factor;
+    tripMilliamps=trip_milliamps;
+  }
+};
+
+static void checkDriver(const char * shield, const char * track, Calibration * calibration) {
+  float senseFactor=calibration->senseFactor;
+  MotorDriver driver(UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN,
+                     senseFactor, calibration->tripMilliamps, UNUSED_PIN);
+  // Bounds: half a unit for the rounding, plus the rounding of the scale itself
+  // (half a unit in 2^SHIFT) times the largest value converted.
+  const int MAX_RAW=1023;
+  const unsigned int MAX_MA=65535;
+  double raw2mABound=0.5 + MAX_RAW * 0.5 / (1UL<<SENSE_SHIFT);
+  double mA2rawBound=0.5 + MAX_MA * 0.5 / (1UL<<RAW_SHIFT);
+  double raw2mAWorst=0, mA2rawWorst=0;
+  unsigned int raw2mABad=0, mA2rawBad=0;
+
+  for (int raw=0; raw<=MAX_RAW; raw++) {
+    unsigned int fixed=driver.raw2mA(raw);
+    unsigned int old=(unsigned int)(raw * senseFactor);
+    double error=fabs(fixed - raw * (double)senseFactor);
+    if (error>raw2mAWorst) raw2mAWorst=error;
+    if (error>raw2mABound || fixed<old || fixed>old+1) raw2mABad++;
+  }
+  for (unsigned int mA=0; mA<=MAX_MA; mA++) {
+    int fixed=driver.mA2raw(mA);
+    int old=(int)(mA / senseFactor);
+    double error=fabs(fixed - mA / (double)senseFactor);
+    if (error>mA2rawWorst) mA2rawWorst=error;
+    if (error>mA2rawBound || fixed<old || fixed>old+1) mA2rawBad++;
+  }
+  check(driver.raw2mA(-5)==0, "raw2mA of a negative current is 0");
+  printf("%-22s %s sense=%-6g raw2mA worst=%.3f bad=%u  mA2raw worst=%.3f bad=%u\n", shield, track,
+         senseFactor, raw2mAWorst, raw2mABad, mA2rawWorst, mA2rawBad);
+  check(raw2mABad==0, "raw2mA rounds raw*senseFactor");
+  check(mA2rawBad==0, "mA2raw rounds mA/senseFactor");
+}
+
+static void checkShield(const char * shield, Calibration * main, Calibration * prog) {
+  checkDriver(shield, "main", main);
+  checkDriver(shield, "prog", prog);
+  delete main;
+  delete prog;
+}
+
+// The shield macros give the name and the two drivers
+#define CHECK_SHIELD(shield) checkShield(shield)
+
+int main() {
+  StringFormatter::diagSerial=NULL;
+#define MotorDriver Calibration
+#undef F
+#define F(string) string
+  CHECK_SHIELD(STANDARD_MOTOR_SHIELD);
+  CHECK_SHIELD(NOOP_MOTOR_SHIELD);
+  CHECK_SHIELD(POLOLU_MOTOR_SHIELD);
+  CHECK_SHIELD(FIREBOX_MK1);
+  CHECK_SHIELD(FIREBOX_MK1S);
+  CHECK_SHIELD(FUNDUMOTO_SHIELD);
+  CHECK_SHIELD(IBT_2_WITH_ARDUINO);
+  return failures ? 1 : 0;
+}
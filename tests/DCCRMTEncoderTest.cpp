@@ -0,0 +1,322 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Checks the RMT items that the ESP32 sends for a packet image: a golden
+// copy of the idle packet, then every image length against the NMRA S-9.1
+// command station limits, decoding the items back to the image. Then runs
+// the ring of items against a model of the RMT, which sends them round and
+// round while its interrupts are late by various amounts, and decodes the
+// packets that come out.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "DCCRMT.h"
+
+// NMRA S-9.1 command station limits
+const uint16_t ONE_MIN_US = 55;
+const uint16_t ONE_MAX_US = 61;
+const uint16_t ONE_MAX_DIFF_US = 3;    // between the halves of a '1'
+const uint16_t ZERO_MIN_US = 95;
+const uint16_t ZERO_MAX_US = 9900;
+
+const uint8_t IMAGE_BITS = 80;         // longest wire image, PACKET_IMAGE_BYTES*8
+
+static int failures=0;
+
+static void check(bool ok, const char * what) {
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+static uint16_t high(uint32_t item) { return item & 0x7FFF; }
+static uint16_t low(uint32_t item) { return (item >> 16) & 0x7FFF; }
+
+// The idle packet as DCCWaveform encodes it: 16 preamble bits, then
+// 0 11111111 0 00000000 0 11111111 1
+static void idleGolden() {
+  const uint8_t image[]={0xFF, 0xFF, 0x7F, 0x80, 0x1F, 0xF0};
+  const uint8_t bits=16+9+9+9+1;
+  uint32_t items[RMT_RING_ITEMS];
+  uint32_t golden[RMT_RING_ITEMS];
+  const uint32_t one=0x003A803A, zero=0x00648064;
+  uint8_t n=0;
+  for (uint8_t i=0; i<16; i++) golden[n++]=one;
+  golden[n++]=zero;
+  for (uint8_t i=0; i<8; i++) golden[n++]=one;
+  golden[n++]=zero;
+  for (uint8_t i=0; i<8; i++) golden[n++]=zero;
+  golden[n++]=zero;
+  for (uint8_t i=0; i<8; i++) golden[n++]=one;
+  golden[n++]=one;
+  uint8_t bit=0;
+  check(DCCRMTEncoder::encode(items, RMT_RING_ITEMS, image, bits, bit)==bits && bit==bits, "idle: item count");
+  check(n==bits && memcmp(items, golden, n*sizeof(items[0]))==0, "idle: items match the golden copy");
+  check(DCCRMTEncoder::durationUs(items, bits)==(uint32_t)33*116 + 11*200, "idle: duration");
+}
+
+// Every image length, encoded a few items at a time as the ring does
+static void limits() {
+  uint8_t image[IMAGE_BITS/8];
+  uint32_t items[IMAGE_BITS];
+  unsigned int ones=0, zeros=0, bad=0;
+  srand(1);
+  for (uint8_t bits=1; bits<=IMAGE_BITS; bits++) {
+    for (uint8_t b=0; b<sizeof(image); b++) image[b]=rand();
+    image[(bits-1)>>3] |= 0x80>>((bits-1)&7);   // packets end with a '1' bit
+    uint8_t bit=0, count=0;
+    while (bit<bits) {
+      uint8_t chunk=1+rand()%8;
+      uint8_t was=bit;
+      uint8_t n=DCCRMTEncoder::encode(items+count, chunk, image, bits, bit);
+      if (n!=bit-was || n>chunk || (n<chunk && bit!=bits)) bad++;
+      count+=n;
+    }
+    if (count!=bits || DCCRMTEncoder::encode(items, 1, image, bits, bit)!=0) bad++;
+    uint32_t us=0;
+    for (uint8_t b=0; b<bits; b++) {
+      uint32_t item=items[b];
+      bool one=image[b>>3] & (0x80>>(b&7));
+      // high first, then low, so the decoder sees the halves as the timer interrupt sends them
+      if (!(item & 0x8000) || (item & 0x80000000UL)) bad++;
+      uint16_t h=high(item), l=low(item);
+      us+=h+l;
+      if (one) {
+        ones++;
+        if (h<ONE_MIN_US || h>ONE_MAX_US || l<ONE_MIN_US || l>ONE_MAX_US) bad++;
+        if ((h>l ? h-l : l-h) > ONE_MAX_DIFF_US) bad++;
+      }
+      else {
+        zeros++;
+        if (h<ZERO_MIN_US || h>ZERO_MAX_US || l<ZERO_MIN_US || l>ZERO_MAX_US) bad++;
+      }
+      // a half bit between the '1' and '0' limits could not be decoded either way
+      bool decodedOne= h<=ONE_MAX_US;
+      if (decodedOne!=one) bad++;
+    }
+    if (DCCRMTEncoder::durationUs(items, bits)!=us) bad++;
+  }
+  printf("RMT items: %u ones %u zeros bad=%u, up to %d bits\n", ones, zeros, bad, IMAGE_BITS);
+  check(bad==0, "every item is within the NMRA limits and decodes to its bit");
+}
+
+// Packets numbered from 0, each with its number in its first two bytes,
+// then up to 3 random bytes and the checksum.
+const unsigned int MAX_PACKETS = 3000;
+const uint8_t PREAMBLE_BITS = 16;
+const uint8_t MAX_BYTES = 6;
+
+struct Packets {
+  uint8_t data[MAX_PACKETS][MAX_BYTES];
+  uint8_t length[MAX_PACKETS];
+  uint8_t image[MAX_PACKETS][IMAGE_BITS/8];
+  unsigned int count;
+};
+static Packets packets;
+
+static void putBit(uint8_t image[], uint8_t & bits, bool one) {
+  if (one) image[bits>>3] |= 0x80>>(bits&7);
+  bits++;
+}
+
+static const uint8_t * nextPacket(void * context, uint8_t & bitCount) {
+  Packets & p=*(Packets *)context;
+  unsigned int n=p.count++;
+  if (n>=MAX_PACKETS) {
+    check(false, "enough packets for the run");
+    exit(1);
+  }
+  uint8_t * data=p.data[n];
+  uint8_t length=3+rand()%4;
+  data[0]=n & 0xFF;
+  data[1]=n >> 8;
+  data[length-1]=data[0]^data[1];
+  for (uint8_t b=2; b<length-1; b++) {
+    data[b]=rand();
+    data[length-1]^=data[b];
+  }
+  p.length[n]=length;
+  uint8_t * image=p.image[n];
+  memset(image, 0, IMAGE_BITS/8);
+  bitCount=0;
+  for (uint8_t b=0; b<PREAMBLE_BITS; b++) putBit(image, bitCount, true);
+  for (uint8_t b=0; b<length; b++) {
+    putBit(image, bitCount, false);
+    for (uint8_t i=0; i<8; i++) putBit(image, bitCount, data[b] & (0x80>>i));
+  }
+  putBit(image, bitCount, true);
+  return image;
+}
+
+// Decodes the bits that the RMT sends, as a decoder would, and checks each
+// packet is the next one after the last, unless the RMT has stopped since.
+struct Receiver {
+  uint8_t ones;
+  int bit;           // -1 looking for the preamble, else bits of the byte so far
+  uint8_t value;
+  uint8_t data[MAX_BYTES+1];
+  uint8_t length;
+  long last;         // number of the last packet received
+  bool restarted;    // since the last packet
+  unsigned int good, bad, lost;
+
+  void addBit(bool one) {
+    if (bit<0) {
+      if (one) ones++;
+      else if (ones>=10) { bit=0; length=0; value=0; }
+      else ones=0;
+      return;
+    }
+    if (bit<8) {
+      value=(value<<1) | one;
+      if (++bit<8) return;
+      if (length<sizeof(data)) data[length]=value;
+      length++;
+      return;
+    }
+    // the bit after a byte: 0 starts the next byte, 1 ends the packet
+    if (!one) { bit=0; value=0; return; }
+    endPacket();
+    bit=-1;
+    ones=1;
+  }
+
+  void endPacket() {
+    uint8_t checksum=0;
+    for (uint8_t i=0; i<length && i<sizeof(data); i++) checksum^=data[i];
+    unsigned int n= length>=2 ? data[0] | data[1]<<8 : MAX_PACKETS;
+    if (length<3 || length>MAX_BYTES || checksum!=0 || n>=packets.count
+        || length!=packets.length[n] || memcmp(data, packets.data[n], length)!=0) {
+      bad++;
+      return;
+    }
+    // after a stop the packet that was cut off goes again, or the last one if none was
+    if (restarted ? (long)n<last || (long)n>last+1 : (long)n!=last+1) lost++;
+    else good++;
+    last=n;
+    restarted=false;
+  }
+};
+
+// The RMT reads each item as it starts to send it, raises the threshold
+// event as it finishes each quarter and the end event at a zero item, where
+// it stops. The interrupt runs LATENCY_US after the first event it has not
+// seen, or as the window it is held off in ends. Events meanwhile add to it.
+const uint32_t RUN_US = 2000000;
+const uint32_t LATENCY_US = 20;
+const uint32_t WINDOW_EVERY_US = 51000;   // not a multiple of any quarter's time
+const uint32_t LEAD_US = 2*RMT_QUARTER_ITEMS*2*RMT_ONE_HALF_US;
+
+struct RingRun {
+  unsigned int stops;
+  unsigned int heldEvents;   // threshold events raised while one was pending
+  uint32_t stoppedUs;
+  unsigned int packets;
+};
+
+static uint32_t interruptAt(uint32_t raised, uint32_t heldUs) {
+  uint32_t at=raised+LATENCY_US;
+  uint32_t windowStart=raised/WINDOW_EVERY_US*WINDOW_EVERY_US + WINDOW_EVERY_US/2;
+  if (heldUs && raised>=windowStart && raised<windowStart+heldUs) at=windowStart+heldUs;
+  return at;
+}
+
+static RingRun runRing(uint32_t heldUs) {
+  RingRun run;
+  memset(&run, 0, sizeof(run));
+  memset(&packets, 0, sizeof(packets));
+  Receiver receiver;
+  memset(&receiver, 0, sizeof(receiver));
+  receiver.bit=-1;
+  receiver.last=-1;
+  srand(2);
+
+  uint32_t memory[RMT_RING_ITEMS];
+  DCCRMTRing ring;
+  ring.begin(memory, nextPacket, &packets);
+  ring.start();
+  uint32_t now=0;
+  uint8_t reading=0;
+  bool running=true;
+  bool sentEvent=false, endEvent=false, pending=false;
+  uint32_t pendingAt=0;
+  while (now<RUN_US) {
+    if (pending && pendingAt<=now) {
+      if (endEvent) {
+        ring.start();
+        reading=0;
+        running=true;
+        receiver.restarted=true;
+      }
+      else ring.sent(reading/RMT_QUARTER_ITEMS);
+      sentEvent=endEvent=pending=false;
+    }
+    if (!running) {
+      run.stoppedUs+=pendingAt-now;
+      now=pendingAt;
+      continue;
+    }
+    uint32_t item=memory[reading];
+    if (item==0) {
+      running=false;
+      run.stops++;
+      endEvent=true;
+    }
+    else {
+      receiver.addBit(high(item)<=ONE_MAX_US);
+      now+=high(item)+low(item);
+      reading=(reading+1) % RMT_RING_ITEMS;
+      if (reading % RMT_QUARTER_ITEMS) continue;
+      if (sentEvent) run.heldEvents++;
+      sentEvent=true;
+    }
+    if (!pending) {
+      pending=true;
+      pendingAt=interruptAt(now, heldUs);
+    }
+  }
+  run.packets=receiver.good;
+  printf("interrupt held off %5luuS every %luuS: %4u packets, %u lost, %u bad, %2u stops for %6luuS, %3u events held\n",
+         (unsigned long)heldUs, (unsigned long)WINDOW_EVERY_US, receiver.good, receiver.lost, receiver.bad,
+         run.stops, (unsigned long)run.stoppedUs, run.heldEvents);
+  check(receiver.good>RUN_US/(2*116*(PREAMBLE_BITS+9*MAX_BYTES+1)), "packets are received");
+  check(receiver.lost==0, "no packet is lost or sent out of turn");
+  check(receiver.bad<=run.stops, "only a packet cut off by a stop is bad");
+  return run;
+}
+
+static void ring() {
+  printf("the interrupt may be up to %luuS late without a gap\n", (unsigned long)LEAD_US);
+  RingRun run=runRing(0);
+  check(run.stops==0 && run.heldEvents==0, "interrupts on time: no gap between packets");
+  run=runRing(LEAD_US/2);
+  check(run.stops==0, "held off a quarter: no gap");
+  run=runRing(LEAD_US-2*LATENCY_US);
+  check(run.stops==0 && run.heldEvents>0, "held off nearly two quarters: events held, no gap");
+  run=runRing(30000);
+  check(run.stops>0, "held off 30mS: the RMT stops at the end marker");
+}
+
+int main() {
+  idleGolden();
+  limits();
+  ring();
+  return failures ? 1 : 0;
+}
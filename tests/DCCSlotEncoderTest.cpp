@@ -0,0 +1,96 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Feeds images of every length up to a full packet through DCCSlotEncoder,
+// as the shift interrupt does, and decodes the slot stream as a decoder
+// would: every level must last 1 or 2 slots (58 or 116uS), both halves of a
+// bit must be equal, and the bits must be those of the images, with no gap
+// where one image runs on into the next.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "DCCSlotEncoder.h"
+
+static int failures=0;
+
+static void check(bool ok, const char * what) {
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+int main() {
+  DCCSlotEncoder encoder;
+  std::vector<bool> sent;       // bits of the images, in order
+  std::vector<bool> slots;      // the shifted slots, MSB of each byte first
+  uint8_t images[64][6];
+  unsigned int bytes=0;
+  srand(1);
+
+  // Each image is used for as long as fill() wants it, then the next is set,
+  // so bit counts from 1 to 48 test every split of a bit over a byte boundary.
+  for (unsigned int i=0; i<sizeof(images)/sizeof(images[0]); i++) {
+    uint8_t bitCount=1 + i % 48;
+    for (uint8_t b=0; b<sizeof(images[i]); b++) images[i][b]=rand();
+    for (uint8_t b=0; b<bitCount; b++) sent.push_back(images[i][b>>3] & (0x80>>(b&7)));
+    encoder.setImage(images[i], bitCount);
+    while (encoder.fill()) {
+      for (int s=7; s>=0; s--) slots.push_back(encoder.slotByte & (1<<s));
+      bytes++;
+    }
+  }
+  // Pad with '1' bits to flush the last byte, as the preamble of the next packet would
+  static const uint8_t ones[]={0xFF, 0xFF};
+  encoder.setImage(ones, 16);
+  check(encoder.fill(), "a byte is completed by the next image");
+  for (int s=7; s>=0; s--) slots.push_back(encoder.slotByte & (1<<s));
+
+  // Decode the runs of equal slots into halves, and pairs of halves into bits
+  std::vector<unsigned int> halves;
+  size_t start=0;
+  for (size_t s=1; s<=slots.size(); s++) {
+    if (s<slots.size() && slots[s]==slots[start]) continue;
+    halves.push_back((s-start)*DCC_SLOT_US);
+    start=s;
+  }
+  halves.pop_back();   // the last run may go on in the next byte
+  check(slots[0], "bits start high");
+
+  unsigned int badHalves=0, badBits=0;
+  std::vector<bool> received;
+  for (size_t h=0; h+1<halves.size(); h+=2) {
+    unsigned int first=halves[h], second=halves[h+1];
+    if (first!=DCC_SLOT_US && first!=2*DCC_SLOT_US) badHalves++;
+    if (first!=second) badBits++;
+    received.push_back(first==DCC_SLOT_US);
+  }
+  printf("%u images %u bits in %u bytes, %u halves bad=%u, %u bits unequal=%u\n",
+         (unsigned int)(sizeof(images)/sizeof(images[0])), (unsigned int)sent.size(), bytes,
+         (unsigned int)halves.size(), badHalves, (unsigned int)received.size(), badBits);
+  check(badHalves==0, "every half bit is 58 or 116uS");
+  check(badBits==0, "both halves of a bit are equal");
+  check(received.size()>=sent.size(), "every bit is sent");
+  bool same=true;
+  for (size_t b=0; b<sent.size() && b<received.size(); b++) same=same && sent[b]==received[b];
+  check(same, "the bits are those of the images, without gaps");
+  for (size_t b=sent.size(); b<received.size(); b++)
+    if (!received[b]) { check(false, "only the padding follows"); break; }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// How long after a function key is pressed the decoder starts to receive the
+// function packet, with the loco table at several occupancy levels. Every loco
+// is moving with F0 on, so each reminder cycle sends its speed and F0-F4.
+//
+// "after" is the function packet DCC now queues as soon as the key is pressed.
+// "before" is what the key used to wait for: the reminder cycle reaching the
+// loco, measured as the first F0-F4 packet after the immediate one and its 3
+// repeats. Latency runs from the key press to the first preamble bit.
+
+#include <Arduino.h>
+#include "DCC.h"
+#include "StringFormatter.h"
+#include "HostTimer.h"
+#include "Decoder.h"
+
+const byte MAIN_PIN = 12;
+const byte PRESSES = 20;
+const byte IMMEDIATE_PACKETS = 4;            // the packet and its 3 repeats
+const unsigned long AFTER_LIMIT_US = 35000;  // two of the longest packets
+
+static int failures=0;
+
+static void check(bool ok, const char * what) {
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+static Decoder decoder("MAIN", MAIN_PIN);
+static unsigned long seed=12345;
+
+static unsigned long randomTicks(unsigned long range) {
+  seed=seed*1103515245UL+12345UL;
+  return (seed>>16) % range;
+}
+
+static void runTicks(unsigned long ticks) {
+  for (unsigned long t=0; t<ticks; t++) {
+    hostTimerInterrupt();
+    decoder.poll();
+    DCC::loop();
+  }
+}
+
+struct Result {
+  unsigned long worstAfter, totalAfter;
+  unsigned long worstBefore, totalBefore;
+};
+
+static Result measure(int locos) {
+  DCC::forgetAllLocos();
+  for (int cab=1; cab<=locos; cab++) {
+    DCC::setThrottle(cab, 20+cab, true);
+    DCC::setFn(cab, 0, true);
+  }
+  runTicks(20000);   // past the changes, into steady reminders
+
+  Result result={0,0,0,0};
+  bool on=true;
+  for (byte p=0; p<PRESSES; p++) {
+    runTicks(randomTicks(2000));
+    int cab=1+randomTicks(locos);
+    on=!on;
+    const byte group[]={(byte)cab, (byte)(0x90 | (on ? 0x01 : 0))};   // F0 on, F1 as pressed
+    unsigned long pressed=hostMicros;
+    DCC::setFn(cab, 1, on);
+    byte seen=0;
+    while (seen<=IMMEDIATE_PACKETS) {
+      hostTimerInterrupt();
+      if (decoder.poll() && decoder.is(group, sizeof(group))) {
+        unsigned long latency=decoder.packetStart>pressed ? decoder.packetStart-pressed : 0;
+        if (seen==0) {
+          result.totalAfter+=latency;
+          if (latency>result.worstAfter) result.worstAfter=latency;
+        }
+        else if (seen==IMMEDIATE_PACKETS) {
+          result.totalBefore+=latency;
+          if (latency>result.worstBefore) result.worstBefore=latency;
+        }
+        seen++;
+      }
+      DCC::loop();
+    }
+  }
+  return result;
+}
+
+int main() {
+  StringFormatter::diagSerial=NULL;
+  MotorDriver mainDriver(3, MAIN_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  MotorDriver progDriver(11, 13, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  DCCWaveform::begin(&mainDriver, &progDriver);
+
+  const int levels[]={1, 10, 25, MAX_LOCOS};
+  printf("%d presses per level, latency to the first preamble bit\n", PRESSES);
+  for (byte l=0; l<sizeof(levels)/sizeof(levels[0]); l++) {
+    Result r=measure(levels[l]);
+    printf("%3d locos  before mean=%6luuS worst=%6luuS  after mean=%5luuS worst=%5luuS\n", levels[l],
+           r.totalBefore/PRESSES, r.worstBefore, r.totalAfter/PRESSES, r.worstAfter);
+    check(r.worstAfter<=AFTER_LIMIT_US, "a function packet starts within two packets of the key");
+    if (levels[l]>1) check(r.totalAfter<r.totalBefore, "sooner than the reminder cycle");
+  }
+  check(decoder.badHalves==0 && decoder.badPackets==0, "the signal stays well formed");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Sets F0-F68 at random on several locos and checks what getFn() reports and
+// what the reminders send on the decoded main track against a reference.
+// Built for a Mega, and for an Uno, which keeps F32-F68 for only FN_POOL_SIZE
+// locos: the others send a higher function when it is set but do not
+// remember it, until a loco with a pool entry is forgotten.
+
+#include <Arduino.h>
+#include "DCC.h"
+#include "StringFormatter.h"
+#include "HostTimer.h"
+#include "Decoder.h"
+
+const byte MAIN_PIN = 12;
+const int LOCOS = 6;
+const int FIRST_CAB = 3;
+
+static int failures=0;
+
+static void check(bool ok, const char * what) {
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+static Decoder decoder("MAIN", MAIN_PIN);
+static bool reference[LOCOS][MAX_LOCO_FUNCTION+1];
+static unsigned long seed=777;
+
+static bool randomBit() {
+  seed=seed*1103515245UL+12345UL;
+  return (seed>>16) & 1;
+}
+
+// Whether a loco's function is remembered on this board
+static bool remembered(int loco, int fn) {
+#ifdef ARDUINO_AVR_UNO
+  return fn<FN_SLOT_BYTES*8 || loco<FN_POOL_SIZE;
+#else
+  (void)loco; (void)fn;
+  return true;
+#endif
+}
+
+static bool expected(int loco, int fn) {
+  return remembered(loco, fn) && reference[loco][fn];
+}
+
+// Runs the signal until the function packet for this group of the loco goes
+static bool sent(int cab, byte instruction, byte value, unsigned long limitUs) {
+  const byte packet[]={(byte)cab, instruction, value};
+  unsigned long end=hostMicros+limitUs;
+  while (hostMicros<end) {
+    hostTimerInterrupt();
+    if (decoder.poll() && decoder.is(packet, sizeof(packet))) return true;
+    DCC::loop();
+  }
+  return false;
+}
+
+static byte expectedBits(int loco, int first) {
+  byte bits=0;
+  for (int b=0; b<8 && first+b<=MAX_LOCO_FUNCTION; b++) if (expected(loco, first+b)) bits|=1<<b;
+  return bits;
+}
+
+int main() {
+  StringFormatter::diagSerial=NULL;
+  MotorDriver mainDriver(3, MAIN_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  MotorDriver progDriver(11, 13, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  DCCWaveform::begin(&mainDriver, &progDriver);
+
+  for (int loco=0; loco<LOCOS; loco++) {
+    DCC::setThrottle(FIRST_CAB+loco, 0, true);
+    for (int fn=0; fn<=MAX_LOCO_FUNCTION; fn++) {
+      reference[loco][fn]= fn==MAX_LOCO_FUNCTION || randomBit();   // every loco has a higher function on
+      DCC::setFn(FIRST_CAB+loco, fn, reference[loco][fn]);
+      for (int t=0; t<400; t++) {   // let the queue empty
+        hostTimerInterrupt();
+        decoder.poll();
+        DCC::loop();
+      }
+    }
+  }
+
+  unsigned int bad=0;
+  for (int loco=0; loco<LOCOS; loco++)
+    for (int fn=0; fn<=MAX_LOCO_FUNCTION; fn++)
+      if (DCC::getFn(FIRST_CAB+loco, fn)!=(expected(loco, fn) ? 1 : 0)) bad++;
+  printf("%d locos, F0-F%d, %u getFn() wrong\n", LOCOS, MAX_LOCO_FUNCTION, bad);
+  check(bad==0, "getFn reports the remembered states");
+
+  // every loco's F61-F68 group is reminded with what it remembers
+  unsigned int missing=0;
+  for (int loco=0; loco<LOCOS; loco++)
+    if (!sent(FIRST_CAB+loco, 0xDC, expectedBits(loco, 61), 5000000UL)) missing++;
+  printf("%u F61-F68 reminders not as remembered\n", missing);
+  check(missing==0, "reminders carry the remembered states");
+
+  // the last loco sends a higher function it may not remember
+  int last=LOCOS-1;
+  reference[last][33]=!reference[last][33];
+  DCC::setFn(FIRST_CAB+last, 33, reference[last][33]);
+  byte bits=expectedBits(last, 29);
+  if (reference[last][33]) bits|=1<<4;
+  check(sent(FIRST_CAB+last, 0xD8, bits, 100000UL), "a higher function is sent when it is set");
+
+#ifdef ARDUINO_AVR_UNO
+  // forgetting a loco with a pool entry makes room
+  DCC::forgetLoco(FIRST_CAB);
+  DCC::setFn(FIRST_CAB+last, 40, true);
+  check(DCC::getFn(FIRST_CAB+last, 40)==1, "a forgotten loco's pool entry is reused");
+  check(DCC::getFn(FIRST_CAB+last, 33)==0, "an entry is taken with its functions off");
+#endif
+  check(decoder.badHalves==0 && decoder.badPackets==0, "the signal stays well formed");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Built with MAX_LOCOS=500. Churns the loco table through the public DCC API,
+// creating and forgetting locos at random, and checks every lookup against a
+// reference map. Part of the address pool hashes to the last entries of the
+// index so that probe sequences wrap round to its start.
+//
+// Then times lookups with the table full: "before" is the scan of the whole
+// table that the index replaced, modelled on a copy of the old table entry,
+// "after" is getThrottleSpeed() going through the index.
+
+#include <map>       // before Arduino.h and its min and max macros
+#include <Arduino.h>
+#include "DCC.h"
+#include "StringFormatter.h"
+#include "HostTimer.h"
+#include "HostCycles.h"
+
+const int POOL = 900;              // addresses in play, more than the table holds
+const int WRAP_HOMES = 8;          // the last index entries, which the wrapping addresses hash to
+const unsigned long OPS = 300000;
+const unsigned long CHECK_EVERY = 5000;
+const int LOOKUPS = 20000;
+
+static int failures=0;
+
+static void check(bool ok, const char * what) {
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+static unsigned long seed=4321;
+static unsigned long randomNumber(unsigned long range) {
+  seed=seed*1103515245UL+12345UL;
+  return ((seed>>16) & 0x7FFF) % range;
+}
+
+static int home(int id) {
+  return (id ^ (id>>7)) & (LOCO_INDEX_SIZE-1);
+}
+
+static bool wraps(int id) {
+  return home(id)>=LOCO_INDEX_SIZE-WRAP_HOMES;
+}
+
+static int pool[POOL];
+static std::map<int, byte> reference;   // address to speed
+
+static bool lookupOk(int id) {
+  std::map<int, byte>::iterator it=reference.find(id);
+  if (it==reference.end()) return DCC::getFn(id, 0)==-1 && DCC::getThrottleSpeed(id)==0;
+  return DCC::getFn(id, 0)==0 && DCC::getThrottleSpeed(id)==it->second;
+}
+
+static void churn() {
+  // a third of the pool wraps round the end of the index, the rest is anywhere
+  int n=0;
+  for (int id=1; id<=10239 && n<POOL/3; id++) if (wraps(id)) pool[n++]=id;
+  while (n<POOL) {
+    int id=1+randomNumber(10239);
+    bool used=false;
+    for (int i=0; i<n && !used; i++) used= pool[i]==id;
+    if (!used) pool[n++]=id;
+  }
+
+  unsigned long bad=0, full=0;
+  int wrapping=0, mostWrapping=0;
+  for (unsigned long op=1; op<=OPS; op++) {
+    int id=pool[randomNumber(POOL)];
+    unsigned long what=randomNumber(100);
+    if (what<50) {
+      byte speed=2+randomNumber(125);
+      bool known=reference.count(id);
+      DCC::setThrottle(id, speed, true);
+      if (known || reference.size()<MAX_LOCOS) {
+        if (!known && wraps(id)) wrapping++;
+        reference[id]=speed;
+      }
+      else full++;
+    }
+    else if (what<80) {
+      if (reference.erase(id) && wraps(id)) wrapping--;
+      DCC::forgetLoco(id);
+    }
+    else if (!lookupOk(id)) bad++;
+    if (wrapping>mostWrapping) mostWrapping=wrapping;
+    if (op%CHECK_EVERY==0) for (int i=0; i<POOL; i++) if (!lookupOk(pool[i])) bad++;
+  }
+  printf("%lu operations, %lu refused with the table full, at most %d locos in the last %d index entries\n",
+         OPS, full, mostWrapping, WRAP_HOMES);
+  check(bad==0, "every lookup agrees with the reference map");
+  check(full>0, "the table was filled");
+  check(mostWrapping>WRAP_HOMES, "probe sequences wrapped round the index");
+}
+
+// The table entry and lookup before the index
+struct OLD_LOCO {
+  int loco;
+  byte speedCode;
+  byte groupFlags;
+  byte locoFlags;
+  unsigned long functions;
+  uint16_t lastRefresh;
+  uint16_t lastChange;
+};
+static OLD_LOCO oldTable[MAX_LOCOS];
+
+static int __attribute__((noinline)) oldLookup(int locoId) {
+  int firstEmpty=MAX_LOCOS;
+  int reg;
+  for (reg=0; reg<MAX_LOCOS; reg++) {
+    if (oldTable[reg].loco==locoId) break;
+    if (oldTable[reg].loco==0 && firstEmpty==MAX_LOCOS) firstEmpty=reg;
+  }
+  return reg<MAX_LOCOS ? reg : -1;
+}
+
+// Uses the addresses that are anywhere, not those bunched at the end of the index
+static void benchmark() {
+  const int * spread=pool+POOL/3;
+  const int spreadCount=POOL-POOL/3;
+  DCC::forgetAllLocos();
+  reference.clear();
+  for (int reg=0; reg<MAX_LOCOS; reg++) {
+    int id=spread[reg];
+    DCC::setThrottle(id, 2+reg%120, true);
+    oldTable[reg].loco=id;
+  }
+  static int hits[LOOKUPS], misses[LOOKUPS];
+  for (int i=0; i<LOOKUPS; i++) {
+    hits[i]=spread[randomNumber(MAX_LOCOS)];
+    misses[i]=spread[MAX_LOCOS+randomNumber(spreadCount-MAX_LOCOS)];
+  }
+  const int * sets[]={hits, misses};
+  const char * const names[]={"found", "absent"};
+  for (byte s=0; s<2; s++) {
+    uint64_t before=~0ULL, after=~0ULL;
+    volatile long sink=0;
+    for (byte pass=0; pass<5; pass++) {   // the least of several passes, to lose the noise
+      uint64_t start=hostCycles();
+      for (int i=0; i<LOOKUPS; i++) sink+=oldLookup(sets[s][i]);
+      uint64_t t=hostCycles()-start;
+      if (t<before) before=t;
+      start=hostCycles();
+      for (int i=0; i<LOOKUPS; i++) sink+=DCC::getThrottleSpeed(sets[s][i]);
+      t=hostCycles()-start;
+      if (t<after) after=t;
+    }
+    printf("%d locos, %-6s before=%5.0f after=%3.0f host cycles per lookup\n", MAX_LOCOS, names[s],
+           (double)before/LOOKUPS, (double)after/LOOKUPS);
+    check(after<before, "the index is quicker than the scan");
+  }
+}
+
+int main() {
+  StringFormatter::diagSerial=NULL;
+  MotorDriver mainDriver(3, 12, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  MotorDriver progDriver(11, 13, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  DCCWaveform::begin(&mainDriver, &progDriver);
+  DCC::setEvictAge(0);   // a full table refuses new locos
+
+  printf("MAX_LOCOS=%d, index of %d entries\n", MAX_LOCOS, LOCO_INDEX_SIZE);
+  churn();
+  benchmark();
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// How long loop() is held up by a burst of commands from several clients.
+// Each pass of loop() every client sends a speed, a function, an accessory
+// and a POM write, which schedule the packets they would from DCC. The
+// waveform interrupt then runs for LOOP_TICKS before the next pass.
+//
+// "before" is the single pending packet that schedulePacket used to spin on,
+// modelled by running the interrupt until nothing is waiting before each
+// packet. "after" is the queue, which never waits but may refuse a packet.
+// Times are signal time spent waiting, which is what the hardware would spend.
+
+#include <Arduino.h>
+#include "DCCWaveform.h"
+#include "StringFormatter.h"
+#include "HostTimer.h"
+
+const byte CLIENTS = 4;
+const byte PASSES = 20;
+const byte LOOP_TICKS = 17;   // ~1mS of other loop() work between bursts
+
+struct Result {
+  unsigned long worstTicks;   // longest wait in one pass of loop()
+  unsigned long totalTicks;
+  unsigned int scheduled;
+  unsigned int refused;
+};
+
+static bool spinFirst;   // before: wait for the pending packet to go
+
+static void schedule(Result & result, const byte packet[], byte length, byte repeats,
+                     PACKET_PRIORITY priority, unsigned long key, unsigned long & ticks) {
+  unsigned long start=hostTimerTicks;
+  if (spinFirst) while (DCCWaveform::mainTrack.isPacketPending()) hostTimerInterrupt();
+  result.scheduled++;
+  if (!DCCWaveform::mainTrack.schedulePacket(packet, length, repeats, priority, key)) result.refused++;
+  ticks+=hostTimerTicks-start;
+}
+
+static Result run(bool before) {
+  spinFirst=before;
+  while (DCCWaveform::mainTrack.isPacketPending()) hostTimerInterrupt();
+  Result result={0,0,0,0};
+  for (byte pass=0; pass<PASSES; pass++) {
+    unsigned long ticks=0;
+    for (byte c=0; c<CLIENTS; c++) {
+      byte cab=3+c;
+      byte speed[]={cab, 0x3F, (byte)(0x80 | (pass+c))};
+      schedule(result, speed, sizeof(speed), 0, PACKET_PRIORITY::SPEED, supersedeKey(0x0001, cab), ticks);
+      byte function[]={cab, (byte)(0x80 | (pass & 0x1F))};
+      schedule(result, function, sizeof(function), 3, PACKET_PRIORITY::FUNCTION, supersedeKey(0x80, cab), ticks);
+      byte accessory[]={(byte)(0x80 | (c+1)), (byte)(0xF8 | (pass & 1))};
+      schedule(result, accessory, sizeof(accessory), 4, PACKET_PRIORITY::ACCESSORY, 0, ticks);
+      byte pom[]={cab, 0xEC, (byte)(pass+c), (byte)pass};
+      schedule(result, pom, sizeof(pom), 4, PACKET_PRIORITY::ACCESSORY, supersedeKey(0x8000 | (pass+c), cab), ticks);
+    }
+    if (ticks>result.worstTicks) result.worstTicks=ticks;
+    result.totalTicks+=ticks;
+    for (byte t=0; t<LOOP_TICKS; t++) hostTimerInterrupt();
+  }
+  return result;
+}
+
+static void report(const char * name, const Result & result) {
+  printf("%-6s worst loop() wait=%luuS mean=%luuS packets=%u refused=%u\n", name,
+         result.worstTicks*DCC_TICK_US, result.totalTicks*DCC_TICK_US/PASSES,
+         result.scheduled, result.refused);
+}
+
+int main() {
+  StringFormatter::diagSerial=NULL;
+  MotorDriver mainDriver(3, 12, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  MotorDriver progDriver(11, 13, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  DCCWaveform::begin(&mainDriver, &progDriver);
+
+  printf("%d clients, %d commands each per loop(), %d passes\n", CLIENTS, 4, PASSES);
+  Result before=run(true);
+  report("before", before);
+  Result after=run(false);
+  report("after", after);
+  DCCWaveform::mainTrack.displayQueueStats(&Serial);
+  if (after.totalTicks!=0) {
+    printf("FAIL: schedulePacket waited for the interrupt\n");
+    return 1;
+  }
+  return 0;
+}
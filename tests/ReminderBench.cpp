@@ -0,0 +1,110 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Host cycles DCC::loop() spends issuing one speed reminder, with 50 moving
+// locos and no functions touched so that every reminder is a speed packet.
+//
+// "before" rebuilds and encodes the packet each time, as every reminder did
+// before the encoded packet was kept in the table: the cache is emptied
+// before each reminder by setting the speed steps again, outside the timing.
+// "after" sends the kept packet. The cost of loop() when the queue is busy
+// and no reminder goes out is taken off both. "saved" is the median of the
+// difference for the same loco in neighbouring rounds, which is steadier than
+// the difference of the medians.
+
+#include <algorithm>   // before Arduino.h and its min and max macros
+#include <Arduino.h>
+#include "DCC.h"
+#include "LocoFlags.h"
+#include "StringFormatter.h"
+#include "HostTimer.h"
+#include "HostCycles.h"
+
+const int LOCOS = 50;
+const int SAMPLES = 10001;
+
+static uint64_t samples[3][SAMPLES];
+static int64_t saved[SAMPLES];   // before less after for the same loco in neighbouring rounds
+
+static uint64_t median(uint64_t values[]) {
+  std::sort(values, values+SAMPLES);
+  return values[SAMPLES/2];
+}
+
+static void drain() {
+  while (DCCWaveform::mainTrack.isPacketPending()) hostTimerInterrupt();
+}
+
+static uint64_t timeLoop() {
+  uint64_t start=hostCycles();
+  DCC::loop();
+  return hostCycles()-start;
+}
+
+// Rounds of one reminder per loco, emptying the cache before every other round.
+// The loop() cost with a busy queue is taken in turn with the reminders, so that
+// all three see the same conditions on the host.
+enum { BUSY, BEFORE, AFTER };
+static void measure(byte steps) {
+  const byte packet[]={3, 0x3F, 0x80};
+  int taken[3]={0,0,0};
+  for (int round=0; taken[BEFORE]<SAMPLES || taken[AFTER]<SAMPLES; round++) {
+    byte which=(round & 1) ? BEFORE : AFTER;
+    if (which==BEFORE) DCC::setGlobalSpeedsteps(steps);
+    for (int loco=0; loco<LOCOS; loco++) {
+      drain();
+      uint64_t cycles=timeLoop();
+      if (round>0 && taken[which]<SAMPLES) samples[which][taken[which]++]=cycles;
+      drain();
+      DCCWaveform::mainTrack.schedulePacket(packet, sizeof(packet), 0, PACKET_PRIORITY::SPEED, 0);
+      cycles=timeLoop();
+      if (taken[BUSY]<SAMPLES) samples[BUSY][taken[BUSY]++]=cycles;
+    }
+  }
+}
+
+int main() {
+  StringFormatter::diagSerial=NULL;
+  MotorDriver mainDriver(3, 12, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  MotorDriver progDriver(11, 13, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  DCCWaveform::begin(&mainDriver, &progDriver);
+  for (int cab=1; cab<=LOCOS; cab++) DCC::setThrottle(cab<=LOCOS/2 ? cab : 1000+cab, 30, true);
+
+  int failures=0;
+  printf("%d moving locos, median host cycles per speed reminder\n", LOCOS);
+  const byte steps[]={128, 28, 128};
+  const char * const names[]={"128 steps", "28 steps", "RCN-212"};
+  for (byte s=0; s<3; s++) {
+    if (s==2) for (int cab=1; cab<=LOCOS; cab++) DCC::setLocoFlags(cab<=LOCOS/2 ? cab : 1000+cab, LOCO_FLAG_RCN212);
+    DCC::setGlobalSpeedsteps(steps[s]);
+    measure(steps[s]);
+    for (int i=0; i<SAMPLES; i++) saved[i]=(int64_t)(samples[BEFORE][i]-samples[AFTER][i]);
+    std::sort(saved, saved+SAMPLES);
+    uint64_t busy=median(samples[BUSY]);
+    uint64_t before=median(samples[BEFORE])-busy;
+    uint64_t after=median(samples[AFTER])-busy;
+    printf("%-9s  before=%4lu  after=%4lu  saved=%3ld  (loop() itself %lu)\n", names[s],
+           (unsigned long)before, (unsigned long)after, (long)saved[SAMPLES/2], (unsigned long)busy);
+    if (saved[SAMPLES/2]<0) {
+      printf("FAIL: sending the kept packet is slower than building it\n");
+      failures++;
+    }
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Fills the loco table with moving, recently changed and idle locos and checks
+// on the decoded main track signal that the reminders share the track 4:2:1
+// per loco by class, and that no loco waits longer than the maximum interval.
+//
+// With a short maximum interval the weights decide the shares. With the
+// default one an idle loco is held back to half the maximum interval, and the
+// moving and recent locos share what is left 2:1.
+
+#include <Arduino.h>
+#include "DCC.h"
+#include "StringFormatter.h"
+#include "HostTimer.h"
+#include "Decoder.h"
+
+const byte MAIN_PIN = 12;
+const int MOVING = 10;
+const int RECENT = 10;                        // stopped, changed in the last 10 seconds
+const int IDLE = MAX_LOCOS-MOVING-RECENT;
+const unsigned long SETTLE_US = 12000000UL;   // long enough for the first changes to stop being recent
+const unsigned long WINDOW_US = 8000000UL;    // short enough for the recent ones to stay so
+const unsigned long PACKET_US = 16000;        // the longest packet, which may delay a reminder
+
+static int failures=0;
+
+static void check(bool ok, const char * what) {
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+class Discard : public Print {
+  public:
+    size_t write(uint8_t c) { (void)c; return 1; }
+};
+
+static Decoder decoder("MAIN", MAIN_PIN);
+static const char * const classNames[]={"moving", "recent", "idle"};
+
+static byte classOf(int cab) {
+  return cab<=MOVING ? 0 : cab<=MOVING+RECENT ? 1 : 2;
+}
+
+struct Result {
+  unsigned long packets[3];
+  unsigned long worstUs[3];
+  double perLoco[3];   // reminders per loco per second
+};
+
+static Result run(unsigned int maxIntervalMs) {
+  Discard discard;
+  DCC::forgetAllLocos();
+  DCC::setReminderMaxInterval(maxIntervalMs);
+  for (int cab=1; cab<=MAX_LOCOS; cab++) DCC::setThrottle(cab, classOf(cab)==0 ? 30 : 0, true);
+  unsigned long end=hostMicros+SETTLE_US;
+  while (hostMicros<end) {
+    hostTimerInterrupt();
+    decoder.poll();
+    DCC::loop();
+  }
+
+  for (int cab=MOVING+1; cab<=MOVING+RECENT; cab++) DCC::setThrottle(cab, 0, false);
+  DCC::displayReminderStats(&discard);
+  Result result;
+  memset(&result, 0, sizeof(result));
+  unsigned long lastSeen[MAX_LOCOS+1];
+  unsigned long start=hostMicros;
+  for (int cab=1; cab<=MAX_LOCOS; cab++) lastSeen[cab]=start;
+  end=start+WINDOW_US;
+  while (hostMicros<end) {
+    hostTimerInterrupt();
+    if (decoder.poll() && decoder.length==4 && decoder.packet[1]==0x3F) {
+      int cab=decoder.packet[0];
+      if (cab>=1 && cab<=MAX_LOCOS) {
+        byte c=classOf(cab);
+        result.packets[c]++;
+        unsigned long interval=decoder.packetEnd-lastSeen[cab];
+        if (interval>result.worstUs[c]) result.worstUs[c]=interval;
+        lastSeen[cab]=decoder.packetEnd;
+      }
+    }
+    DCC::loop();
+  }
+  for (int cab=1; cab<=MAX_LOCOS; cab++) {   // a loco still waiting at the end
+    byte c=classOf(cab);
+    if (end-lastSeen[cab]>result.worstUs[c]) result.worstUs[c]=end-lastSeen[cab];
+  }
+  const int counts[]={MOVING, RECENT, IDLE};
+  unsigned long total=result.packets[0]+result.packets[1]+result.packets[2];
+  printf("max interval %umS, %lu reminders in %luS\n", maxIntervalMs, total, WINDOW_US/1000000);
+  for (byte c=0; c<3; c++) {
+    result.perLoco[c]=result.packets[c]*1000000.0/WINDOW_US/counts[c];
+    printf("  %-6s %2d locos  share=%4.1f%%  per loco=%5.2f/S  worst interval=%4lumS\n", classNames[c],
+           counts[c], 100.0*result.packets[c]/total, result.perLoco[c], result.worstUs[c]/1000);
+    check(result.worstUs[c]<=maxIntervalMs*1000UL+PACKET_US, "every loco is reminded within the maximum interval");
+  }
+  return result;
+}
+
+static bool near(double value, double expected) {
+  return value>expected*0.9 && value<expected*1.1;
+}
+
+int main() {
+  StringFormatter::diagSerial=NULL;
+  MotorDriver mainDriver(3, MAIN_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  MotorDriver progDriver(11, 13, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  DCCWaveform::begin(&mainDriver, &progDriver);
+
+  Result weighted=run(1200);
+  const double expectedShare[]={4.0*MOVING, 2.0*RECENT, 1.0*IDLE};
+  const double weights=expectedShare[0]+expectedShare[1]+expectedShare[2];
+  unsigned long total=weighted.packets[0]+weighted.packets[1]+weighted.packets[2];
+  for (byte c=0; c<3; c++) 
+    check(near((double)weighted.packets[c]/total, expectedShare[c]/weights), "each class has its 4:2:1 weighted share");
+  check(near(weighted.perLoco[0]/weighted.perLoco[1], 2), "moving locos are reminded twice as often as recent ones");
+  check(near(weighted.perLoco[0]/weighted.perLoco[2], 4), "and four times as often as idle ones");
+
+  Result held=run(4000);
+  check(near(held.perLoco[0]/held.perLoco[1], 2), "moving locos are reminded twice as often as recent ones");
+  check(held.perLoco[2]<=1000.0/2000, "idle locos wait half the maximum interval");
+  check(held.worstUs[2]>=2000000UL, "idle locos wait half the maximum interval");
+  check(decoder.badHalves==0 && decoder.badPackets==0, "the signal stays well formed");
+  return failures ? 1 : 0;
+}
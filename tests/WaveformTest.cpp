@@ -0,0 +1,471 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Decodes the signal pins driven by the variable period waveform interrupt
+// and checks every half bit is 58 or 116uS and the packets are the ones queued.
+// Then counts the interrupts for each main track packet, with the fixed and
+// the variable period, and the share of the CPU they take, and times each
+// fixed period interrupt against the interrupt as it was before the packet 
+// queue (BaselineWaveform), and that interrupt with and without its free 
+// memory check. Cycles are the host's, so they only compare with each other.
+
+#include <Arduino.h>
+#include "DCCWaveform.h"
+#include "StringFormatter.h"
+#include "HostTimer.h"
+#include "HostCycles.h"
+#include "Decoder.h"
+#include "BaselineWaveform.h"
+#include "MotorDrivers.h"
+
+const byte MAIN_PIN = 12;
+const byte PROG_PIN = 13;
+const unsigned int INTERRUPTS = 4000;
+
+static int failures=0;
+
+static void check(bool ok, const char * what) {
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+// Host timing is noisy, so a measurement whose timing checks fail is made 
+// again, up to TIMING_TRIES times, before they count as failures.
+const byte TIMING_TRIES = 3;
+static byte timingTry;
+static bool timingOk;
+
+static void checkTiming(bool ok, const char * what) {
+  if (ok) return;
+  if (timingTry==TIMING_TRIES) check(ok, what);
+  else {
+    printf("noisy: %s, measuring again\n", what);
+    timingOk=false;
+  }
+}
+
+static void timed(void (*measure)()) {
+  for (timingTry=1; timingTry<=TIMING_TRIES; timingTry++) {
+    timingOk=true;
+    measure();
+    if (timingOk) return;
+  }
+}
+
+static int decodeSignals() {
+  hostVaryPeriod=true;
+  MotorDriver mainDriver(3, MAIN_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  MotorDriver progDriver(11, PROG_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  DCCWaveform::begin(&mainDriver, &progDriver);
+
+  const byte speed[]={3, 0x3F, 0x85};
+  const byte idle[]={0xFF, 0x00};
+  const byte reset[]={0x00, 0x00};
+  check(DCCWaveform::mainTrack.schedulePacket(speed, sizeof(speed), 2, PACKET_PRIORITY::SPEED, 0), "schedule");
+
+  Decoder decoders[2]={{"MAIN", MAIN_PIN}, {"PROG", PROG_PIN}};
+  unsigned int speedPackets=0, idlePackets=0, resetPackets=0, others=0;
+  unsigned long interrupts=0;
+  for (unsigned int i=0; i<INTERRUPTS; i++) {
+    hostTimerInterrupt();
+    interrupts++;
+    for (byte d=0; d<2; d++) {
+      Decoder & decoder=decoders[d];
+      if (!decoder.poll()) continue;
+      if (d==0 && decoder.is(speed, sizeof(speed))) speedPackets++;
+      else if (d==0 && decoder.is(idle, sizeof(idle))) idlePackets++;
+      else if (d==1 && decoder.is(reset, sizeof(reset))) resetPackets++;
+      else others++;
+    }
+  }
+
+  for (byte d=0; d<2; d++) {
+    printf("%s halves=%u bad=%u packets=%u bad=%u\n", decoders[d].name, decoders[d].halves,
+           decoders[d].badHalves, decoders[d].packets, decoders[d].badPackets);
+    check(decoders[d].badHalves==0, "half bits are 58 or 116uS, both halves equal");
+    check(decoders[d].badPackets==0, "packets are well formed");
+  }
+  printf("speed=%u idle=%u reset=%u other=%u in %lu interrupts for %lu ticks\n",
+         speedPackets, idlePackets, resetPackets, others, interrupts, hostTimerTicks);
+  check(speedPackets==3, "the speed packet is sent with its 2 repeats");
+  check(idlePackets>0 && resetPackets>0, "idle and reset packets follow");
+  check(others==0, "no other packets");
+  check(interrupts<hostTimerTicks, "interrupts only on edges");
+  return failures;
+}
+
+// Interrupts for RATE_PACKETS main track packets, sent over and over while the
+// prog track sends its resets. They are timed all together, as the least of
+// REPLAYS identical runs, less the same runs with an empty interrupt. Fixed
+// and variable take turns ROUNDS times, keeping the least for each, so that
+// changes in the host's clock fall on both.
+const byte RATE_PACKETS = 50;
+const unsigned int REPLAYS = 9;
+const byte ROUNDS = 5;
+const byte ONES[]={0xFF, 0xFF, 0xFF};    // and checksum 0xFF: 49 one bits and 4 zeros
+const byte ZEROS[]={0x00, 0x00, 0x00};   // and checksum 0x00: 17 one bits and 36 zeros
+
+struct PacketRate {
+  unsigned long interrupts;
+  unsigned long ticks;
+  uint64_t cycles;
+  unsigned int others;    // main track packets that were not the one sent
+};
+
+static bool rateVary;
+static const byte * ratePacket;
+static PacketRate * rateResult;
+static Decoder * rateDecoder;
+
+// Runs interrupts until RATE_PACKETS more main track packets have ended
+static unsigned long countPackets(uint64_t cycles[], unsigned long count) {
+  unsigned int end=rateDecoder->packets+RATE_PACKETS;
+  unsigned long ticks=hostTimerTicks;
+  rateResult->interrupts=0;
+  rateResult->others=0;
+  while (rateDecoder->packets<end) {
+    hostTimerInterrupt();
+    rateResult->interrupts++;
+    if (rateDecoder->poll() && !rateDecoder->is(ratePacket, sizeof(ONES))) rateResult->others++;
+  }
+  rateResult->ticks=hostTimerTicks-ticks;
+  return 0;
+}
+
+// Times the interrupts countPackets counted
+static unsigned long timeInterrupts(uint64_t cycles[], unsigned long count) {
+  hostTimeInterrupts=false;
+  unsigned long interrupts=rateResult->interrupts;
+  uint64_t start=hostCycles();
+  for (unsigned long i=0; i<interrupts; i++) hostTimerInterrupt();
+  cycles[0]=hostCycles()-start;
+  return 1;
+}
+
+static void noInterrupt() {}
+
+static int measureRate() {
+  hostVaryPeriod=rateVary;
+  MotorDriver mainDriver(3, MAIN_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  MotorDriver progDriver(11, PROG_PIN, UNUSED_PIN, UNUSED_PIN, UNUSED_PIN, 2.99, 2000, UNUSED_PIN);
+  DCCWaveform::begin(&mainDriver, &progDriver);
+  // 256 packets, more than the count and the replays need
+  check(DCCWaveform::mainTrack.schedulePacket(ratePacket, sizeof(ONES), 255, PACKET_PRIORITY::SPEED, 0), "schedule");
+  Decoder decoder("MAIN", MAIN_PIN);
+  rateDecoder=&decoder;
+  while (!(decoder.poll() && decoder.is(ratePacket, sizeof(ONES)))) hostTimerInterrupt();
+
+  // from the end of one packet to the end of another
+  uint64_t cycles, empty;
+  hostReplay(countPackets, &cycles, 1, 1);
+  hostReplay(timeInterrupts, &cycles, 1, REPLAYS);
+  DCCTimer::begin(noInterrupt);
+  hostReplay(timeInterrupts, &empty, 1, REPLAYS);
+  cycles= cycles>empty ? cycles-empty : 0;
+  if (cycles<rateResult->cycles) rateResult->cycles=cycles;
+  return failures;
+}
+
+static void packetRates() {
+  double cyclesPerMicro=hostCyclesPerMicro();
+  static PacketRate * rates=(PacketRate *)hostShared(4*sizeof(PacketRate));
+  const byte * packets[2]={ONES, ZEROS};
+  const char * names[2]={"all ones ", "all zeros"};
+  const unsigned long expectedTicks[2]={2*49+4*4, 2*17+4*36};
+  for (byte r=0; r<4; r++) rates[r].cycles=UINT64_MAX;
+  for (byte round=0; round<ROUNDS; round++) {
+    for (byte r=0; r<4; r++) {
+      rateVary=r&1;
+      ratePacket=packets[r/2];
+      rateResult=&rates[r];
+      failures+=hostIsolated(measureRate);
+    }
+  }
+
+  double share[4];
+  for (byte r=0; r<4; r++) {
+    PacketRate & rate=rates[r];
+    byte p=r/2;
+    bool vary=r&1;
+    share[r]=100.0*rate.cycles/(rate.ticks*DCC_TICK_US*cyclesPerMicro);
+    printf("%s %-8s %6.1f interrupts/packet for %5.1f ticks, %5.1f host cycles/interrupt, %.4f%% host CPU\n",
+           names[p], vary ? "variable" : "fixed", (double)rate.interrupts/RATE_PACKETS,
+           (double)rate.ticks/RATE_PACKETS, (double)rate.cycles/rate.interrupts, share[r]);
+    check(rate.others==0, "only the packet sent over and over on the main track");
+    check(rate.ticks==expectedTicks[p]*RATE_PACKETS, "packet lasts its bits' ticks");
+    if (!vary) check(rate.interrupts==rate.ticks, "fixed period interrupts every tick");
+    // the main track has 2 edges a bit, and the prog track adds some of its own
+    else check(rate.interrupts>=2*53*RATE_PACKETS && rate.interrupts<=rates[r-1].interrupts,
+               "variable period interrupts at the edges, no more than the fixed");
+  }
+  printf("variable/fixed: all ones %.2f interrupts %.2f CPU, all zeros %.2f interrupts %.2f CPU\n",
+         (double)rates[1].interrupts/rates[0].interrupts, share[1]/share[0],
+         (double)rates[3].interrupts/rates[2].interrupts, share[3]/share[2]);
+  check(rates[3].interrupts*4<=rates[2].interrupts*3, "all zeros take at least a quarter fewer interrupts");
+  // The host has no cost for entering an interrupt, which is what fewer interrupts
+  // save on an Arduino, so here the variable period can only break about even.
+  checkTiming(share[3]<share[2]*1.5, "all zeros take less than half as much CPU again");
+  checkTiming(share[1]<share[0]*1.8, "all ones take less than 4/5 as much CPU again");
+}
+
+// Each fixed period interrupt timed alone, now and in BaselineWaveform, for 
+// the standard and the Pololu motor shield, with the main track sending a speed
+// packet as soon as the last has been taken. The standard shield's signal pins
+// share a port, as on an Uno or a Mega; the Pololu's are on two ports, as on 
+// an Uno. The cycles for each interrupt are the least of STEP_REPLAYS identical
+// runs, in each of ROUNDS turns taken by now and the baseline. The first 
+// COLD_STEPS of a replay find the host's caches cold after the fork, and are
+// not counted. A few host cycles either way are noise in a single interrupt,
+// so the mean is timed over all the interrupts at once, less the same loop 
+// with an empty interrupt. That loop's packets go with the interrupts, which 
+// puts the cost of queueing them, more now than in the baseline, on the mean.
+// The signal pin writes alone are timed SIGNAL_WRITES at a time.
+const unsigned long STEPS = 4000;
+const unsigned long COLD_STEPS = 16;
+const unsigned int STEP_REPLAYS = 15;
+const unsigned int SIGNAL_WRITES = 1000;
+const unsigned int SIGNAL_REPLAYS = 200;
+const byte SPEED[]={3, 0x3F, 0x85};
+
+struct InterruptWork {
+  uint64_t cycles[STEPS];   // least for each interrupt
+  uint64_t allCycles;       // least for all of them at once
+  uint64_t signalCycles;    // least for SIGNAL_WRITES writes of both tracks' signals
+  unsigned int packets;     // speed packets on the main track while warming up
+  unsigned int badPackets;
+  unsigned int progPackets; // reset packets on the prog track while warming up
+};
+
+static byte workShield;
+static bool workBaseline;
+static bool workFreeMemory=true;
+static InterruptWork * workResult;
+static uint64_t stepCycles[STEPS];
+static BaselineDriver * volatile baselineDrivers[2];   // volatile so the calls stay virtual
+
+// The shields as a sketch would name them
+static MotorDriver * shieldDrivers[2];
+static void shield(const FSH * name, MotorDriver * mainDriver, MotorDriver * progDriver) {
+  (void)name;
+  shieldDrivers[0]=mainDriver;
+  shieldDrivers[1]=progDriver;
+}
+
+static void feedMainTrack() {
+  if (workBaseline) BaselineWaveform::mainTrack.schedulePacket(SPEED, sizeof(SPEED), 0);
+  else if (!DCCWaveform::mainTrack.isPacketPending()) 
+    DCCWaveform::mainTrack.schedulePacket(SPEED, sizeof(SPEED), 0, PACKET_PRIORITY::SPEED, 0);
+}
+
+static unsigned long runSteps(uint64_t cycles[], unsigned long count) {
+  for (unsigned long i=0; i<count; i++) {
+    hostTimerInterrupt();
+    cycles[i]=hostInterruptCycles;
+    feedMainTrack();
+  }
+  return count;
+}
+
+static unsigned long timeSteps(uint64_t cycles[], unsigned long count) {
+  hostTimeInterrupts=false;
+  uint64_t start=hostCycles();
+  for (unsigned long i=0; i<STEPS; i++) {
+    hostTimerInterrupt();
+    feedMainTrack();
+  }
+  cycles[0]=hostCycles()-start;
+  return 1;
+}
+
+// Both tracks' signals as the interrupt writes them
+static void writeSignals() {
+  uint64_t start=hostCycles();
+  if (workBaseline) {
+    for (unsigned int i=0; i<SIGNAL_WRITES; i++) {
+      baselineDrivers[0]->setSignal(i & 1);
+      baselineDrivers[1]->setSignal(i & 2);
+    }
+  }
+  else {
+    for (unsigned int i=0; i<SIGNAL_WRITES; i++) MotorDriver::setSignals(i & 3);
+  }
+  uint64_t cycles=hostCycles()-start;
+  if (cycles<workResult->signalCycles) workResult->signalCycles=cycles;
+}
+
+static int measureWork() {
+  hostVaryPeriod=false;
+  if (workShield==0) shield(STANDARD_MOTOR_SHIELD);
+  else shield(POLOLU_MOTOR_SHIELD);
+  MotorDriver * mainDriver=shieldDrivers[0];
+  MotorDriver * progDriver=shieldDrivers[1];
+  BaselineDriver mainBaseline(mainDriver->getSignalPin(), mainDriver->getSignalPin2());
+  BaselineDriver progBaseline(progDriver->getSignalPin(), progDriver->getSignalPin2());
+  baselineDrivers[0]=&mainBaseline;
+  baselineDrivers[1]=&progBaseline;
+  BaselineWaveform::trackFreeMemory=workFreeMemory;
+  if (workBaseline) BaselineWaveform::begin(&mainBaseline, &progBaseline);
+  else {
+    DCCWaveform::begin(mainDriver, progDriver);
+    check(MotorDriver::slicedSignals, "signal pins in the signal port table");
+  }
+  // an idle packet goes first, then only speed packets
+  Decoder decoder("MAIN", mainDriver->getSignalPin());
+  Decoder progDecoder("PROG", progDriver->getSignalPin());
+  workResult->packets=0;
+  for (unsigned int i=0; i<STEPS; i++) {
+    hostTimerInterrupt();
+    feedMainTrack();
+    progDecoder.poll();
+    if (!decoder.poll() || decoder.packets==1) continue;
+    workResult->packets++;
+    if (!decoder.is(SPEED, sizeof(SPEED))) decoder.badPackets++;
+  }
+  workResult->badPackets=decoder.badPackets;
+  workResult->progPackets=progDecoder.packets;
+
+  hostReplay(runSteps, stepCycles, STEPS, STEP_REPLAYS);
+  for (unsigned long i=0; i<STEPS; i++) 
+    if (stepCycles[i]<workResult->cycles[i]) workResult->cycles[i]=stepCycles[i];
+  uint64_t all, empty;
+  hostReplay(timeSteps, &all, 1, STEP_REPLAYS);
+  DCCTimer::begin(noInterrupt);
+  hostReplay(timeSteps, &empty, 1, STEP_REPLAYS);
+  all= all>empty ? all-empty : 0;
+  if (all<workResult->allCycles) workResult->allCycles=all;
+  for (unsigned int r=0; r<SIGNAL_REPLAYS; r++) writeSignals();
+  return failures;
+}
+
+static int compareUint64(const void * a, const void * b) {
+  uint64_t x=*(const uint64_t *)a, y=*(const uint64_t *)b;
+  return x<y ? -1 : x>y;
+}
+
+struct WorkStats {
+  double mean;
+  uint64_t percentile99;
+  uint64_t worst;
+};
+
+static WorkStats workStats(InterruptWork & work) {
+  WorkStats stats;
+  uint64_t * warm=work.cycles+COLD_STEPS;
+  const unsigned long count=STEPS-COLD_STEPS;
+  qsort(warm, count, sizeof(warm[0]), compareUint64);
+  stats.mean=(double)work.allCycles/STEPS;
+  stats.percentile99=warm[count*99/100];
+  stats.worst=warm[count-1];
+  return stats;
+}
+
+static void interruptWork() {
+  // now and baseline for each shield
+  static InterruptWork * work=(InterruptWork *)hostShared(4*sizeof(InterruptWork));
+  for (byte w=0; w<4; w++) {
+    for (unsigned long i=0; i<STEPS; i++) work[w].cycles[i]=UINT64_MAX;
+    work[w].allCycles=UINT64_MAX;
+    work[w].signalCycles=UINT64_MAX;
+  }
+  for (byte round=0; round<ROUNDS; round++) {
+    for (byte w=0; w<4; w++) {
+      workShield=w/2;
+      workBaseline=w&1;
+      workResult=&work[w];
+      failures+=hostIsolated(measureWork);
+    }
+  }
+  const char * shields[2]={"STANDARD", "POLOLU"};
+  for (byte s=0; s<2; s++) {
+    WorkStats stats[2];
+    for (byte b=0; b<2; b++) {
+      InterruptWork & w=work[2*s+b];
+      stats[b]=workStats(w);
+      printf("%-8s fixed period interrupt %-8s mean %5.1f, 99%% %3lu, worst %3lu, signal writes %4.1f host cycles (%u packets, %u bad)\n",
+             shields[s], b ? "baseline" : "now", stats[b].mean, (unsigned long)stats[b].percentile99, 
+             (unsigned long)stats[b].worst, (double)w.signalCycles/SIGNAL_WRITES, w.packets, w.badPackets);
+      check(w.packets>=STEPS/160 && w.badPackets==0, "speed packets sent back to back");
+    }
+    checkTiming(stats[0].mean<=stats[1].mean*1.1, "the mean interrupt is no longer than it was");
+    checkTiming(stats[0].worst<=stats[1].worst*1.5, "the worst interrupt is not much longer than it was");
+    checkTiming(work[2*s].signalCycles<work[2*s+1].signalCycles, "the signal writes are shorter than they were");
+  }
+}
+
+// The baseline interrupt called updateMinimumFreeMemory on each preamble bit
+// of both tracks, where the stack painting now checks from loop(). Timed with
+// and without that call, on the STANDARD_MOTOR_SHIELD, taking turns 
+// 2*ROUNDS times. Each packet while warming up had one call per preamble bit and one 
+// for the end bit, which gives the calls in STEPS interrupts near enough.
+// That is a few cycles in each mean, about as much as the noise, so the call
+// is also timed alone, SIGNAL_WRITES at a time.
+static int timeFreeMemory() {
+  BaselineWaveform::begin(NULL, NULL);
+  uint64_t * least=&workResult->signalCycles;
+  for (unsigned int r=0; r<SIGNAL_REPLAYS; r++) {
+    uint64_t start=hostCycles();
+    BaselineWaveform::updateFreeMemory(SIGNAL_WRITES);
+    uint64_t cycles=hostCycles()-start;
+    if (cycles<*least) *least=cycles;
+  }
+  return 0;
+}
+
+static void freeMemoryWork() {
+  static InterruptWork * work=(InterruptWork *)hostShared(2*sizeof(InterruptWork));
+  for (byte w=0; w<2; w++) {
+    for (unsigned long i=0; i<STEPS; i++) work[w].cycles[i]=UINT64_MAX;
+    work[w].allCycles=UINT64_MAX;
+    work[w].signalCycles=UINT64_MAX;
+  }
+  workShield=0;
+  workBaseline=true;
+  for (byte round=0; round<2*ROUNDS; round++) {
+    for (byte w=0; w<2; w++) {
+      workFreeMemory= w==0;
+      workResult=&work[w];
+      failures+=hostIsolated(measureWork);
+    }
+  }
+  workFreeMemory=true;
+  for (byte round=0; round<ROUNDS; round++) hostIsolated(timeFreeMemory);
+  WorkStats stats[2];
+  for (byte w=0; w<2; w++) {
+    stats[w]=workStats(work[w]);
+    printf("baseline interrupt %-31s mean %5.1f, 99%% %3lu, worst %3lu host cycles\n",
+           w ? "without updateMinimumFreeMemory" : "with updateMinimumFreeMemory",
+           stats[w].mean, (unsigned long)stats[w].percentile99, (unsigned long)stats[w].worst);
+  }
+  unsigned long calls=work[0].packets*(PREAMBLE_BITS_MAIN+1UL) + work[0].progPackets*(PREAMBLE_BITS_PROG+1UL);
+  double callCycles=(double)work[0].signalCycles/SIGNAL_WRITES;
+  printf("about %lu calls in %lu interrupts, %.1f host cycles each alone, %.1f from the means\n", 
+         calls, STEPS, callCycles, (stats[0].mean-stats[1].mean)*STEPS/calls);
+  check(callCycles>=1, "updateMinimumFreeMemory takes some time");
+  checkTiming(stats[1].mean<=stats[0].mean, "the interrupt is no longer without updateMinimumFreeMemory");
+}
+
+int main() {
+  StringFormatter::diagSerial=NULL;
+  failures+=hostIsolated(decodeSignals);
+  timed(packetRates);
+  timed(interruptWork);
+  timed(freeMemoryWork);
+  return failures ? 1 : 0;
+}
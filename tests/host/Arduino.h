@@ -0,0 +1,148 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Arduino_h
+#define Arduino_h
+
+// Just enough of the Arduino core to build the portable parts of the command
+// station on the host for the tests. Time only moves when a test moves it,
+// and the ports are plain bytes.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper*)(s))
+#define PROGMEM
+#define pgm_read_byte_near(a) (*(const uint8_t*)(a))
+#define pgm_read_byte(a) (*(const uint8_t*)(a))
+#define pgm_read_word_near(a) (*(const uint16_t*)(a))
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define memcpy_P memcpy
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define NOT_A_PIN 0
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define F_CPU 16000000L
+
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define bitRead(v,b) (((v)>>(b))&1)
+#define bitSet(v,b) ((v)|=(1UL<<(b)))
+#define bitClear(v,b) ((v)&=~(1UL<<(b)))
+#define bitWrite(v,b,x) ((x)?bitSet(v,b):bitClear(v,b))
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+// Host clock, moved on by the tests
+extern unsigned long hostMicros;
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Pins: 8 to a port, ports are bytes in hostPorts
+const byte HOST_PORTS = 8;
+extern volatile uint8_t hostPorts[HOST_PORTS];
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+uint8_t digitalPinToPort(int pin);
+uint8_t digitalPinToBitMask(int pin);
+volatile uint8_t * portOutputRegister(uint8_t port);
+volatile uint8_t * portInputRegister(uint8_t port);
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+class Print {
+  public:
+    virtual size_t write(uint8_t c)=0;
+    virtual size_t write(const uint8_t * buffer, size_t size) {
+      size_t n=0;
+      while (size--) n+=write(*buffer++);
+      return n;
+    }
+    size_t write(const char * s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(const char * s) { return write(s); }
+    size_t print(const __FlashStringHelper * s) { return write((const char *)s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(long value, int base=10) { return printNumber(value, base); }
+    size_t print(int value, int base=10) { return printNumber(value, base); }
+    size_t print(unsigned long value, int base=10) { return printNumber(value, base); }
+    size_t print(unsigned int value, int base=10) { return printNumber(value, base); }
+    size_t print(unsigned char value, int base=10) { return printNumber(value, base); }
+    size_t print(double value, int digits=2) {
+      char buffer[32];
+      snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+      return write(buffer);
+    }
+    size_t println() { return write('\n'); }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+    virtual ~Print() {}
+  private:
+    size_t printNumber(long value, int base) {
+      char buffer[34];
+      snprintf(buffer, sizeof(buffer), base==16 ? "%lx" : "%ld", value);
+      return write(buffer);
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available()=0;
+    virtual int read()=0;
+    virtual int peek() { return -1; }
+};
+
+class HardwareSerial : public Stream {
+  public:
+    size_t write(uint8_t c) { return fputc(c, stdout)==EOF ? 0 : 1; }
+    using Print::write;
+    int available() { return 0; }
+    int read() { return -1; }
+    void begin(long) {}
+    operator bool() { return true; }
+};
+extern HardwareSerial Serial;
+
+#define BIN 2
+#define OCT 8
+#define DEC 10
+#define HEX 16
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+ #pragma GCC optimize ("-O3")
+#include <Arduino.h>
+#include "BaselineWaveform.h"
+#include "DCCTimer.h"
+
+// The free memory low water mark as updateMinimumFreeMemory kept it from the 
+// interrupt, with the heap top a page below the stack at begin().
+static volatile int minimum_free_memory = __INT_MAX__;
+static char * brkval = NULL;
+static char * heapStart = NULL;
+
+static inline int freeMemory() {
+  char top;
+  return brkval ? &top - brkval : &top - heapStart;
+}
+
+static void updateMinimumFreeMemory(unsigned char extraBytes) __attribute__((noinline));
+static void updateMinimumFreeMemory(unsigned char extraBytes) {
+  int spare = freeMemory()-extraBytes;
+  if (spare < 0) spare = 0;
+  if (spare < minimum_free_memory) minimum_free_memory = spare;
+}
+
+bool BaselineDriver::usePWM=false;
+
+BaselineDriver::BaselineDriver(byte signal_pin, byte signal_pin2) {
+  signalPin=signal_pin;
+  fastSignalPin.inout=portOutputRegister(digitalPinToPort(signalPin));
+  fastSignalPin.maskHIGH=digitalPinToBitMask(signalPin);
+  fastSignalPin.maskLOW=~fastSignalPin.maskHIGH;
+  dualSignal= signal_pin2!=UNUSED_PIN;
+  if (dualSignal) {
+    fastSignalPin2.inout=portOutputRegister(digitalPinToPort(signal_pin2));
+    fastSignalPin2.maskHIGH=digitalPinToBitMask(signal_pin2);
+    fastSignalPin2.maskLOW=~fastSignalPin2.maskHIGH;
+  }
+}
+
+#define setHIGH(fastpin)  *fastpin.inout |= fastpin.maskHIGH
+#define setLOW(fastpin)   *fastpin.inout &= fastpin.maskLOW
+
+void BaselineDriver::setSignal( bool high) {
+  if (signalPin == UNUSED_PIN) return;
+
+   if (usePWM) {
+    DCCTimer::setPWM(signalPin,high);
+   }
+   else {
+     if (high) {
+        setHIGH(fastSignalPin);
+        if (dualSignal) setLOW(fastSignalPin2);
+     }
+     else {
+        setLOW(fastSignalPin);
+        if (dualSignal) setHIGH(fastSignalPin2);
+     }
+   }
+}
+
+BaselineWaveform  BaselineWaveform::mainTrack(PREAMBLE_BITS_MAIN, true);
+BaselineWaveform  BaselineWaveform::progTrack(PREAMBLE_BITS_PROG, false);
+bool BaselineWaveform::progTrackSyncMain=false;
+bool BaselineWaveform::trackFreeMemory=true;
+
+const byte bitMask[] = {0x00, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+
+void BaselineWaveform::begin(BaselineDriver * mainDriver, BaselineDriver * progDriver) {
+  mainTrack.motorDriver=mainDriver;
+  progTrack.motorDriver=progDriver;
+  char here;
+  heapStart=(char *)((uintptr_t)&here-4096);
+  DCCTimer::begin(BaselineWaveform::interruptHandler);
+}
+
+BaselineWaveform::BaselineWaveform( byte preambleBits, bool isMain) {
+  isMainTrack = isMain;
+  packetPending = false;
+  memcpy(transmitPacket, idlePacket, sizeof(idlePacket));
+  state = WAVE_START;
+  requiredPreambles = preambleBits+1;
+  bytes_sent = 0;
+  bits_sent = 0;
+  sentResetsSincePacket = 0;
+  transmitLength = sizeof(idlePacket);
+  transmitRepeats = 0;
+  remainingPreambles = requiredPreambles;
+  ackPending=false;
+}
+
+void BaselineWaveform::interruptHandler() {
+  // call the timer edge sensitive actions for progtrack and maintrack
+  // member functions would be cleaner but have more overhead
+  byte sigMain=signalTransform[mainTrack.state];
+  byte sigProg=progTrackSyncMain? sigMain : signalTransform[progTrack.state];
+  
+  // Set the signal state for both tracks
+  mainTrack.motorDriver->setSignal(sigMain);
+  progTrack.motorDriver->setSignal(sigProg);
+  
+  // Move on in the state engine
+  mainTrack.state=stateTransform[mainTrack.state];    
+  progTrack.state=stateTransform[progTrack.state];    
+
+  // WAVE_PENDING means we dont yet know what the next bit is
+  if (mainTrack.state==WAVE_PENDING) mainTrack.interrupt2();  
+  if (progTrack.state==WAVE_PENDING) progTrack.interrupt2();
+  else if (progTrack.ackPending) progTrack.checkAck();
+}
+
+// For each state of the wave  nextState=stateTransform[currentState] 
+const WAVE_STATE BaselineWaveform::stateTransform[]={
+   /* WAVE_START   -> */ WAVE_PENDING,
+   /* WAVE_MID_1   -> */ WAVE_START,
+   /* WAVE_HIGH_0  -> */ WAVE_MID_0,
+   /* WAVE_MID_0   -> */ WAVE_LOW_0,
+   /* WAVE_LOW_0   -> */ WAVE_START,
+   /* WAVE_PENDING (should not happen) -> */ WAVE_PENDING};
+
+// For each state of the wave, signal pin is HIGH or LOW   
+const bool BaselineWaveform::signalTransform[]={
+   /* WAVE_START   -> */ HIGH,
+   /* WAVE_MID_1   -> */ LOW,
+   /* WAVE_HIGH_0  -> */ HIGH,
+   /* WAVE_MID_0   -> */ LOW,
+   /* WAVE_LOW_0   -> */ LOW,
+   /* WAVE_PENDING (should not happen) -> */ LOW};
+
+void BaselineWaveform::interrupt2() {
+  // calculate the next bit to be sent:
+  // set state WAVE_MID_1  for a 1=bit
+  //        or WAVE_HIGH_0 for a 0 bit.
+
+  if (remainingPreambles > 0 ) {
+    state=WAVE_MID_1;  // switch state to trigger LOW on next interrupt
+    remainingPreambles--;
+    // Update free memory diagnostic as we don't have anything else to do this time.
+    // Allow for checkAck and its called functions using 22 bytes more.
+    if (trackFreeMemory) updateMinimumFreeMemory(22); 
+    return;
+  }
+
+  // Wave has gone HIGH but what happens next depends on the bit to be transmitted
+  // beware OF 9-BIT MASK  generating a zero to start each byte
+  state=(transmitPacket[bytes_sent] & bitMask[bits_sent])? WAVE_MID_1 : WAVE_HIGH_0; 
+  bits_sent++;
+
+  // If this is the last bit of a byte, prepare for the next byte
+
+  if (bits_sent == 9) { // zero followed by 8 bits of a byte
+    //end of Byte
+    bits_sent = 0;
+    bytes_sent++;
+    // if this is the last byte, prepere for next packet
+    if (bytes_sent >= transmitLength) {
+      // end of transmission buffer... repeat or switch to next message
+      bytes_sent = 0;
+      remainingPreambles = requiredPreambles;
+
+      if (transmitRepeats > 0) {
+        transmitRepeats--;
+      }
+      else if (packetPending) {
+        // Copy pending packet to transmit packet
+        // a fixed length memcpy is faster than a variable length loop for these small lengths
+        memcpy( transmitPacket, pendingPacket, sizeof(pendingPacket));
+        
+        transmitLength = pendingLength;
+        transmitRepeats = pendingRepeats;
+        packetPending = false;
+        sentResetsSincePacket=0;
+      }
+      else {
+        // Fortunately reset and idle packets are the same length
+        memcpy( transmitPacket, isMainTrack ? idlePacket : resetPacket, sizeof(idlePacket));
+        transmitLength = sizeof(idlePacket);
+        transmitRepeats = 0;
+        if (sentResetsSincePacket<250) sentResetsSincePacket++;
+      }
+    }
+  }  
+}
+
+void BaselineWaveform::updateFreeMemory(unsigned int count) {
+  for (unsigned int i=0; i<count; i++) updateMinimumFreeMemory(22);
+}
+
+void BaselineWaveform::checkAck() {
+  ackPending=false;
+}
+
+bool BaselineWaveform::schedulePacket(const byte buffer[], byte byteCount, byte repeats) {
+  if (byteCount > MAX_PACKET_SIZE || packetPending) return false;
+
+  byte checksum = 0;
+  for (byte b = 0; b < byteCount; b++) {
+    checksum ^= buffer[b];
+    pendingPacket[b] = buffer[b];
+  }
+  // buffer is MAX_PACKET_SIZE but pendingPacket is one bigger
+  pendingPacket[byteCount] = checksum;
+  pendingLength = byteCount + 1;
+  pendingRepeats = repeats;
+  packetPending = true;
+  sentResetsSincePacket=0;
+  return true;
+}
@@ -0,0 +1,81 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef BaselineWaveform_h
+#define BaselineWaveform_h
+
+// The waveform interrupt as it was before the packet queue and wire images,
+// the inline signal writes and the stack painting, for the benchmarks to 
+// compare with. Only what the fixed period interrupt runs is kept: a virtual 
+// setSignal for each track, the 9 bit byte framing with a count of preambles,
+// updateMinimumFreeMemory on each preamble bit and the copy of the pending
+// packet at the end of each one. 
+
+#include <Arduino.h>
+#include "DCCWaveform.h"
+#include "MotorDriver.h"
+
+class BaselineDriver {
+  public:
+    BaselineDriver(byte signal_pin, byte signal_pin2);
+    virtual void setSignal( bool high);
+    static bool usePWM;
+  private:
+    byte signalPin;
+    FASTPIN fastSignalPin, fastSignalPin2;
+    bool dualSignal;       // true to use signalPin2
+};
+
+class BaselineWaveform {
+  public:
+    BaselineWaveform( byte preambleBits, bool isMain);
+    static void begin(BaselineDriver * mainDriver, BaselineDriver * progDriver);
+    static BaselineWaveform  mainTrack;
+    static BaselineWaveform  progTrack;
+    // Returns false while the last packet is still pending, where it used to wait
+    bool schedulePacket(const byte buffer[], byte byteCount, byte repeats);
+    volatile bool packetPending;
+    volatile byte sentResetsSincePacket;
+    static bool progTrackSyncMain;
+    static bool trackFreeMemory;   // false to leave out updateMinimumFreeMemory
+    static void updateFreeMemory(unsigned int count);   // as the interrupt does, count times
+    static void interruptHandler();
+
+  private:
+    static const WAVE_STATE stateTransform[6];
+    static const bool signalTransform[6];
+    void interrupt2();
+    void checkAck();
+
+    bool isMainTrack;
+    BaselineDriver*  motorDriver;
+    byte transmitPacket[MAX_PACKET_SIZE+1]; // +1 for checksum
+    byte transmitLength;
+    byte transmitRepeats;      // remaining repeats of transmission
+    byte remainingPreambles;
+    byte requiredPreambles;
+    byte bits_sent;           // 0-8 (yes 9 bits) sent for current byte
+    byte bytes_sent;          // number of bytes sent from transmitPacket
+    WAVE_STATE state;         // wave generator state machine
+    byte pendingPacket[MAX_PACKET_SIZE+1]; // +1 for checksum
+    byte pendingLength;
+    byte pendingRepeats;
+    volatile bool ackPending;
+};
+
+#endif
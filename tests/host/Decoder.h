@@ -0,0 +1,118 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Decoder_h
+#define Decoder_h
+
+// Decodes a signal pin as a loco decoder would, checking every half bit is 58
+// or 116uS. Call poll() after each timer interrupt.
+
+#include <Arduino.h>
+#include "DCCWaveform.h"
+#include "HostTimer.h"
+
+struct Decoder {
+  const char * name;
+  byte pin;
+  int level;
+  unsigned long lastEdge;
+  unsigned long firstHalf;    // of the bit being decoded, 0 when none
+  unsigned int halves;
+  unsigned int badHalves;
+  byte ones;                  // preamble bits seen
+  int bit;                    // -1 looking for the preamble, else bits of the byte so far
+  byte value;
+  byte packet[MAX_PACKET_SIZE+1];
+  byte length;
+  unsigned int packets;
+  unsigned int badPackets;
+  unsigned long packetStart;  // uS when the last packet's preamble began, ie the one before ended
+  unsigned long packetEnd;    // uS when the last packet ended
+
+  Decoder(const char * name, byte pin) {
+    memset(this, 0, sizeof(*this));
+    this->name=name;
+    this->pin=pin;
+    bit=-1;
+  }
+
+  // Returns true when a packet has just ended
+  bool poll() {
+    int newLevel=digitalRead(pin);
+    if (halves && newLevel==level) return false;
+    if (halves==0 && newLevel==LOW) return false;   // before the first rising edge
+    unsigned int before=packets;
+    edge(hostMicros, newLevel);
+    return packets!=before;
+  }
+
+  void edge(unsigned long now, int newLevel) {
+    unsigned long half=now-lastEdge;
+    lastEdge=now;
+    level=newLevel;
+    if (halves++==0) {   // first edge, nothing to time
+      firstHalf=0;
+      return;
+    }
+    if (half!=DCC_TICK_US && half!=2*DCC_TICK_US) badHalves++;
+    if (newLevel==LOW) {      // first half of a bit has ended
+      firstHalf=half;
+      return;
+    }
+    if (firstHalf==0) return;
+    if (firstHalf!=half) badHalves++;
+    addBit(half==DCC_TICK_US);
+    firstHalf=0;
+  }
+
+  void addBit(bool one) {
+    if (bit<0) {
+      if (one) ones++;
+      else if (ones>=10) { bit=0; length=0; value=0; }
+      else ones=0;
+      return;
+    }
+    if (bit<8) {
+      value=(value<<1) | one;
+      if (++bit<8) return;
+      if (length<sizeof(packet)) packet[length]=value;
+      length++;
+      return;
+    }
+    // the bit after a byte: 0 starts the next byte, 1 ends the packet
+    if (!one) { bit=0; value=0; return; }
+    endPacket();
+    bit=-1;
+    ones=1;   // the end bit counts towards the next preamble
+  }
+
+  void endPacket() {
+    packets++;
+    packetStart=packetEnd;
+    packetEnd=lastEdge;
+    byte checksum=0;
+    for (byte i=0; i<length && i<sizeof(packet); i++) checksum^=packet[i];
+    if (length<3 || length>sizeof(packet) || checksum!=0) badPackets++;
+  }
+
+  bool is(const byte expected[], byte expectedLength) {
+    return length==expectedLength+1 && memcmp(packet, expected, expectedLength)==0;
+  }
+};
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef EEPROM_h
+#define EEPROM_h
+
+// The EEPROM is a plain array on the host, blank at start
+
+#include <Arduino.h>
+
+class EEPROMClass {
+  public:
+    uint8_t read(int address) { return data[address]; }
+    void write(int address, uint8_t value) { data[address]=value; }
+    void update(int address, uint8_t value) { data[address]=value; }
+    template<typename T> T & get(int address, T & t) {
+      memcpy(&t, data+address, sizeof(T));
+      return t;
+    }
+    template<typename T> const T & put(int address, const T & t) {
+      memcpy(data+address, &t, sizeof(T));
+      return t;
+    }
+    uint16_t length() { return sizeof(data); }
+    uint8_t data[4096];
+};
+extern EEPROMClass EEPROM;
+
+#endif
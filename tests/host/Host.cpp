@@ -0,0 +1,208 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Host versions of the Arduino core and DCCTimer for the tests. The DCC
+// timer does not run by itself: a test calls hostTimerInterrupt() for each
+// tick, as the timer interrupt would every 58uS.
+
+#include <Arduino.h>
+#include "DCCTimer.h"
+#include "freeMemory.h"
+#include "HostTimer.h"
+#include "HostCycles.h"
+#include "LCDDisplay.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <time.h>
+
+// As the sketch has it with no display configured
+LCDDisplay * LCDDisplay::lcdDisplay=0;
+#include "LCD_NONE.h"
+
+HardwareSerial Serial;
+unsigned long hostMicros=0;
+volatile uint8_t hostPorts[HOST_PORTS];
+
+unsigned long millis() { return hostMicros/1000; }
+unsigned long micros() { return hostMicros; }
+void delay(unsigned long ms) { hostMicros+=ms*1000; }
+void delayMicroseconds(unsigned int us) { hostMicros+=us; }
+
+uint8_t digitalPinToPort(int pin) { return (pin/8) % HOST_PORTS; }
+uint8_t digitalPinToBitMask(int pin) { return 1 << (pin%8); }
+volatile uint8_t * portOutputRegister(uint8_t port) { return &hostPorts[port]; }
+volatile uint8_t * portInputRegister(uint8_t port) { return &hostPorts[port]; }
+void pinMode(int pin, int mode) { (void)pin; (void)mode; }
+void digitalWrite(int pin, int value) {
+  if (value) hostPorts[digitalPinToPort(pin)] |= digitalPinToBitMask(pin);
+  else hostPorts[digitalPinToPort(pin)] &= ~digitalPinToBitMask(pin);
+}
+int digitalRead(int pin) { return (hostPorts[digitalPinToPort(pin)] & digitalPinToBitMask(pin)) ? HIGH : LOW; }
+int analogRead(int pin) { (void)pin; return 0; }
+
+// The stack is not painted on the host
+void updateMinimumFreeMemory(unsigned char extraBytes) { (void)extraBytes; }
+int minimumFreeMemory() { return 0; }
+
+static INTERRUPT_CALLBACK timerCallback=NULL;
+unsigned long hostTimerTicks=0;
+bool hostVaryPeriod=false;
+uint64_t hostInterruptCycles=0;
+bool hostTimeInterrupts=true;
+static byte timerPeriod=1;
+
+// The period set by the last interrupt has run
+void hostTimerInterrupt() {
+  hostMicros+=DCC_TICK_US*timerPeriod;
+  hostTimerTicks+=timerPeriod;
+  if (!timerCallback) return;
+  if (!hostTimeInterrupts) {
+    timerCallback();
+    return;
+  }
+  static uint64_t overhead=hostCyclesOverhead();
+  uint64_t start=hostCycles();
+  timerCallback();
+  uint64_t cycles=hostCycles()-start;
+  hostInterruptCycles= cycles>overhead ? cycles-overhead : 0;
+}
+
+// A 58uS timer, with a variable period if the test asks, and none of the optional hardware
+void DCCTimer::begin(INTERRUPT_CALLBACK interrupt) { timerCallback=interrupt; }
+bool DCCTimer::canVaryPeriod() { return hostVaryPeriod; }
+void DCCTimer::setPeriod(byte ticks) { timerPeriod=ticks; }
+bool DCCTimer::canShift(byte mainPin, byte progPin) { (void)mainPin; (void)progPin; return false; }
+void DCCTimer::beginShift(INTERRUPT_CALLBACK callback) { (void)callback; }
+void DCCTimer::shift(byte mainSlots, byte progSlots) { (void)mainSlots; (void)progSlots; }
+bool DCCTimer::beginADC(const byte pins[], byte count, ADC_CALLBACK callback) {
+  (void)pins; (void)count; (void)callback;
+  return false;
+}
+bool DCCTimer::attachPinChange(byte pin, INTERRUPT_CALLBACK callback) { (void)pin; (void)callback; return false; }
+void DCCTimer::getSimulatedMacAddress(byte mac[6]) { memset(mac, 0xBE, 6); }
+bool DCCTimer::isPWMPin(byte pin) { (void)pin; return false; }
+void DCCTimer::setPWM(byte pin, bool high) { (void)pin; (void)high; }
+
+uint64_t hostCyclesOverhead() {
+  uint64_t least=UINT64_MAX;
+  for (int i=0; i<1000; i++) {
+    uint64_t start=hostCycles();
+    uint64_t cycles=hostCycles()-start;
+    if (cycles<least) least=cycles;
+  }
+  return least;
+}
+
+static uint64_t nanoseconds() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+double hostCyclesPerMicro() {
+  uint64_t startNs=nanoseconds();
+  uint64_t start=hostCycles();
+  while (nanoseconds()-startNs < 20000000ULL) {}   // 20mS
+  return (hostCycles()-start)*1000.0/(nanoseconds()-startNs);
+}
+
+void * hostShared(size_t bytes) {
+  void * memory=mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (memory==MAP_FAILED) {
+    perror("mmap");
+    exit(2);
+  }
+  return memory;
+}
+
+// Waits for a child process and returns its exit status
+static int child(pid_t pid) {
+  if (pid<0) {
+    perror("fork");
+    exit(2);
+  }
+  int status=0;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status)) {
+    printf("FAIL: child process died\n");
+    return 2;
+  }
+  return WEXITSTATUS(status);
+}
+
+// A child process shares its parent's pages until it writes to them, then 
+// takes its own copy, and maps code pages only as it first runs them. Either
+// would be timed in the first step to touch each page, so all the pages are
+// touched first.
+static void __attribute__((noinline)) ownPages(uint64_t cycles[], unsigned long count) {
+  const size_t PAGE=4096;
+  FILE * maps=fopen("/proc/self/maps", "r");
+  char line[512];
+  while (maps && fgets(line, sizeof(line), maps)) {
+    unsigned long start, end;
+    char perms[5];
+    if (sscanf(line, "%lx-%lx %4s", &start, &end, perms)!=3) continue;
+    if (perms[0]!='r' || strstr(line, "[v")) continue;   // not vvar or vsyscall
+    for (unsigned long a=start; a<end; a+=PAGE) {
+      volatile char * p=(volatile char *)a;
+      if (perms[1]=='w') *p=*p;
+      else (void)*p;
+    }
+  }
+  if (maps) fclose(maps);
+  volatile char stack[64*1024];
+  for (size_t i=0; i<sizeof(stack); i+=PAGE) stack[i]=0;
+  memset(cycles, 0, count*sizeof(cycles[0]));
+}
+
+unsigned long hostReplay(HOST_RUN run, uint64_t cycles[], unsigned long count, unsigned int runs) {
+  size_t bytes=sizeof(unsigned long)+runs*count*sizeof(uint64_t);
+  unsigned long * steps=(unsigned long *)hostShared(bytes);
+  uint64_t * runCycles=(uint64_t *)(steps+1);
+  for (unsigned int r=0; r<runs; r++) {
+    fflush(stdout);
+    pid_t pid=fork();
+    if (pid==0) {
+      ownPages(runCycles+r*count, count);
+      *steps=run(runCycles+r*count, count);
+      _exit(0);
+    }
+    if (child(pid)) exit(2);
+  }
+  unsigned long made=*steps;
+  for (unsigned long i=0; i<made; i++) {
+    uint64_t least=UINT64_MAX;
+    for (unsigned int r=0; r<runs; r++) if (runCycles[r*count+i]<least) least=runCycles[r*count+i];
+    cycles[i]=least;
+  }
+  munmap(steps, bytes);
+  return made;
+}
+
+int hostIsolated(int (*test)()) {
+  fflush(stdout);
+  pid_t pid=fork();
+  if (pid==0) {
+    int result=test();
+    fflush(stdout);
+    _exit(result);
+  }
+  return child(pid);
+}
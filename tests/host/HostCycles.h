@@ -0,0 +1,67 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HostCycles_h
+#define HostCycles_h
+
+// The host processor's cycle counter for the benchmarks. Host cycles compare 
+// one way of doing something with another on the same machine, they are not
+// the time an Arduino would take.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+inline uint64_t hostCycles() {
+  _mm_lfence();
+  uint64_t t=__rdtsc();
+  _mm_lfence();
+  return t;
+}
+#else
+#include <time.h>
+inline uint64_t hostCycles() {   // nanoseconds where there is no cycle counter
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+#endif
+
+// Least cycles a measurement of nothing takes, to take off each measurement
+uint64_t hostCyclesOverhead();
+// Host cycles in a microsecond, found against the host clock
+double hostCyclesPerMicro();
+
+// A run of count steps that puts the cycles each took in cycles[]. It may stop
+// early, and returns the steps it made.
+typedef unsigned long (*HOST_RUN)(uint64_t cycles[], unsigned long count);
+
+// Makes the same run several times, each in a child process that starts from
+// the state at the call, and leaves in cycles[] the least that each step took
+// in any run. The least of identical runs drops the host's own interrupts and
+// cache misses. Returns the steps made.
+unsigned long hostReplay(HOST_RUN run, uint64_t cycles[], unsigned long count, unsigned int runs);
+
+// Memory shared with child processes, for results. 
+void * hostShared(size_t bytes);
+// Runs test() in a child process, so that what it sets up is gone after. 
+// Returns what test() returned.
+int hostIsolated(int (*test)());
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// What DCC needs from the rest of the sketch on the host: EEStore keeps its
+// place in a blank EEPROM but stores no turnouts, sensors or outputs.
+
+#include <Arduino.h>
+#include "EEStore.h"
+
+EEPROMClass EEPROM;
+EEStore * EEStore::eeStore=NULL;
+int EEStore::eeAddress=0;
+
+void EEStore::init() { reset(); }
+void EEStore::reset() { eeAddress=sizeof(EEStoreData); }
+int EEStore::pointer() { return eeAddress; }
+void EEStore::advance(int n) { eeAddress+=n; }
+void EEStore::store() { reset(); }
+void EEStore::clear() { memset(EEPROM.data, 0, EEPROM.length()); }
+void EEStore::dump(int num) { (void)num; }
@@ -0,0 +1,33 @@
+/*
+ *  © 2021, ralfoide
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HostTimer_h
+#define HostTimer_h
+
+#include <stdint.h>
+
+const unsigned long DCC_TICK_US = 58;
+
+// Runs the DCC timer interrupt once, one period after the last
+void hostTimerInterrupt();
+extern unsigned long hostTimerTicks;   // 58uS ticks so far
+extern bool hostVaryPeriod;            // set before DCCWaveform::begin for the variable period
+extern uint64_t hostInterruptCycles;   // host cycles the last interrupt took, see HostCycles.h
+extern bool hostTimeInterrupts;        // false leaves hostInterruptCycles alone, to time many at once
+
+#endif